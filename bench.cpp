@@ -0,0 +1,439 @@
+// Wall-clock microbenchmarks of the parts of myprog that do the work.
+//
+// The RAM-model operation counts in the .ops files say how much work
+// an algorithm does, not how long it takes. This program times the
+// components one by one on generated texts:
+// 1) bit_ofstream::putbit and bit_ifstream::getbit
+// 2) UTF-8 conversion in ucs4_ifstream and ucs4_ofstream
+// 3) IEncoder::FillFrequencyTable
+// 4) EncodeHuffman::BuildTree and EncodeShannon::BuildTree
+// 5) Decoder::TransformDecode
+// 6) IEncoder::GenerateCodes, IEncoder::WriteTree, Decoder::ReadTree
+//    and the release of the tree, on a chain as deep as its alphabet
+//    and on the EncodeShannon tree of Zipf counts
+// 7) PackJob::Pack of small documents of one vocabulary, the pack
+//    must come out smaller than the archives of the documents
+//
+// Texts are made like gen_file.py makes them: random symbols of one
+// of its three charsets up to the given size in bytes. Each case is
+// run a few times untimed (warmup), then timed repeatedly. The
+// median gives MB/s of text and ns per text symbol, the min, max and
+// relative standard deviation show how stable the timing is. The
+// tree cases report per leaf, MB/s of the UTF-8 of the alphabet.
+//
+// Usage: bench [-w warmup_runs] [-r timed_runs] [-f name_filter] [-d leaves] [-t dir]
+//
+// The scratch files go to -t dir, else to $TMPDIR, else to /tmp.
+//
+// Build with "make bench", the binary is placed next to myprog. It is
+// built like myprog-fast, without the operation counting.
+
+// main.cpp is compiled in as a whole, without its main()
+#define MYPROG_NO_MAIN
+#include "main.cpp"
+
+#include <chrono>
+#include <random>
+#include <functional>
+#include <iomanip>
+#include <cstdio>
+
+using std::cout;
+using std::endl;
+
+
+//=============================================================================
+// Open up the protected parts that are timed.
+class BenchHuffman : public EncodeHuffman
+{
+    public:
+        using IEncoder::FillFrequencyTable;
+        using IEncoder::table;
+};
+
+class BenchShannon : public EncodeShannon
+{
+    public:
+        using IEncoder::table;
+        using IEncoder::root;
+        using IEncoder::GenerateCodes;
+        using IEncoder::WriteTree;
+};
+
+class BenchDecoder : public Decoder
+{
+    public:
+        using Decoder::code2ch;
+        using Decoder::ReadTree;
+        using Decoder::ReadLengths;
+        using Decoder::TransformDecode;
+};
+
+
+//=============================================================================
+// One generated text, kept both as a file and in memory.
+struct Sample
+{
+    string name;
+    string fname;
+    string utf8;
+    vector<char32_t> symbols;
+};
+
+//=============================================================================
+class Bench
+{
+    public:
+        Bench(int warmup, int runs, const string& filter)
+            : warmup(warmup), runs(runs), filter(filter) {}
+
+        // same charsets as gen_file.py
+        static vector<string> Charsets()
+        {
+            string set1 = "ABCDEFGHIJKLMNOPQRSTUVWXYZ abcdefghijklmnopqrstuvwxyz";
+            string set2 = set1 + "АаБбВвГгДдЕеЁёЖжЗзИиЙйКкЛлМмНнОоПпРрСсТтУуФфХхЦцЧчШшЩщЪъЫыЬьЭэЮюЯя";
+            string set3 = set2 + "+-*/=.,;:?!%@#$&~()[]{}<>\"\'";
+            return vector<string>{set1, set2, set3};
+        }
+
+        // random symbols of the charset until size bytes, like gen_file.py
+        static Sample MakeSample(size_t size, size_t charset, const string& dir)
+        {
+            wstring_convert<std::codecvt_utf8<char32_t>, char32_t> conv{};
+            std::u32string chars = conv.from_bytes(Charsets()[charset]);
+            std::mt19937 rng(size * 3 + charset);
+            std::uniform_int_distribution<size_t> pick(0, chars.size() - 1);
+            Sample s;
+            s.name = std::to_string(size / 1024) + "K/set" + std::to_string(charset);
+            while (s.utf8.size() < size) {
+                char32_t ch = chars[pick(rng)];
+                s.symbols.push_back(ch);
+                s.utf8 += conv.to_bytes(ch);
+            }
+            s.fname = dir + "/bench-" + std::to_string(size) + "-" + std::to_string(charset) + ".txt";
+            ofstream out{s.fname, ios::binary | ios::out};
+            out.write(s.utf8.data(), s.utf8.size());
+            return s;
+        }
+
+        // n code points from 0x100 up, past the surrogates
+        static Sample MakeAlphabet(size_t n, const string& shape)
+        {
+            wstring_convert<std::codecvt_utf8<char32_t>, char32_t> conv{};
+            Sample s;
+            s.name = std::to_string(n / 1000) + "K/" + shape;
+            for (size_t i=0; i<n; i++) {
+                char32_t ch = 0x100 + i;
+                if (ch >= 0xD800) {
+                    ch += 0x800;
+                }
+                s.symbols.push_back(ch);
+                s.utf8 += conv.to_bytes(ch);
+            }
+            return s;
+        }
+
+        // Documents of the same few hundred words, each written to a
+        // file of dir. The returned sample is all of them.
+        static Sample MakeDocs(size_t count, size_t words, const string& dir, vector<string>& fnames)
+        {
+            wstring_convert<std::codecvt_utf8<char32_t>, char32_t> conv{};
+            std::mt19937 rng(count * 7 + words);
+            std::uniform_int_distribution<int> letter('a', 'z');
+            std::uniform_int_distribution<size_t> length(2, 9);
+            vector<string> vocabulary(300);
+            for (auto& word : vocabulary) {
+                for (size_t n = length(rng); n > 0; n--) {
+                    word += static_cast<char>(letter(rng));
+                }
+            }
+            std::uniform_int_distribution<size_t> pick(0, vocabulary.size() - 1);
+            Sample all;
+            all.name = std::to_string(count) + "docs";
+            fnames.clear();
+            for (size_t d=0; d<count; d++) {
+                string doc;
+                for (size_t i=0; i<words; i++) {
+                    doc += vocabulary[pick(rng)];
+                    doc += (i % 12 == 11) ? '\n' : ' ';
+                }
+                fnames.push_back(dir + "/bench-doc-" + std::to_string(d) + ".txt");
+                ofstream out{fnames.back(), ios::binary | ios::out};
+                out.write(doc.data(), doc.size());
+                all.utf8 += doc;
+            }
+            std::u32string symbols = conv.from_bytes(all.utf8);
+            all.symbols.assign(symbols.begin(), symbols.end());
+            return all;
+        }
+
+        static uint64_t FileBytes(const string& fname)
+        {
+            ifstream in{fname, ios::binary | ios::ate};
+            return in ? static_cast<uint64_t>(in.tellg()) : 0;
+        }
+
+        // every internal node has a leaf on the left, n-1 levels
+        static NodePtr MakeChain(const vector<char32_t>& symbols)
+        {
+            NodePtr node{new LeafNode{1, symbols.back()}};
+            for (size_t i=symbols.size()-1; i-- > 0; ) {
+                node = NodePtr{new InternalNode{NodePtr{new LeafNode{1, symbols[i]}}, node}};
+            }
+            return node;
+        }
+
+        // setup is not timed, work is
+        void Run(const string& component, const Sample& s,
+                std::function<void()> setup, std::function<void()> work)
+        {
+            if (! filter.empty() && component.find(filter) == string::npos) {
+                return;
+            }
+            for (int i=0; i<warmup; i++) {
+                setup();
+                work();
+            }
+            vector<double> ns;
+            for (int i=0; i<runs; i++) {
+                setup();
+                auto start = std::chrono::steady_clock::now();
+                work();
+                auto stop = std::chrono::steady_clock::now();
+                ns.push_back(std::chrono::duration<double, std::nano>(stop - start).count());
+            }
+            Report(component, s, ns);
+        }
+
+        static void Header()
+        {
+            cout << std::left << std::setw(22) << "component" << std::setw(12) << "text"
+                 << std::right << std::setw(10) << "MB/s" << std::setw(12) << "ns/symbol"
+                 << std::setw(12) << "min" << std::setw(12) << "max" << std::setw(8) << "rsd%" << endl;
+        }
+
+    protected:
+        int warmup;
+        int runs;
+        string filter;
+
+        void Report(const string& component, const Sample& s, vector<double> ns)
+        {
+            std::sort(ns.begin(), ns.end());
+            double median = ns[ns.size() / 2];
+            double mean = 0;
+            for (const auto& t : ns) {
+                mean += t;
+            }
+            mean /= ns.size();
+            double var = 0;
+            for (const auto& t : ns) {
+                var += (t - mean) * (t - mean);
+            }
+            double rsd = (mean > 0) ? 100 * std::sqrt(var / ns.size()) / mean : 0;
+            double n = s.symbols.size();
+            cout << std::left << std::setw(22) << component << std::setw(12) << s.name
+                 << std::right << std::fixed << std::setprecision(1)
+                 << std::setw(10) << s.utf8.size() / (median / 1e9) / (1 << 20)
+                 << std::setprecision(2)
+                 << std::setw(12) << median / n
+                 << std::setw(12) << ns.front() / n
+                 << std::setw(12) << ns.back() / n
+                 << std::setprecision(1) << std::setw(8) << rsd << endl;
+        }
+};
+
+
+//=============================================================================
+int main(int argc, char **argv)
+{
+    ArgParser input(argc, argv);
+    if (input.option_exists("-h")) {
+        cout << "Usage: bench [-w warmup_runs] [-r timed_runs] [-f name_filter] [-d leaves] [-t dir]" << endl;
+        return -1;
+    }
+    string w = input.get_option_value("-w");
+    string r = input.get_option_value("-r");
+    string d = input.get_option_value("-d");
+    int warmup = w.empty() ? 2 : std::atoi(w.c_str());
+    int runs = r.empty() ? 9 : std::max(1, std::atoi(r.c_str()));
+    size_t leaves = d.empty() ? 100000 : std::max(2, std::atoi(d.c_str()));
+    Bench bench{warmup, runs, input.get_option_value("-f")};
+
+    string dir = input.get_option_value("-t");
+    if (dir.empty()) {
+        const char* tmpdir = std::getenv("TMPDIR");
+        dir = (tmpdir != nullptr && *tmpdir != '\0') ? tmpdir : "/tmp";
+    }
+    string bits = dir + "/bench-bits.bin";
+    string coded = dir + "/bench-coded.bin";
+    string text = dir + "/bench-out.txt";
+    string tree = dir + "/bench-tree.bin";
+    vector<size_t> sizes{64 * 1024, 1024 * 1024, 4 * 1024 * 1024};
+
+    Bench::Header();
+    for (const auto& size : sizes) {
+        for (size_t charset=0; charset<Bench::Charsets().size(); charset++) {
+            Sample s = Bench::MakeSample(size, charset, dir);
+            string fname = s.fname;
+
+            // every bit of the UTF-8 text, one putbit call each
+            bench.Run("putbit", s, []{}, [&]{
+                bit_ofstream out{bits};
+                for (const auto& c : s.utf8) {
+                    for (int i=7; i>=0; i--) {
+                        out.putbit((c >> i) & 1);
+                    }
+                }
+                out.stop_writing();
+            });
+            bench.Run("getbit", s, []{}, [&]{
+                bit_ifstream in{bits};
+                bool bit = false;
+                while (in.getbit(bit).good()) {
+                }
+            });
+
+            bench.Run("utf8-decode", s, []{}, [&]{
+                ucs4_ifstream in{fname};
+                char32_t ch;
+                while (in.get(ch).good()) {
+                }
+            });
+            bench.Run("utf8-encode", s, []{}, [&]{
+                ucs4_ofstream out{text};
+                for (const auto& ch : s.symbols) {
+                    out << ch;
+                }
+            });
+
+            BenchHuffman huffman{};
+            bench.Run("FillFrequencyTable", s, [&]{ huffman.table.clear(); }, [&]{
+                ucs4_ifstream in{fname};
+                huffman.FillFrequencyTable(in);
+            });
+            // the table of this text is left in huffman.table, also
+            // when -f left the run out
+            if (huffman.table.empty()) {
+                ucs4_ifstream in{fname};
+                huffman.FillFrequencyTable(in);
+            }
+            BenchShannon shannon{};
+            shannon.table = huffman.table;
+            bench.Run("Huffman::BuildTree", s, []{}, [&]{ huffman.BuildTree(); });
+            bench.Run("Shannon::BuildTree", s, []{}, [&]{ shannon.BuildTree(); });
+
+            // the text coded with the huffman tree
+            {
+                ucs4_ifstream in{fname};
+                bit_ofstream out{coded};
+                EncodeHuffman enc{};
+                enc.Encode(in, out);
+                out.stop_writing();
+            }
+            bench.Run("TransformDecode", s, []{}, [&]{
+                bit_ifstream in{coded};
+                ucs4_ofstream out{text};
+                BenchDecoder dec{};
+                if (in.method() == METHOD::lengths) {
+                    dec.ReadLengths(in);
+                } else {
+                    dec.ReadTree(in);
+                }
+                dec.TransformDecode(in, out);
+            });
+            std::remove(fname.c_str());
+        }
+    }
+
+    // trees of leaves symbols: a chain as deep as the alphabet and
+    // the tree EncodeShannon makes of Zipf counts
+    for (const string shape : {"chain", "zipf"}) {
+        Sample s = Bench::MakeAlphabet(leaves, shape);
+        BenchShannon enc{};
+        for (size_t i=0; i<leaves; i++) {
+            enc.table[s.symbols[i]] = UINT64_C(1000000000000) / (i + 1);
+        }
+        auto build = [&]{
+            if (shape == "chain") {
+                enc.root = Bench::MakeChain(s.symbols);
+            } else {
+                enc.BuildTree();
+            }
+        };
+        build();
+        if (shape == "zipf") {
+            bench.Run("Shannon::BuildTree", s, []{}, [&]{ enc.BuildTree(); });
+        }
+        bench.Run("GenerateCodes", s, []{}, [&]{ enc.GenerateCodes(); });
+        bench.Run("WriteTree", s, []{}, [&]{
+            bit_ofstream out{tree};
+            enc.WriteTree(out);
+            out.stop_writing();
+        });
+        {
+            bit_ofstream out{tree};
+            enc.WriteTree(out);
+            out.stop_writing();
+        }
+        BenchDecoder dec{};
+        bench.Run("ReadTree", s, [&]{ dec.code2ch.clear(); }, [&]{
+            bit_ifstream in{tree};
+            dec.ReadTree(in);
+        });
+        // the tree read back gives the codes it was written with
+        dec.code2ch.clear();
+        bit_ifstream in{tree};
+        dec.ReadTree(in);
+        enc.GenerateCodes();
+        for (const auto& entry : enc.Codes()) {
+            uint32_t node = 0;
+            for (const auto& bit : enc.Codes().Code(entry.first)) {
+                node = dec.code2ch.Next(node, bit);
+                if (node == 0) {
+                    break;
+                }
+            }
+            if (node == 0 || ! dec.code2ch.Leaf(node) || dec.code2ch.Symbol(node) != entry.first
+                    || dec.code2ch.size() != enc.Codes().size()) {
+                cout << "ReadTree of the " << shape << " tree gave other codes" << endl;
+                return 1;
+            }
+        }
+        bench.Run("~InternalNode", s, build, [&]{ enc.root.reset(); });
+    }
+
+    // small documents of one vocabulary share their tree in a pack,
+    // which must then beat the archives of the documents one by one
+    {
+        vector<string> docs;
+        Sample s = Bench::MakeDocs(30, 1000, dir, docs);
+        string pack = dir + "/bench-docs.pack";
+        JobOptions opt{};
+        opt.has_algo = true;
+        std::ostringstream log;
+        PackJob packer{};
+        bench.Run("pack", s, []{}, [&]{ packer.Pack(pack, docs, opt, log); });
+        packer.Pack(pack, docs, opt, log);
+        uint64_t packed = Bench::FileBytes(pack);
+        uint64_t separate = 0;
+        FileJob job{};
+        for (const auto& doc : docs) {
+            job.Run(doc, opt, log);
+            separate += Bench::FileBytes(job.output);
+            std::remove(job.output.c_str());
+            std::remove(doc.c_str());
+        }
+        std::remove(pack.c_str());
+        if (packed >= separate) {
+            cout << "pack of " << docs.size() << " documents is " << packed
+                 << " bytes, their archives " << separate << " bytes" << endl;
+            return 1;
+        }
+    }
+    std::remove(bits.c_str());
+    std::remove(coded.c_str());
+    std::remove(text.c_str());
+    std::remove(tree.c_str());
+    return 0;
+}
@@ -0,0 +1,572 @@
+// Benchmark inputs of any size, written at disk speed.
+//
+// gen_file.py picks every symbol with random.choice, which takes
+// minutes past a few MiB, and only makes uniform texts. This program
+// writes the same kind of files and more:
+// 1) the charsets of gen_file.py (0, 1, 2), the third one with astral
+//    plane symbols added (3), a large alphabet of CJK ideographs from
+//    the BMP and the astral plane (4), or code point ranges given in hex
+// 2) symbols drawn uniformly (like gen_file.py), by a Zipf law, by a
+//    geometric law, or in Fibonacci counts: the histogram that gives a
+//    Huffman tree its greatest depth
+// 3) Markov chain text: every symbol has a few likely successors
+//
+// The files are named like gen_file.py names them, so collect_data.py
+// finds them: size-<bytes>_charset-<n>_sample-<k>.txt. As there, a file
+// holds whole symbols until it reaches the size, the last one may run
+// over by up to 3 bytes. Every file has its own seed made from --seed,
+// the size, the charset and the sample, so any file can be made again
+// alone.
+//
+// Usage: gen_corpus [-o dir] [-s sizes] [-c charsets] [-n samples]
+//                   [-d distribution] [--seed n]
+//   sizes         comma separated, with K, M or G suffixes ("20K,1M,4G")
+//   charsets      comma separated, 0..4 or n=range+range... where a
+//                 range is hex code points ("7=41-5A+1F600-1F64F")
+//   distribution  uniform, zipf[:s], geometric[:p], fibonacci or
+//                 markov[:s]; s is the Zipf exponent, p the chance of
+//                 the first symbol
+// The defaults make the gen_file.py set: ./inputs, its sizes,
+// charsets 0,1,2, 5 samples, uniform symbols.
+//
+// Build with "make gen_corpus", the binary is placed next to myprog.
+
+// main.cpp is compiled in as a whole, without its main()
+#define MYPROG_NO_MAIN
+#include "main.cpp"
+
+#include <random>
+#include <cstdio>
+#include <cstring>
+
+using std::cout;
+using std::cerr;
+using std::endl;
+
+
+//=============================================================================
+// The code points of a charset, in the order gen_file.py lists them
+class Charset
+{
+    public:
+        // the sets of gen_file.py and the two with astral symbols
+        static vector<char32_t> BuiltIn(int n)
+        {
+            string set1 = "ABCDEFGHIJKLMNOPQRSTUVWXYZ abcdefghijklmnopqrstuvwxyz";
+            string set2 = set1 + "АаБбВвГгДдЕеЁёЖжЗзИиЙйКкЛлМмНнОоПпРрСсТтУуФфХхЦцЧчШшЩщЪъЫыЬьЭэЮюЯя";
+            string set3 = set2 + "+-*/=.,;:?!%@#$&~()[]{}<>\"\'";
+            wstring_convert<std::codecvt_utf8<char32_t>, char32_t> conv{};
+            switch (n) {
+                case 0: return Of(conv.from_bytes(set1));
+                case 1: return Of(conv.from_bytes(set2));
+                case 2: return Of(conv.from_bytes(set3));
+                case 3: {
+                    // emoji and mathematical letters, 4 bytes each
+                    vector<char32_t> chars = Of(conv.from_bytes(set3));
+                    AddRange(chars, 0x1F600, 0x1F64F);
+                    AddRange(chars, 0x1D400, 0x1D433);
+                    return chars;
+                }
+                case 4: {
+                    // CJK Unified Ideographs and Extension B
+                    vector<char32_t> chars;
+                    AddRange(chars, 0x4E00, 0x9FFF);
+                    AddRange(chars, 0x20000, 0x2A6DF);
+                    return chars;
+                }
+            }
+            throw runtime_error("No charset " + std::to_string(n) + ".");
+        }
+
+        // "41-5A+1F600-1F64F+20", hex code points
+        static vector<char32_t> Ranges(const string& spec)
+        {
+            vector<char32_t> chars;
+            std::stringstream ss{spec};
+            string range;
+            while (std::getline(ss, range, '+')) {
+                size_t dash = range.find('-');
+                char32_t first = Hex(range.substr(0, dash));
+                char32_t last = (dash == string::npos) ? first : Hex(range.substr(dash + 1));
+                if (last < first) {
+                    throw runtime_error("Bad range " + range + ".");
+                }
+                AddRange(chars, first, last);
+            }
+            if (chars.empty()) {
+                throw runtime_error("Empty charset.");
+            }
+            return chars;
+        }
+
+    private:
+        static vector<char32_t> Of(const std::u32string& text)
+        {
+            return vector<char32_t>(text.begin(), text.end());
+        }
+
+        // surrogates are not characters and are left out
+        static void AddRange(vector<char32_t>& chars, char32_t first, char32_t last)
+        {
+            for (char32_t ch=first; ch<=last; ch++) {
+                if (ch < 0xD800 || ch > 0xDFFF) {
+                    chars.push_back(ch);
+                }
+            }
+        }
+
+        static char32_t Hex(const string& text)
+        {
+            if (text.empty() || text.find_first_not_of("0123456789abcdefABCDEF") != string::npos) {
+                throw runtime_error("Bad code point " + text + ".");
+            }
+            unsigned long value = std::strtoul(text.c_str(), nullptr, 16);
+            if (value > 0x10FFFF) {
+                throw runtime_error("Bad code point " + text + ".");
+            }
+            return static_cast<char32_t>(value);
+        }
+};
+
+//=============================================================================
+// Draws indexes 0..n-1 by fixed weights in constant time (Vose's alias method)
+class AliasTable
+{
+    public:
+        explicit AliasTable(const vector<double>& weights)
+            : alias(weights.size()), threshold(weights.size())
+        {
+            double total = 0;
+            for (const auto& w : weights) {
+                total += w;
+            }
+            size_t n = weights.size();
+            vector<double> scaled(n), chance(n, 1);
+            vector<uint32_t> small, large;
+            for (size_t i=0; i<n; i++) {
+                scaled[i] = weights[i] * n / total;
+                (scaled[i] < 1 ? small : large).push_back(i);
+            }
+            while (! small.empty() && ! large.empty()) {
+                uint32_t s = small.back();
+                small.pop_back();
+                uint32_t l = large.back();
+                chance[s] = scaled[s];
+                alias[s] = l;
+                scaled[l] -= 1 - scaled[s];
+                if (scaled[l] < 1) {
+                    large.pop_back();
+                    small.push_back(l);
+                }
+            }
+            // what is left is 1 up to rounding and keeps its chance of 1
+            for (size_t i=0; i<n; i++) {
+                if (chance[i] >= 1) {
+                    alias[i] = i;
+                    threshold[i] = UINT32_MAX;
+                } else {
+                    threshold[i] = static_cast<uint32_t>(chance[i] * 4294967296.0);
+                }
+            }
+        }
+
+        // the upper half of one 64 bit number picks the column,
+        // the lower half the side of it
+        uint32_t Draw(std::mt19937_64& rng) const
+        {
+            uint64_t r = rng();
+            uint32_t i = ((r >> 32) * alias.size()) >> 32;
+            return static_cast<uint32_t>(r) < threshold[i] ? i : alias[i];
+        }
+
+    private:
+        vector<uint32_t> alias;
+        vector<uint32_t> threshold;
+};
+
+//=============================================================================
+// Exact counts drawn in random order without replacement, a Fenwick
+// tree of the counts left finds the symbol of a random position
+class CountedDraw
+{
+    public:
+        explicit CountedDraw(const vector<uint64_t>& counts)
+            : tree(counts.size() + 1, 0)
+        {
+            for (size_t i=0; i<counts.size(); i++) {
+                Add(i, counts[i]);
+                left += counts[i];
+            }
+            top = 1;
+            while (top * 2 <= counts.size()) {
+                top *= 2;
+            }
+        }
+
+        bool empty() const {
+            return left == 0;
+        }
+
+        uint32_t Draw(std::mt19937_64& rng)
+        {
+            std::uniform_int_distribution<uint64_t> position(0, left - 1);
+            uint64_t r = position(rng);
+            size_t i = 0;
+            for (size_t step=top; step>0; step/=2) {
+                if (i + step < tree.size() && tree[i + step] <= r) {
+                    i += step;
+                    r -= tree[i];
+                }
+            }
+            Add(i, -1);
+            left--;
+            return i;
+        }
+
+    private:
+        vector<uint64_t> tree;
+        uint64_t left = 0;
+        size_t top = 1;
+
+        void Add(size_t i, int64_t delta)
+        {
+            for (i++; i<tree.size(); i+=i&(~i+1)) {
+                tree[i] += delta;
+            }
+        }
+};
+
+//=============================================================================
+enum class DIST
+{
+    uniform,
+    zipf,
+    geometric,
+    fibonacci,
+    markov
+};
+
+struct Distribution
+{
+    DIST kind = DIST::uniform;
+    // the Zipf exponent or the chance of the first symbol
+    double param = 0;
+
+    // "zipf:1.2", "geometric", ...
+    static Distribution Parse(const string& text)
+    {
+        size_t colon = text.find(':');
+        string name = text.substr(0, colon);
+        Distribution d;
+        if (name == "uniform") {
+            d.kind = DIST::uniform;
+        } else if (name == "zipf") {
+            d.kind = DIST::zipf;
+            d.param = 1.0;
+        } else if (name == "geometric") {
+            d.kind = DIST::geometric;
+            d.param = 0.1;
+        } else if (name == "fibonacci") {
+            d.kind = DIST::fibonacci;
+        } else if (name == "markov") {
+            d.kind = DIST::markov;
+            d.param = 1.0;
+        } else {
+            throw runtime_error("No distribution " + name + ".");
+        }
+        if (colon != string::npos) {
+            d.param = std::atof(text.c_str() + colon + 1);
+        }
+        if ((d.kind == DIST::zipf || d.kind == DIST::markov) && d.param <= 0) {
+            throw runtime_error("The Zipf exponent must be positive.");
+        }
+        if (d.kind == DIST::geometric && (d.param <= 0 || d.param >= 1)) {
+            throw runtime_error("The geometric chance must be in (0, 1).");
+        }
+        return d;
+    }
+};
+
+//=============================================================================
+// Writes one file: symbols of the charset until size bytes
+class Generator
+{
+    public:
+        // successors of a symbol in markov text, and the chance of
+        // any symbol instead, so that every symbol keeps turning up
+        static const size_t fanout = 8;
+        static constexpr double escape = 1.0 / 16;
+
+        Generator(const vector<char32_t>& charset, const Distribution& dist, uint64_t seed)
+            : chars(charset), dist(dist), rng(seed)
+        {
+            // the ranks of the symbols are a random order of the charset
+            std::shuffle(chars.begin(), chars.end(), rng);
+            for (const auto& ch : chars) {
+                utf8.push_back(Utf8::Of(ch));
+            }
+        }
+
+        void Write(const string& fname, uint64_t size)
+        {
+            FILE* out = std::fopen(fname.c_str(), "wb");
+            if (out == nullptr) {
+                throw runtime_error("Could not open " + fname + ".");
+            }
+            bytes = 0;
+            Fill(size, out);
+            Flush(out);
+            if (std::fclose(out) != 0) {
+                throw runtime_error("Could not write " + fname + ".");
+            }
+        }
+
+    protected:
+        vector<char32_t> chars;
+        Distribution dist;
+        std::mt19937_64 rng;
+
+        // a symbol's UTF-8 bytes, copied as 4 bytes at once
+        struct Utf8
+        {
+            char bytes[4];
+            uint32_t len;
+
+            static Utf8 Of(char32_t ch)
+            {
+                Utf8 u{{0, 0, 0, 0}, static_cast<uint32_t>(utf8_length(ch))};
+                if (u.len == 1) {
+                    u.bytes[0] = static_cast<char>(ch);
+                    return u;
+                }
+                // the lead byte has len high bits set, the others 10xxxxxx
+                for (uint32_t i=u.len-1; i>0; i--) {
+                    u.bytes[i] = static_cast<char>(0x80 | (ch & 0x3F));
+                    ch >>= 6;
+                }
+                u.bytes[0] = static_cast<char>((0xF00 >> u.len) | ch);
+                return u;
+            }
+        };
+        vector<Utf8> utf8;
+        // UTF-8 bytes written so far and the ones not written yet
+        uint64_t bytes = 0;
+        vector<char> pending = vector<char>(chunk + 4);
+        size_t used = 0;
+
+        static const size_t chunk = 1 << 20;
+
+        void Fill(uint64_t size, FILE* out)
+        {
+            switch (dist.kind) {
+                case DIST::uniform:
+                    FillDrawn(AliasTable{vector<double>(chars.size(), 1.0)}, size, out);
+                    return;
+                case DIST::zipf:
+                    FillDrawn(AliasTable{Zipf(chars.size(), dist.param)}, size, out);
+                    return;
+                case DIST::geometric: {
+                    vector<double> weights(chars.size());
+                    double w = 1;
+                    for (auto& x : weights) {
+                        x = w;
+                        // far symbols are not drawn anyway, keep them above 0
+                        w = std::max(w * (1 - dist.param), 1e-300);
+                    }
+                    FillDrawn(AliasTable{weights}, size, out);
+                    return;
+                }
+                case DIST::fibonacci:
+                    FillFibonacci(size, out);
+                    return;
+                case DIST::markov:
+                    FillMarkov(size, out);
+                    return;
+            }
+        }
+
+        static vector<double> Zipf(size_t n, double s)
+        {
+            vector<double> weights(n);
+            for (size_t k=0; k<n; k++) {
+                weights[k] = 1.0 / std::pow(k + 1, s);
+            }
+            return weights;
+        }
+
+        void FillDrawn(const AliasTable& table, uint64_t size, FILE* out)
+        {
+            while (bytes < size) {
+                Put(table.Draw(rng), out);
+            }
+        }
+
+        // Counts 1, 1, 2, 3, 5... for as many symbols as fit, all scaled
+        // by the same factor to reach the size. Every symbol then merges
+        // with the tree of all more frequent ones, one level deeper each.
+        void FillFibonacci(uint64_t size, FILE* out)
+        {
+            vector<uint64_t> counts;
+            uint64_t a = 1, b = 1, pattern = 0;
+            while (counts.size() < chars.size()) {
+                uint64_t more = a * utf8_length(chars[counts.size()]);
+                if (! counts.empty() && pattern + more > size) {
+                    break;
+                }
+                pattern += more;
+                counts.push_back(a);
+                uint64_t next = a + b;
+                a = b;
+                b = next;
+            }
+            // the most frequent symbols first in the charset order
+            std::reverse(counts.begin(), counts.end());
+            uint64_t scale = std::max<uint64_t>(1, size / std::max<uint64_t>(1, pattern));
+            for (auto& c : counts) {
+                c *= scale;
+            }
+            // what the scaled counts leave goes to the most frequent
+            // symbol, it is the last one merged in any case
+            if (size > pattern * scale) {
+                counts[0] += (size - pattern * scale) / utf8_length(chars[0]) + 1;
+            }
+            CountedDraw draw{counts};
+            while (bytes < size && ! draw.empty()) {
+                Put(draw.Draw(rng), out);
+            }
+        }
+
+        // Every symbol has fanout successors, picked at random, with Zipf
+        // weights. With the escape chance the next one is drawn from
+        // the Zipf law of the whole charset instead.
+        void FillMarkov(uint64_t size, FILE* out)
+        {
+            size_t n = chars.size();
+            size_t k = std::min(fanout, n);
+            AliasTable any{Zipf(n, dist.param)};
+            AliasTable near{Zipf(k, dist.param)};
+            vector<uint32_t> next(n * k);
+            std::uniform_int_distribution<uint32_t> pick(0, n - 1);
+            for (auto& x : next) {
+                x = pick(rng);
+            }
+            uint32_t state = any.Draw(rng);
+            while (bytes < size) {
+                Put(state, out);
+                if (rng() < static_cast<uint64_t>(escape * 18446744073709551616.0)) {
+                    state = any.Draw(rng);
+                } else {
+                    state = next[state * k + near.Draw(rng)];
+                }
+            }
+        }
+
+        // the symbol of rank i
+        void Put(uint32_t i, FILE* out)
+        {
+            const Utf8& u = utf8[i];
+            std::memcpy(pending.data() + used, u.bytes, 4);
+            used += u.len;
+            bytes += u.len;
+            if (used >= chunk) {
+                Flush(out);
+            }
+        }
+
+        void Flush(FILE* out)
+        {
+            if (std::fwrite(pending.data(), 1, used, out) != used) {
+                throw runtime_error("Could not write the file.");
+            }
+            used = 0;
+        }
+};
+
+const size_t Generator::fanout;
+const size_t Generator::chunk;
+constexpr double Generator::escape;
+
+//=============================================================================
+// splitmix64 of the seed and the file's name parts, so that nearby
+// seeds do not give related files
+static uint64_t FileSeed(uint64_t seed, uint64_t size, uint64_t charset, uint64_t sample)
+{
+    uint64_t x = seed;
+    for (uint64_t part : {size, charset, sample}) {
+        x += part + 0x9E3779B97F4A7C15ull;
+        x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+        x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+        x ^= x >> 31;
+    }
+    return x;
+}
+
+static vector<string> Split(const string& text)
+{
+    vector<string> items;
+    std::stringstream ss{text};
+    string item;
+    while (std::getline(ss, item, ',')) {
+        if (! item.empty()) {
+            items.push_back(item);
+        }
+    }
+    return items;
+}
+
+
+//=============================================================================
+int main(int argc, char **argv)
+{
+    ArgParser input(argc, argv);
+    if (input.option_exists("-h")) {
+        cout << "Usage: gen_corpus [-o dir] [-s sizes] [-c charsets] [-n samples]" << endl
+             << "                  [-d uniform|zipf[:s]|geometric[:p]|fibonacci|markov[:s]] [--seed n]" << endl;
+        return -1;
+    }
+    string dir = input.get_option_value("-o");
+    string s = input.get_option_value("-s");
+    string c = input.get_option_value("-c");
+    string n = input.get_option_value("-n");
+    string d = input.get_option_value("-d");
+    string seed = input.get_option_value("--seed");
+    dir = dir.empty() ? "./inputs" : dir;
+    s = s.empty() ? "20K,40K,60K,80K,100K,1M,2M,3M" : s;
+    c = c.empty() ? "0,1,2" : c;
+    int samples = n.empty() ? 5 : std::atoi(n.c_str());
+    try {
+        Distribution dist = Distribution::Parse(d.empty() ? "uniform" : d);
+        vector<uint64_t> sizes;
+        for (const auto& item : Split(s)) {
+            uint64_t size = MemoryBudget::Parse(item);
+            if (size == 0) {
+                throw runtime_error("Bad size " + item + ".");
+            }
+            sizes.push_back(size);
+        }
+        vector<std::pair<int, vector<char32_t>>> charsets;
+        for (const auto& item : Split(c)) {
+            size_t eq = item.find('=');
+            int id = std::atoi(item.substr(0, eq).c_str());
+            charsets.push_back(std::make_pair(id, (eq == string::npos)
+                        ? Charset::BuiltIn(id) : Charset::Ranges(item.substr(eq + 1))));
+        }
+        uint64_t base = seed.empty() ? 0 : std::strtoull(seed.c_str(), nullptr, 10);
+        for (const auto& size : sizes) {
+            for (const auto& charset : charsets) {
+                for (int sample=0; sample<samples; sample++) {
+                    string fname = dir + "/size-" + std::to_string(size)
+                        + "_charset-" + std::to_string(charset.first)
+                        + "_sample-" + std::to_string(sample) + ".txt";
+                    Generator gen{charset.second, dist, FileSeed(base, size, charset.first, sample)};
+                    gen.Write(fname, size);
+                    cout << fname << endl;
+                }
+            }
+        }
+    } catch (const std::exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,200 @@
+// Latency of the jobs of "myprog serve".
+//
+// Every connection sends the same request as soon as the reply to the
+// last one has come, until all the requests are sent. The time of every
+// request is taken from before it is sent to after its reply is read,
+// so it holds the job and everything around it: the socket, the worker
+// and, for inline requests, the copies of the text and the output.
+//
+// Usage: loadgen --socket path -i file [-c connections] [-n requests]
+//                [-w warmup] [--inline] [-a huffman|shennon|auto]
+//                [-o 0|1] [-t none|bwt|lz77|words]
+//   file         a .txt file is encoded, anything else is decoded; the
+//                path is sent unless --inline sends the file itself
+//   connections  open at once (4 with --inline, else 1); requests by
+//                path need -c 1, as the jobs of several would write one
+//                output file together
+//   requests     timed requests over all connections (1000)
+//   warmup       requests per connection before the timing starts (10)
+// Prints the requests per second and the 50th, 90th, 99th percentile
+// and the longest latency. The server writes the outputs of requests
+// by path next to their files, as myprog would, so those are timed one
+// connection at a time.
+//
+// Build with "make loadgen", the binary is placed next to myprog.
+
+// main.cpp is compiled in as a whole, without its main()
+#define MYPROG_NO_MAIN
+#include "main.cpp"
+
+#include <cstdio>
+
+using std::cout;
+using std::cerr;
+using std::endl;
+
+
+//=============================================================================
+// Latencies in microseconds, the percentiles of them
+class Latencies
+{
+    public:
+        void Add(const vector<double>& more)
+        {
+            all.insert(all.end(), more.begin(), more.end());
+        }
+
+        size_t Count() const
+        {
+            return all.size();
+        }
+
+        // the nearest rank of p percent
+        double Percentile(double p)
+        {
+            if (all.empty()) {
+                return 0;
+            }
+            std::sort(all.begin(), all.end());
+            size_t rank = static_cast<size_t>(std::ceil(p / 100.0 * all.size()));
+            return all[std::max<size_t>(1, rank) - 1];
+        }
+
+    private:
+        vector<double> all;
+};
+
+//=============================================================================
+static ServeProtocol::Request MakeRequest(const ArgParser& input, const string& infile)
+{
+    ServeProtocol::Request req{};
+    const string alg = input.get_option_value("-a");
+    req.opt.has_algo = ! alg.empty();
+    if (alg.compare("shennon") == 0) {
+        req.opt.algo = ALGORITHM::shennon;
+    } else if (alg.compare("auto") == 0) {
+        req.opt.algo = ALGORITHM::automatic;
+    } else if (! alg.empty() && alg.compare("huffman") != 0) {
+        throw runtime_error("Bad algorithm " + alg + ".");
+    }
+    req.opt.order = (input.get_option_value("-o").compare("1") == 0) ? 1 : 0;
+    const string trn = input.get_option_value("-t");
+    if (trn.compare("bwt") == 0) {
+        req.opt.transform = TRANSFORM::bwt;
+    } else if (trn.compare("lz77") == 0) {
+        req.opt.transform = TRANSFORM::lz77;
+    } else if (trn.compare("words") == 0) {
+        req.opt.transform = TRANSFORM::words;
+    } else if (! trn.empty() && trn.compare("none") != 0) {
+        throw runtime_error("Bad transform " + trn + ".");
+    }
+    req.inline_data = input.option_exists("--inline");
+    req.path = infile;
+    if (req.inline_data) {
+        ifstream in{infile, ios::binary | ios::ate};
+        if (! in) {
+            throw runtime_error("Could not open " + infile);
+        }
+        req.payload.resize(static_cast<uint64_t>(in.tellg()));
+        in.seekg(0, ios::beg);
+        in.read(&req.payload[0], req.payload.size());
+    } else {
+        // the server has a directory of its own
+        std::unique_ptr<char, decltype(&free)> full{realpath(infile.c_str(), nullptr), &free};
+        if (! full) {
+            throw runtime_error("Could not open " + infile);
+        }
+        req.path = full.get();
+    }
+    return req;
+}
+
+//=============================================================================
+int main(int argc, char **argv)
+{
+    ArgParser input(argc, argv);
+    const string socket_path = input.get_option_value("--socket");
+    const string infile = input.get_option_value("-i");
+    if (input.option_exists("-h") || socket_path.empty() || infile.empty()) {
+        cout << "Usage: loadgen --socket path -i file [-c connections] [-n requests] [-w warmup]" << endl
+             << "               [--inline] [-a huffman|shennon|auto] [-o 0|1] [-t none|bwt|lz77|words]" << endl;
+        return -1;
+    }
+    const string c = input.get_option_value("-c");
+    const string n = input.get_option_value("-n");
+    const string w = input.get_option_value("-w");
+    bool inline_data = input.option_exists("--inline");
+    size_t connections = c.empty() ? (inline_data ? 4 : 1) : std::strtoull(c.c_str(), nullptr, 10);
+    size_t requests = n.empty() ? 1000 : std::strtoull(n.c_str(), nullptr, 10);
+    size_t warmup = w.empty() ? 10 : std::strtoull(w.c_str(), nullptr, 10);
+    if (connections == 0 || requests == 0) {
+        cerr << "Bad number of connections or requests." << endl;
+        return -1;
+    }
+    if (connections > 1 && ! inline_data) {
+        cerr << "Requests by path share their output and run one at a time, use --inline with -c " << connections << "." << endl;
+        return -1;
+    }
+    try {
+        const ServeProtocol::Request req = MakeRequest(input, infile);
+        std::atomic<size_t> next{0};
+        std::atomic<size_t> failed{0};
+        std::mutex mutex;
+        string first_error;
+        Latencies latencies;
+        auto run = [&]() {
+            vector<double> mine;
+            try {
+                ServeClient conn{socket_path};
+                for (size_t i=0; i<warmup; i++) {
+                    conn.Call(req);
+                }
+                for (size_t i = next++; i < requests; i = next++) {
+                    auto start = std::chrono::steady_clock::now();
+                    ServeProtocol::Reply rep = conn.Call(req);
+                    mine.push_back(std::chrono::duration<double, std::micro>(
+                                std::chrono::steady_clock::now() - start).count());
+                    if (! rep.ok) {
+                        failed++;
+                        std::lock_guard<std::mutex> lock(mutex);
+                        if (first_error.empty()) {
+                            first_error = rep.log;
+                        }
+                    }
+                }
+            } catch(const std::exception& e) {
+                failed++;
+                std::lock_guard<std::mutex> lock(mutex);
+                if (first_error.empty()) {
+                    first_error = string(e.what()) + "\n";
+                }
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            latencies.Add(mine);
+        };
+        auto start = std::chrono::steady_clock::now();
+        vector<std::thread> pool;
+        for (size_t i=0; i<connections; i++) {
+            pool.emplace_back(run);
+        }
+        for (auto& t : pool) {
+            t.join();
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        cout << latencies.Count() << " requests on " << connections << " connections, "
+             << failed << " failed" << endl;
+        if (! first_error.empty()) {
+            cout << first_error;
+        }
+        cout << std::fixed << std::setprecision(1)
+             << latencies.Count() / seconds << " requests/s" << endl
+             << "p50 " << latencies.Percentile(50) << " us" << endl
+             << "p90 " << latencies.Percentile(90) << " us" << endl
+             << "p99 " << latencies.Percentile(99) << " us" << endl
+             << "max " << latencies.Percentile(100) << " us" << endl;
+        return failed > 0 ? -1 : 0;
+    } catch(const std::exception& e) {
+        cerr << e.what() << endl;
+        return -1;
+    }
+}
@@ -25,6 +25,85 @@
 // 8) The two encoders are split into separate classes
 // 9) Based on input file and algorithm flag
 //    output file gets correctly named.
+// 10) Order-1 context model (-o 1): one code tree per
+//    previous symbol, rare contexts share a fallback tree.
+// 11) Block transform (-t bwt): Burrows-Wheeler transform
+//    by suffix array (SA-IS), move-to-front and zero run
+//    length coding in front of the entropy coder.
+// 12) LZ77 front end (-t lz77): hash chain match finder,
+//    deflate style length/distance codes coded with
+//    separate literal+length and distance trees.
+// 13) Automatic selection (-a auto): every coder, with any
+//    transform and order, writes the archive in turn and the
+//    smallest is kept. The method is kept in the header, so
+//    any archive decodes without -a.
+// 14) Stored and run-length fallbacks: a file (or a bwt/lz77
+//    block) that would not shrink is stored as is, a single
+//    repeated symbol is written as runs.
+// 15) Block index with CRC32C checksums of the coded bytes
+//    and of the decoded text of every block, checked when
+//    decoding; --test checks an archive without decoding it.
+//    An archive of one block keeps the checksums and varint
+//    sizes only. A failed encode leaves no archive, one
+//    without its index does not decode.
+// 16) Seek table (-s N): a restart point every N symbols (every
+//    block for bwt/lz77), --range start:len decodes only that
+//    slice starting from the nearest restart point.
+// 17) Wall-clock microbenchmarks of the components in
+//    bench.cpp, built with "make bench".
+// 18) --profile prints wall time and hardware counters
+//    (perf_event_open) for every stage of the run.
+// 19) "make" also builds myprog-fast, the same program with
+//    the operation counting compiled out (no .ops files).
+// 20) Batch mode: "program batch [options] files..." (or the
+//    file names on stdin) runs a pool of -j worker threads.
+// 21) Multi-file archives: "program pack" codes files as members
+//    of one archive, each with a tree of its own or one tree of
+//    all of them, whichever is smaller; "program unpack [-m N]"
+//    decodes all or one, "program list". A name keeps only what
+//    it does not share with the name before, the block index
+//    holds varint sizes, so small members pay little for both.
+// 22) --max-memory N[K|M|G] bounds the working memory: bwt and
+//    lz77 blocks are sized to fit it, order 1 and words fall back
+//    to order 0 past it, the peak is reported.
+// 23) The archive records the symbols, the UTF-8 bytes and the
+//    coded bits of the text: the output is allocated at once and
+//    most codes are read without checking for the end of data.
+// 24) Files are read ahead and written behind in chunks by
+//    io_uring (or a helper thread where there is none) while
+//    the current chunk is coded.
+// 25) Order 0 texts of code points below 0x100 or 0x10000 are
+//    coded with flat tables of uint8_t or uint16_t symbols, built
+//    from the same tree.
+// 26) Order 0 archives keep code lengths instead of the tree when
+//    that is smaller: the symbol set as an ASCII bitmap and gaps,
+//    the lengths coded with a code of their own.
+// 27) Benchmark inputs of any size and symbol distribution are made
+//    by gen_corpus.cpp, built with "make gen_corpus".
+// 28) --alloc counts heap allocations, bytes and the peak heap per
+//    stage, written with the peak resident size to a .mem file
+//    next to the .ops file. The peaks are left out when several
+//    workers share the process.
+// 29) --sample N[K|M|G] codes order 0 in one pass with the tree
+//    of N bytes read in windows over the file; symbols it missed
+//    are escaped. The loss against the exact tree is reported.
+// 30) A bwt or lz77 block whose symbols code smaller with the trees
+//    of the last coded block repeats them instead of its own.
+// 31) The code trees are built, walked, written and read with
+//    explicit stacks, so a tree as deep as its alphabet fits. The
+//    codes are kept as trees of nodes, a leaf linked to its parent
+//    for the encoder and a node array walked a bit at a time for the
+//    decoder, and Shannon splits its leaves by their prefix sums:
+//    every walk is O(1) a node, a chain of n leaves O(n).
+// 32) -t words codes the words and the runs between them as symbols
+//    (method 9), with a dictionary of the repeated tokens in the
+//    header and the rest spelled after an escape code.
+// 33) "program serve --socket path" takes jobs over a Unix socket
+//    on a pool of -j workers, "program client" sends one, the text
+//    or archive inline or by path. loadgen.cpp ("make loadgen")
+//    reports the latency percentiles of many. Jobs by path that share
+//    a file run one at a time; --max-frame (256M by default) caps
+//    the messages either side reads.
 //
 // What is NOT done:
 // 0) Nothing, everything should work
@@ -39,18 +118,52 @@
 #include <string>
 #include <iostream>
 #include <vector>
+#include <array>
 #include <algorithm>
 #include <memory>
 #include <fstream>
 #include <sstream>
 #include <map>
+#include <unordered_map>
 #include <stdexcept>
 #include <utility>
 #include <queue>
+#include <functional>
 #include <iterator>
+#include <cstddef>
 #include <cstdint>
+#include <cstdlib>
+#include <cmath>
 #include <codecvt>
 #include <locale>
+#include <chrono>
+#include <iomanip>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <set>
+#include <thread>
+#include <atomic>
+#include <limits>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#endif
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <csignal>
+#include <cerrno>
+#include <cstring>
+#include <malloc.h>
+#include <new>
 
 
 using std::uint64_t;
@@ -84,20 +197,548 @@ using std::runtime_error;
 
 
 //=============================================================================
+// Stages of encoding and decoding. Operations are counted per stage,
+// --profile also reports time and hardware counters for each.
+enum class STAGE : uint8_t
+{
+    histogram,
+    tree_build,
+    code_gen,
+    tree_write,
+    transform,
+    tree_read,
+    decode,
+    count       // also the slot of operations outside any stage
+};
+
+// the stages as reports name them, "other" is outside any stage
+const char* const stage_names[] = {
+    "histogram", "tree build", "code gen", "tree write",
+    "transform", "tree read", "decode", "other"};
+
+//=============================================================================
+// Operations are counted according to the RAM model. Building with
+// -DMYPROG_NO_OPS (the myprog-fast target) turns add() into an empty
+// inline function, the compiler then drops the counting altogether.
+//
+// Every thread counts into its own slot, a cache line of its own, so
+// threads neither race nor share lines. The totals are summed over
+// the slots, read them once the counting threads are done.
 class OpsCounter
 {
     public:
-        uint64_t operations = 0;
+        static const int stages = static_cast<int>(STAGE::count) + 1;
+
+        struct alignas(64) Slot
+        {
+            uint64_t stage_ops[stages];
+            int stage;
+        };
 
+#ifdef MYPROG_NO_OPS
+        void add(int64_t) {}
+        int enter(STAGE) { return 0; }
+        void leave(int) {}
+#else
         void add(int64_t new_ops) {
-            operations += new_ops;
+            Slot* slot = local();
+            slot->stage_ops[slot->stage] += new_ops;
+        }
+
+        // count into stage from now on, returns the stage to go back to
+        int enter(STAGE stage) {
+            Slot* slot = local();
+            int outer = slot->stage;
+            slot->stage = static_cast<int>(stage);
+            return outer;
+        }
+
+        void leave(int outer) {
+            local()->stage = outer;
+        }
+#endif
+
+        // all threads, all stages
+        uint64_t total() const {
+            uint64_t sum = 0;
+            for (int s=0; s<stages; s++) {
+                sum += stage_total(s);
+            }
+            return sum;
+        }
+
+        // all threads, one stage (STAGE::count is outside any stage)
+        uint64_t stage_total(int stage) const {
+            std::lock_guard<std::mutex> lock(mutex);
+            uint64_t sum = 0;
+            for (const auto& slot : slots) {
+                sum += slot->stage_ops[stage];
+            }
+            return sum;
+        }
+
+        // one total per thread that has counted anything
+        vector<uint64_t> thread_totals() const {
+            std::lock_guard<std::mutex> lock(mutex);
+            vector<uint64_t> sums;
+            for (const auto& slot : slots) {
+                uint64_t sum = 0;
+                for (int s=0; s<stages; s++) {
+                    sum += slot->stage_ops[s];
+                }
+                sums.push_back(sum);
+            }
+            return sums;
+        }
+
+        // the calling thread, all stages
+        uint64_t thread_total() {
+            uint64_t sum = 0;
+            for (int s=0; s<stages; s++) {
+                sum += local()->stage_ops[s];
+            }
+            return sum;
         }
 
         void reset() {
-            operations = 0;
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto& slot : slots) {
+                std::fill(slot->stage_ops, slot->stage_ops + stages, 0);
+            }
+        }
+
+        // the count goes to fname.ops, the fast build has none to write
+        void write(const string& fname, uint64_t operations) const {
+#ifndef MYPROG_NO_OPS
+            ofstream result{fname + ".ops"};
+            result << operations << endl;
+            result.close();
+#else
+            (void) fname;
+            (void) operations;
+#endif
+        }
+
+        void write(const string& fname) const {
+            write(fname, total());
+        }
+
+    protected:
+        mutable std::mutex mutex{};
+        vector<Slot*> slots{};
+        // owns the slots, over-allocated as new does not align to 64 here
+        vector<std::unique_ptr<char[]>> memory{};
+
+        Slot* local() {
+            static thread_local Slot* slot = nullptr;
+            if (slot == nullptr) {
+                slot = Register();
+            }
+            return slot;
+        }
+
+        Slot* Register() {
+            std::lock_guard<std::mutex> lock(mutex);
+            size_t space = sizeof(Slot) + alignof(Slot);
+            memory.emplace_back(new char[space]);
+            void* p = memory.back().get();
+            std::align(alignof(Slot), sizeof(Slot), p, space);
+            Slot* slot = new (p) Slot{};
+            slot->stage = static_cast<int>(STAGE::count);
+            slots.push_back(slot);
+            return slot;
         }
 } ops{}; // <- global variable
 
+//=============================================================================
+// Heap allocations per stage, counted by the operator new and delete
+// below when --alloc enables them. Counts and bytes are kept per
+// thread, like the operations; the live heap and its peaks are those
+// of the process. Sizes are the usable sizes malloc gives, which is
+// what the heap really holds. The fast build has no counting at all.
+//
+// Blocks are malloc's own, without a header: disabled, the hook costs
+// a test of enabled. main enables it before it allocates, the blocks
+// of the static constructors are only freed at exit.
+//
+// Every member is a constant, so the counter is ready before any
+// static constructor can allocate.
+class AllocCounter
+{
+    public:
+        static const int stages = OpsCounter::stages;
+
+        // what one thread allocated, per stage
+        struct Usage
+        {
+            uint64_t count[stages];
+            uint64_t bytes[stages];
+        };
+
+        bool enabled = false;
+        // jobs run side by side: the peaks of the process are not those
+        // of one job and are left out of the reports
+        bool concurrent = false;
+
+#ifdef MYPROG_NO_OPS
+        int enter(STAGE) { return 0; }
+        void leave(int) {}
+#else
+        // charge the calling thread's allocations to stage from now on
+        int enter(STAGE stage) {
+            int outer = stage_now;
+            stage_now = static_cast<int>(stage);
+            return outer;
+        }
+
+        void leave(int outer) {
+            stage_now = outer;
+        }
+
+        // a block from malloc, returned as it is
+        void* allocated(void* block) {
+            if (enabled) {
+                uint64_t size = malloc_usable_size(block);
+                usage.count[stage_now]++;
+                usage.bytes[stage_now] += size;
+                int64_t now = live.fetch_add(size, std::memory_order_relaxed) + size;
+                Raise(peak, now);
+                Raise(stage_peak[stage_now], now);
+            }
+            return block;
+        }
+
+        // a block about to go back to malloc
+        void freed(void* block) {
+            if (enabled) {
+                live.fetch_sub(malloc_usable_size(block), std::memory_order_relaxed);
+            }
+        }
+#endif
+
+        // the calling thread's allocations so far
+        Usage thread_usage() const {
+#ifndef MYPROG_NO_OPS
+            return usage;
+#else
+            return Usage{};
+#endif
+        }
+
+        // the peaks start over from the heap in use now
+        void reset_peak() {
+            int64_t now = live.load(std::memory_order_relaxed);
+            peak.store(now, std::memory_order_relaxed);
+            for (auto& p : stage_peak) {
+                p.store(now, std::memory_order_relaxed);
+            }
+        }
+
+        // The allocations since before go to fname.mem: the totals, the
+        // peak heap since reset_peak and the peak resident size, then
+        // a line per stage that allocated. Only when enabled, the peaks
+        // only unless concurrent.
+        void write(const string& fname, const Usage& before, uint64_t peak_rss) const {
+#ifndef MYPROG_NO_OPS
+            if (! enabled) {
+                return;
+            }
+            Usage now = thread_usage();
+            uint64_t count = 0, bytes = 0;
+            for (int s=0; s<stages; s++) {
+                count += now.count[s] - before.count[s];
+                bytes += now.bytes[s] - before.bytes[s];
+            }
+            ofstream result{fname + ".mem"};
+            result << "allocations " << count << endl
+                   << "bytes " << bytes << endl;
+            if (! concurrent) {
+                result << "peak_heap " << peak.load(std::memory_order_relaxed) << endl
+                       << "peak_rss " << peak_rss << endl;
+            }
+            result << "stage allocations bytes" << (concurrent ? "" : " peak_heap") << endl;
+            for (int s=0; s<stages; s++) {
+                uint64_t n = now.count[s] - before.count[s];
+                if (n > 0) {
+                    result << stage_names[s] << " " << n << " " << now.bytes[s] - before.bytes[s];
+                    if (! concurrent) {
+                        result << " " << stage_peak[s].load(std::memory_order_relaxed);
+                    }
+                    result << endl;
+                }
+            }
+            result.close();
+#else
+            (void) fname;
+            (void) before;
+            (void) peak_rss;
+#endif
+        }
+
+    protected:
+        std::atomic<int64_t> live{0};
+        std::atomic<int64_t> peak{0};
+        std::atomic<int64_t> stage_peak[stages] = {};
+#ifndef MYPROG_NO_OPS
+        static thread_local int stage_now;
+        static thread_local Usage usage;
+
+        static void Raise(std::atomic<int64_t>& top, int64_t value) {
+            int64_t seen = top.load(std::memory_order_relaxed);
+            while (value > seen && ! top.compare_exchange_weak(seen, value, std::memory_order_relaxed)) {
+            }
+        }
+#endif
+} allocs{}; // <- global variable
+
+#ifndef MYPROG_NO_OPS
+thread_local int AllocCounter::stage_now = static_cast<int>(STAGE::count);
+thread_local AllocCounter::Usage AllocCounter::usage{};
+
+// every allocation of the program passes through here
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+    // a new of 0 bytes still gives a block of its own
+    void* block = std::malloc(std::max<std::size_t>(1, size));
+    return (block != nullptr) ? allocs.allocated(block) : nullptr;
+}
+
+void* operator new(std::size_t size)
+{
+    void* block = ::operator new(size, std::nothrow);
+    if (block == nullptr) {
+        throw std::bad_alloc();
+    }
+    return block;
+}
+
+void* operator new[](std::size_t size)
+{
+    return ::operator new(size);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+    return ::operator new(size, std::nothrow);
+}
+
+void operator delete(void* p) noexcept
+{
+    if (p != nullptr) {
+        allocs.freed(p);
+        std::free(p);
+    }
+}
+
+void operator delete[](void* p) noexcept
+{
+    ::operator delete(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept
+{
+    ::operator delete(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept
+{
+    ::operator delete(p);
+}
+#endif
+
+//=============================================================================
+// Wall time and hardware counters per stage. Stages nest, the time
+// of an inner stage is taken out of the outer one. When disabled a
+// stage costs one test of a flag on entry and exit; no counting is
+// done inside the hot loops in any case.
+class Profiler
+{
+    public:
+        static const int counters = 5;
+        bool enabled = false;
+
+        ~Profiler() {
+#ifdef __linux__
+            for (const auto& fd : fds) {
+                if (fd >= 0) {
+                    close(fd);
+                }
+            }
+#endif
+        }
+
+        void Enable() {
+            enabled = true;
+#ifdef __linux__
+            const uint32_t type[counters] = {
+                PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+                PERF_TYPE_HW_CACHE, PERF_TYPE_HW_CACHE};
+            const uint64_t config[counters] = {
+                PERF_COUNT_HW_CPU_CYCLES,
+                PERF_COUNT_HW_INSTRUCTIONS,
+                PERF_COUNT_HW_BRANCH_MISSES,
+                PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+                PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)};
+            for (int i=0; i<counters; i++) {
+                perf_event_attr attr{};
+                attr.size = sizeof(attr);
+                attr.type = type[i];
+                attr.config = config[i];
+                attr.exclude_kernel = 1;
+                attr.exclude_hv = 1;
+                fds[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+            }
+#endif
+            Read(last);
+            first = last;
+        }
+
+        void Begin(STAGE stage) {
+            Sample now;
+            Read(now);
+            if (! stack.empty()) {
+                Charge(stack.back(), now);
+            }
+            stack.push_back(stage);
+            totals[static_cast<int>(stage)].calls++;
+            last = now;
+        }
+
+        void End() {
+            Sample now;
+            Read(now);
+            Charge(stack.back(), now);
+            stack.pop_back();
+            last = now;
+        }
+
+        // a line per stage that ran, "other" is the time outside all stages
+        void Report(std::ostream& out) {
+            Sample now;
+            Read(now);
+            Totals other{};
+            other.ns = now.ns - first.ns;
+            for (int i=0; i<counters; i++) {
+                other.value[i] = now.value[i] - first.value[i];
+            }
+            out << std::left << std::setw(12) << "stage" << std::right
+                << std::setw(8) << "calls" << std::setw(11) << "ms" << std::setw(14) << "ops"
+                << std::setw(14) << "cycles" << std::setw(14) << "instructions"
+                << std::setw(6) << "IPC" << std::setw(13) << "branch-miss"
+                << std::setw(12) << "L1D-miss" << std::setw(12) << "LLC-miss" << endl;
+            for (int s=0; s<static_cast<int>(STAGE::count); s++) {
+                const Totals& t = totals[s];
+                other.ns -= t.ns;
+                for (int i=0; i<counters; i++) {
+                    other.value[i] -= t.value[i];
+                }
+                if (t.calls > 0) {
+                    Line(out, stage_names[s], t, ops.stage_total(s));
+                }
+            }
+            Line(out, stage_names[static_cast<int>(STAGE::count)], other, ops.stage_total(static_cast<int>(STAGE::count)));
+            vector<uint64_t> threads = ops.thread_totals();
+            if (threads.size() > 1) {
+                for (size_t i=0; i<threads.size(); i++) {
+                    out << "thread " << i << ": " << threads[i] << " ops" << endl;
+                }
+            }
+        }
+
+    protected:
+        struct Sample
+        {
+            double ns;
+            uint64_t value[counters];
+        };
+
+        struct Totals
+        {
+            uint64_t calls;
+            double ns;
+            uint64_t value[counters];
+        };
+
+        int fds[counters] = {-1, -1, -1, -1, -1};
+        Sample first{};
+        Sample last{};
+        vector<STAGE> stack{};
+        Totals totals[static_cast<int>(STAGE::count)] = {};
+
+        void Read(Sample& sample) {
+            for (int i=0; i<counters; i++) {
+                sample.value[i] = 0;
+#ifdef __linux__
+                if (fds[i] >= 0 && read(fds[i], &sample.value[i], sizeof(uint64_t)) != sizeof(uint64_t)) {
+                    sample.value[i] = 0;
+                }
+#endif
+            }
+            sample.ns = std::chrono::duration<double, std::nano>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+        void Charge(STAGE stage, const Sample& now) {
+            Totals& t = totals[static_cast<int>(stage)];
+            t.ns += now.ns - last.ns;
+            for (int i=0; i<counters; i++) {
+                t.value[i] += now.value[i] - last.value[i];
+            }
+        }
+
+        // counters that could not be opened are shown as "-"
+        void Line(std::ostream& out, const char* name, const Totals& t, uint64_t stage_ops) {
+            out << std::left << std::setw(12) << name << std::right
+                << std::setw(8) << t.calls << std::setw(11) << std::fixed
+                << std::setprecision(3) << t.ns / 1e6 << std::setw(14) << stage_ops;
+            const int width[counters] = {14, 14, 13, 12, 12};
+            for (int i=0; i<counters; i++) {
+                if (fds[i] >= 0) {
+                    out << std::setw(width[i]) << t.value[i];
+                } else {
+                    out << std::setw(width[i]) << "-";
+                }
+                if (i == 1) {
+                    // instructions per cycle
+                    if (fds[0] >= 0 && fds[1] >= 0 && t.value[0] > 0) {
+                        out << std::setw(6) << std::setprecision(2) << double(t.value[1]) / t.value[0];
+                    } else {
+                        out << std::setw(6) << "-";
+                    }
+                }
+            }
+            out << endl;
+        }
+} profiler{}; // <- global variable
+
+//=============================================================================
+// Charges the enclosing block to a stage: its operations always, its
+// allocations with --alloc, time and hardware counters when profiling
+// is enabled
+class ProfileScope
+{
+    public:
+        explicit ProfileScope(STAGE stage)
+            : active(profiler.enabled), outer(ops.enter(stage)), alloc_outer(allocs.enter(stage)) {
+            if (active) {
+                profiler.Begin(stage);
+            }
+        }
+
+        ~ProfileScope() {
+            if (active) {
+                profiler.End();
+            }
+            ops.leave(outer);
+            allocs.leave(alloc_outer);
+        }
+
+    private:
+        const bool active;
+        const int outer;
+        const int alloc_outer;
+};
+
 
 /* -----------------------------------------------------------------------------*/
 /**
@@ -130,16 +771,43 @@ class ArgParser
                 != this->tokens.end();
         }
 
+        // the arguments that are neither options nor values of the
+        // options listed in with_value
+        vector<string> get_positional(const vector<string> &with_value) const {
+            vector<string> args;
+            for (size_t i=0; i < this->tokens.size(); ++i) {
+                const string& tok = this->tokens[i];
+                if (tok.empty() || tok[0] != '-') {
+                    args.push_back(tok);
+                }
+                else if (std::find(with_value.begin(), with_value.end(), tok) != with_value.end()) {
+                    ++i;
+                }
+            }
+            return args;
+        }
+
     private:
         vector <string> tokens;
 };
 
 
 //=============================================================================
-enum class ALGORITHM : bool
+enum class ALGORITHM : uint8_t
+{
+    huffman,
+    shennon,
+    // pick the coder that gives the smallest archive
+    automatic
+};
+
+//=============================================================================
+enum class TRANSFORM : uint8_t
 {
-    huffman = true,
-    shennon = false
+    none,
+    bwt,
+    lz77,
+    words
 };
 
 /** @} */ // end doxygroup
@@ -155,13 +823,107 @@ enum class ALGORITHM : bool
 
 //=============================================================================
 typedef vector<bool> VariableCode;
-typedef std::map<char32_t, VariableCode> EncodeHuffmanMap;
-typedef std::map<VariableCode, char32_t> DecodeMap;
+
 typedef std::map<char32_t,uint64_t> FrequencyTable;
 
+// order-1 model: one table per previous symbol (the context), the
+// code tables of the contexts come with EncodeHuffmanMap and DecodeMap
+typedef std::map<char32_t, FrequencyTable> ContextFrequencyTable;
+
 class INode;
 typedef std::shared_ptr<INode> NodePtr;
 
+// Stored in the upper 5 bits of the first byte of an archive,
+// the lower 3 bits of that byte hold the trash size.
+// Files written before this field existed have it set to zero.
+enum class METHOD : uint8_t
+{
+    tree = 0,   // single order-0 code tree
+    order1 = 1, // one code tree per previous symbol + fallback tree
+    bwt = 2,    // blocks of BWT + MTF + RLE output, code tree per block
+    lz77 = 3,   // blocks of LZ77 tokens, literal/length and distance trees
+    stored = 4, // UTF-8 text copied without coding
+    rle = 5,    // (length, symbol) runs
+    pack = 6,   // members of a multi-file archive, a block each
+    lengths = 7,// order-0 like tree, the header holds code lengths
+    sampled = 8,// like lengths, for a sampled histogram with an escape code
+    words = 9   // a dictionary of words and separators, a tree over its tokens
+};
+
+// Set in the method field when the archive ends with a block index
+const uint8_t index_flag = 0x10;
+
+// Kind of a block inside the block methods (bwt, lz77).
+// Blocks that do not compress fall back to a stored copy or runs.
+enum class BLOCK : uint8_t
+{
+    coded = 0,
+    stored = 1,
+    runs = 2,
+    repeat = 3  // coded with the trees of the last coded block
+};
+
+// One entry of the block index at the end of an archive.
+// Whole-file methods have a single block. The sizes are varints in
+// the archive, the offsets follow from them: the blocks are back to
+// back from the byte after the header.
+struct BlockEntry
+{
+    uint64_t offset;        // first payload byte in the archive
+    uint64_t bytes;         // payload bytes
+    uint32_t crc;           // CRC32C of the payload bytes
+    uint64_t text_bytes;    // UTF-8 bytes of the decoded text
+    uint32_t text_crc;      // CRC32C of the decoded text
+};
+typedef vector<BlockEntry> BlockIndex;
+
+// A place in the coded data where decoding can start over: the
+// number of symbols before it, its bit offset in the archive and the
+// previous symbol for the order-1 model. Tables are read as usual.
+struct SeekPoint
+{
+    uint64_t symbol;
+    uint64_t bit;
+    char32_t context;
+};
+typedef vector<SeekPoint> SeekTable;
+// bytes taken by one SeekPoint in the archive
+const int seek_entry_size = 20;
+// set in the block count when a seek table is written before the blocks
+const uint32_t seek_table_flag = 0x80000000;
+
+// Sizes of the whole text and of the coded data, known before decoding
+// starts: the output is allocated at once and the decoder runs most of
+// the codes without looking for the end of the data.
+struct Totals
+{
+    uint64_t symbols;       // symbols of the text
+    uint64_t text_bytes;    // UTF-8 bytes of the text
+    uint64_t payload_bits;  // bits of the archive before the trash
+};
+// The index ends with a 4-byte word of flags and the length of the
+// index before it: the varint count, the entries and the varint
+// symbols and text bytes of the Totals. The payload bits follow from
+// the trash size.
+// set in the last word when the Totals follow the block entries
+const uint32_t totals_flag = 0x40000000;
+// Set in the last word of an archive of one block and no seek table.
+// The two checksums and the varint text bytes and symbols come
+// instead of the count, the entry and the Totals.
+const uint32_t short_index_flag = 0x20000000;
+// the length of the index in the last word
+const uint32_t index_length_mask = 0x1fffffff;
+// context of a seek point before the first symbol
+const char32_t no_context = 0xffffffff;
+
+// How the symbols in the leaves of a stored code tree are written
+enum class LEAF : uint8_t
+{
+    utf8,       // text symbols
+    number,     // fixed width numbers
+    litlen      // flag bit, then a text symbol or a fixed width length code
+};
+
 /** @} */ // end doxygroup
 
 /* -----------------------------------------------------------------------------*/
@@ -195,10 +957,31 @@ class INode
 class InternalNode : public INode
 {
     public:
-        NodePtr const left;
-        NodePtr const right;
+        NodePtr left;
+        NodePtr right;
 
         InternalNode(NodePtr c0, NodePtr c1) : INode(c0->f + c1->f), left(c0), right(c1) {}
+
+        // A tree as deep as its alphabet is released a node at a time:
+        // the children of a node that goes are taken out before it does.
+        ~InternalNode() override
+        {
+            if (! left && ! right) {
+                return;
+            }
+            vector<NodePtr> orphans;
+            orphans.push_back(std::move(left));
+            orphans.push_back(std::move(right));
+            while (! orphans.empty()) {
+                NodePtr node = std::move(orphans.back());
+                orphans.pop_back();
+                InternalNode* in = dynamic_cast<InternalNode*>(node.get());
+                if (in != nullptr && node.use_count() == 1) {
+                    orphans.push_back(std::move(in->left));
+                    orphans.push_back(std::move(in->right));
+                }
+            }
+        }
 };
 
 //=============================================================================
@@ -223,602 +1006,7684 @@ struct NodeCmp
 /** @} */ // end doxygroup
 /* -----------------------------------------------------------------------------*/
 /**
- *  @defgroup symbol_file_streams Classes to facilitate reading and writing
- *  to and from UTF-8 <-> UCS4 streams.
+ *  @defgroup file_io Reads and writes of file chunks in the background,
+ *  under the symbol and bit file streams.
  *  @{
  */
 
 
 //=============================================================================
-class ucs4_ifstream : public basic_ifstream<char32_t>
+// Reads and writes of a chunk of a file at an offset, done in the
+// background. Every request is made for a slot, Wait(slot) returns
+// the bytes read or written, or -errno.
+class AsyncIo
 {
     public:
-        using basic_ifstream<char32_t>::basic_ifstream;
+        virtual ~AsyncIo() {}
 
-        ucs4_ifstream(string& fname) : basic_ifstream<char32_t>(fname, ios::binary | ios::out) {
-            imbue(uft8_aware_locale);
-        }
+        virtual void Submit(int slot, bool write, int fd, char* data, size_t len, uint64_t offset) = 0;
+        virtual int64_t Wait(int slot) = 0;
 
     protected:
-        locale uft8_aware_locale{std::locale(), new std::codecvt_utf8<char32_t>};
-
+        // the whole chunk, unless the file ends first
+        static int64_t Transfer(bool write, int fd, char* data, size_t len, uint64_t offset)
+        {
+            size_t done = 0;
+            while (done < len) {
+                ssize_t n = write ? pwrite(fd, data + done, len - done, offset + done)
+                                  : pread(fd, data + done, len - done, offset + done);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n < 0) {
+                    return -errno;
+                }
+                if (n == 0) {
+                    break;
+                }
+                done += n;
+            }
+            return done;
+        }
 };
 
 //=============================================================================
-class ucs4_ofstream : public basic_ofstream<char32_t>
+// A helper thread that does the requests one by one with pread/pwrite
+class ThreadIo : public AsyncIo
 {
     public:
-        using basic_ofstream<char32_t>::basic_ofstream;
+        explicit ThreadIo(int slots) : requests(slots), worker([this]{ Work(); }) {}
 
-        ucs4_ofstream(string& fname) : basic_ofstream<char32_t>(fname, ios::binary | ios::out) {
-            imbue(uft8_aware_locale);
+        ~ThreadIo() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stop = true;
+            }
+            work_ready.notify_one();
+            worker.join();
         }
 
-    protected:
-        locale uft8_aware_locale{std::locale(), new std::codecvt_utf8<char32_t>};
-};
+        void Submit(int slot, bool write, int fd, char* data, size_t len, uint64_t offset) override
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            requests[slot] = Request{write, fd, data, len, offset, 0, false};
+            queue.push_back(slot);
+            work_ready.notify_one();
+        }
 
+        int64_t Wait(int slot) override
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            work_done.wait(lock, [&]{ return requests[slot].done; });
+            return requests[slot].result;
+        }
 
-/** @} */ // end doxygroup
-/* -----------------------------------------------------------------------------*/
-/**
- *  @defgroup bit_file_streams Classes for bit file IO.
- *  @{
- */
+    protected:
+        struct Request
+        {
+            bool write;
+            int fd;
+            char* data;
+            size_t len;
+            uint64_t offset;
+            int64_t result;
+            bool done;
+        };
+
+        std::mutex mutex;
+        std::condition_variable work_ready;
+        std::condition_variable work_done;
+        std::deque<int> queue;
+        vector<Request> requests;
+        bool stop = false;
+        // started last, once the rest is there
+        std::thread worker;
 
+        // the queued requests are done before the thread stops
+        void Work()
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true) {
+                work_ready.wait(lock, [&]{ return stop || ! queue.empty(); });
+                if (queue.empty()) {
+                    return;
+                }
+                int slot = queue.front();
+                queue.pop_front();
+                Request r = requests[slot];
+                lock.unlock();
+                int64_t result = Transfer(r.write, r.fd, r.data, r.len, r.offset);
+                lock.lock();
+                requests[slot].result = result;
+                requests[slot].done = true;
+                work_done.notify_all();
+            }
+        }
+};
 
+#if defined(__linux__) && ! defined(MYPROG_NO_URING)
 //=============================================================================
-class bit_ifstream : public ifstream
+// io_uring through the raw system calls: a ring of one entry per slot,
+// the kernel does the reads and writes without a thread of ours.
+class UringIo : public AsyncIo
 {
-
-
     public:
-
-        bit_ifstream(const string& fname) : ifstream(fname, ios::binary | ios::in) {
-            // plus initialisation
-            ops.add(5);
-            getarray(reinterpret_cast<char*>(&trash_size), 8);
+        // throws if the kernel gives no ring
+        explicit UringIo(int slots)
+            : iovecs(slots), lens(slots, 0), results(slots, 0), pending(slots, false),
+              offsets(slots, 0), writes(slots, false), fds(slots, -1)
+        {
+            io_uring_params params;
+            memset(&params, 0, sizeof(params));
+            ring_fd = syscall(SYS_io_uring_setup, slots, &params);
+            if (ring_fd < 0) {
+                throw runtime_error("No io_uring.");
+            }
+            sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+            if (single) {
+                sq_size = cq_size = std::max(sq_size, cq_size);
+            }
+            sq_ring = Map(sq_size, IORING_OFF_SQ_RING);
+            cq_ring = single ? sq_ring : Map(cq_size, IORING_OFF_CQ_RING);
+            sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+            sqes = static_cast<io_uring_sqe*>(Map(sqes_size, IORING_OFF_SQES));
+            if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED) {
+                Unmap();
+                throw runtime_error("No io_uring.");
+            }
+            char* sq = static_cast<char*>(sq_ring);
+            char* cq = static_cast<char*>(cq_ring);
+            sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+            sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+            sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+            cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+            cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+            cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+            cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
         }
 
-        bit_ifstream& getbit(bool& bit) {
-            ops.add(2);
-            if (lastbyte && nbit <= trash_size) {
-                ops.add(1);
-                setstate(ios::eofbit);
-                return *this;
-            }
-            if (nbit == 0) {
-                ops.add(3);
-                get(bitbuf);
-                nbit = 8;
-                if (peek() == EOF) {
-                    ops.add(2);
-                    lastbyte = true;
-                    clear();
+        ~UringIo() {
+            for (size_t slot=0; slot<pending.size(); slot++) {
+                try {
+                    Wait(slot);
+                } catch(const std::runtime_error&) {
+                    // the kernel has the buffer of a lost request, the ring
+                    // goes with the file
                 }
             }
-            // disregard the last trash_size bits in the last byte
-            ops.add(4);
-            bit = (bitbuf & (1 << --nbit)) ? true : false;
-            return *this;
+            Unmap();
         }
 
-        bit_ifstream& getucs4(char32_t& ch) {
+        void Submit(int slot, bool write, int fd, char* data, size_t len, uint64_t offset) override
+        {
+            iovecs[slot].iov_base = data;
+            iovecs[slot].iov_len = len;
+            lens[slot] = len;
+            unsigned tail = *sq_tail;
+            unsigned index = tail & sq_mask;
+            io_uring_sqe* sqe = &sqes[index];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+            sqe->fd = fd;
+            sqe->off = offset;
+            sqe->addr = reinterpret_cast<uint64_t>(&iovecs[slot]);
+            sqe->len = 1;
+            sqe->user_data = slot;
+            sq_array[index] = index;
+            offsets[slot] = offset;
+            writes[slot] = write;
+            fds[slot] = fd;
+            pending[slot] = true;
+            __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+            unsubmitted++;
+            Enter(false);
+        }
+
+        // a short transfer is finished here with pread/pwrite
+        int64_t Wait(int slot) override
+        {
+            while (pending[slot]) {
+                if (! Reap()) {
+                    Enter(true);
+                }
+            }
+            int64_t got = results[slot];
+            if (got > 0 && static_cast<size_t>(got) < lens[slot]) {
+                char* data = static_cast<char*>(iovecs[slot].iov_base);
+                int64_t more = Transfer(writes[slot], fds[slot], data + got, lens[slot] - got, offsets[slot] + got);
+                results[slot] = got = (more < 0) ? more : got + more;
+                lens[slot] = 0;
+            }
+            return got;
+        }
+
+    protected:
+        int ring_fd = -1;
+        size_t sq_size = 0;
+        size_t cq_size = 0;
+        size_t sqes_size = 0;
+        void* sq_ring = MAP_FAILED;
+        void* cq_ring = MAP_FAILED;
+        io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+        unsigned* sq_tail = nullptr;
+        unsigned sq_mask = 0;
+        unsigned* sq_array = nullptr;
+        unsigned* cq_head = nullptr;
+        unsigned* cq_tail = nullptr;
+        unsigned cq_mask = 0;
+        io_uring_cqe* cqes = nullptr;
+        // the request of every slot
+        vector<iovec> iovecs;
+        vector<size_t> lens;
+        vector<int64_t> results;
+        vector<bool> pending;
+        vector<uint64_t> offsets;
+        vector<bool> writes;
+        vector<int> fds;
+        // entries in the ring the kernel has not taken yet
+        unsigned unsubmitted = 0;
+        // tries of a busy kernel before its entries are done here
+        static const int busy_tries = 10;
+
+        // Gives the kernel the entries it has not taken, and waits for a
+        // completion if wait. A kernel short of memory is tried again
+        // after a pause growing from 50 us. If it keeps failing, the
+        // entries not taken are taken back and done with pread/pwrite.
+        void Enter(bool wait)
+        {
+            for (int tries = 0; ; tries++) {
+                long taken = syscall(SYS_io_uring_enter, ring_fd, unsubmitted, wait ? 1 : 0,
+                        wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+                if (taken >= 0) {
+                    unsubmitted -= std::min<unsigned>(taken, unsubmitted);
+                    return;
+                }
+                if (errno == EINTR) {
+                    continue;
+                }
+                if ((errno == EAGAIN || errno == EBUSY) && tries < busy_tries) {
+                    std::this_thread::sleep_for(std::chrono::microseconds(50 << tries));
+                    continue;
+                }
+                if (unsubmitted == 0) {
+                    // nothing to do here: the requests are the kernel's
+                    throw runtime_error("Could not wait for io_uring.");
+                }
+                Withdraw();
+                return;
+            }
+        }
+
+        // The entries the kernel has not taken leave the ring, which the
+        // kernel only reads up to the tail, and are done here at once.
+        void Withdraw()
+        {
+            unsigned tail = *sq_tail - unsubmitted;
+            __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+            for (; unsubmitted > 0; unsubmitted--, tail++) {
+                int slot = sqes[tail & sq_mask].user_data;
+                char* data = static_cast<char*>(iovecs[slot].iov_base);
+                results[slot] = Transfer(writes[slot], fds[slot], data, lens[slot], offsets[slot]);
+                pending[slot] = false;
+            }
+        }
+
+        void* Map(size_t size, uint64_t offset)
+        {
+            return mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, offset);
+        }
+
+        void Unmap()
+        {
+            if (sqes != MAP_FAILED) {
+                munmap(sqes, sqes_size);
+            }
+            if (cq_ring != MAP_FAILED && cq_ring != sq_ring) {
+                munmap(cq_ring, cq_size);
+            }
+            if (sq_ring != MAP_FAILED) {
+                munmap(sq_ring, sq_size);
+            }
+            close(ring_fd);
+        }
+
+        // takes the completions there are, false if none
+        bool Reap()
+        {
+            unsigned head = *cq_head;
+            unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+            if (head == tail) {
+                return false;
+            }
+            for (; head != tail; head++) {
+                const io_uring_cqe& cqe = cqes[head & cq_mask];
+                results[cqe.user_data] = cqe.res;
+                pending[cqe.user_data] = false;
+            }
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+            return true;
+        }
+};
+const int UringIo::busy_tries;
+#endif
+
+//=============================================================================
+// io_uring if the kernel has it, a helper thread otherwise
+inline std::unique_ptr<AsyncIo> MakeAsyncIo(int slots)
+{
+#if defined(__linux__) && ! defined(MYPROG_NO_URING)
+    try {
+        return std::unique_ptr<AsyncIo>(new UringIo(slots));
+    } catch(const std::runtime_error& e) {
+        // seccomp or an old kernel, fall back to the thread
+    }
+#endif
+    return std::unique_ptr<AsyncIo>(new ThreadIo(slots));
+}
+
+//=============================================================================
+// A file read ahead or written behind in a few aligned chunks: while
+// the stream works on one chunk, the next ones are being read, or the
+// previous ones written, in the background. The chunks and the io of a
+// closed file are kept for the next file its thread opens, so a worker
+// that codes many small files does not set them up for each one.
+class AsyncFile
+{
+    public:
+        static const size_t chunk_size = 1 << 18;
+        static const int chunks = 4;
+        // closed files kept per thread, as many as a job has open at once
+        static const size_t max_spares = 3;
+
+        AsyncFile() : offsets(chunks, 0), lens(chunks, 0), in_flight(chunks, false) {}
+
+        ~AsyncFile() {
+            close();
+        }
+
+        bool open(const string& fname, bool for_writing)
+        {
+            writing = for_writing;
+            failure = false;
+            fd = writing ? ::open(fname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666)
+                         : ::open(fname.c_str(), O_RDONLY);
+            if (fd < 0) {
+                return false;
+            }
+            vector<Spare>& spares = Spares().list;
+            if (! spares.empty()) {
+                data = spares.back().data;
+                io = std::move(spares.back().io);
+                spares.pop_back();
+            } else {
+                void* p = nullptr;
+                if (posix_memalign(&p, 4096, chunks * chunk_size) != 0) {
+                    ::close(fd);
+                    fd = -1;
+                    return false;
+                }
+                data = static_cast<char*>(p);
+                io = MakeAsyncIo(chunks);
+            }
+            if (! writing) {
+                struct stat st;
+                file_size = (fstat(fd, &st) == 0) ? st.st_size : 0;
+                seek_read(0);
+            }
+            return true;
+        }
+
+        bool is_open() const {
+            return fd >= 0;
+        }
+
+        // false if a read or a write failed
+        bool failed() const {
+            return failure;
+        }
+
+        uint64_t size() const {
+            return file_size;
+        }
+
+        // The next chunk in file order and its offset, 0 bytes at the
+        // end of the file. It is valid up to the next call.
+        size_t next(const char*& chunk, uint64_t& offset)
+        {
+            // the chunk given last time is read again further on
+            if (held >= 0 && next_offset < file_size) {
+                Read(held);
+            }
+            held = -1;
+            if (! in_flight[head]) {
+                return 0;
+            }
+            int64_t got = io->Wait(head);
+            in_flight[head] = false;
+            if (got < 0) {
+                failure = true;
+                return 0;
+            }
+            chunk = data + head * chunk_size;
+            offset = offsets[head];
+            held = head;
+            head = (head + 1) % chunks;
+            return got;
+        }
+
+        // the chunks from offset on are read from now on
+        void seek_read(uint64_t offset)
+        {
+            Drain();
+            held = -1;
+            head = 0;
+            next_offset = offset;
+            for (int slot=0; slot<chunks && next_offset < file_size; slot++) {
+                Read(slot);
+            }
+        }
+
+        // where the next bytes go, chunk_size of room
+        char* buffer()
+        {
+            Finish(current);
+            return data + current * chunk_size;
+        }
+
+        // write len bytes of buffer() in the background
+        void write(size_t len)
+        {
+            if (len == 0) {
+                return;
+            }
+            lens[current] = len;
+            offsets[current] = write_offset;
+            io->Submit(current, true, fd, data + current * chunk_size, len, write_offset);
+            in_flight[current] = true;
+            write_offset += len;
+            current = (current + 1) % chunks;
+        }
+
+        // the writes from now on go to offset
+        void seek_write(uint64_t offset)
+        {
+            Drain();
+            write_offset = offset;
+        }
+
+        // the file is cut to size bytes, the writes from now on go there
+        bool truncate(uint64_t size)
+        {
+            Drain();
+            if (ftruncate(fd, size) != 0) {
+                failure = true;
+            }
+            write_offset = size;
+            return ! failure;
+        }
+
+        // waits for the chunks in flight, false if anything failed
+        bool close()
+        {
+            if (fd < 0) {
+                return ! failure;
+            }
+            Drain();
+            if (::close(fd) != 0) {
+                failure = true;
+            }
+            fd = -1;
+            // nothing is in flight, the next file may take them as they are
+            vector<Spare>& spares = Spares().list;
+            if (spares.size() < max_spares) {
+                spares.push_back(Spare{data, std::move(io)});
+            } else {
+                io.reset();
+                free(data);
+            }
+            data = nullptr;
+            head = 0;
+            held = -1;
+            current = 0;
+            write_offset = 0;
+            return ! failure;
+        }
+
+    protected:
+        int fd = -1;
+        bool writing = false;
+        bool failure = false;
+        char* data = nullptr;
+        std::unique_ptr<AsyncIo> io;
+        // the request of every chunk
+        vector<uint64_t> offsets;
+        vector<size_t> lens;
+        vector<bool> in_flight;
+        // reading: the chunk to hand out next, the one handed out last
+        // and where the next read starts
+        uint64_t file_size = 0;
+        int head = 0;
+        int held = -1;
+        uint64_t next_offset = 0;
+        // writing: the chunk being filled and where it goes
+        int current = 0;
+        uint64_t write_offset = 0;
+
+        void Read(int slot)
+        {
+            offsets[slot] = next_offset;
+            lens[slot] = chunk_size;
+            io->Submit(slot, false, fd, data + slot * chunk_size, chunk_size, next_offset);
+            in_flight[slot] = true;
+            next_offset += chunk_size;
+        }
+
+        // a write must have written all of its chunk
+        void Finish(int slot)
+        {
+            if (! in_flight[slot]) {
+                return;
+            }
+            int64_t got = io->Wait(slot);
+            in_flight[slot] = false;
+            if (got < 0 || (writing && static_cast<size_t>(got) != lens[slot])) {
+                failure = true;
+            }
+        }
+
+        void Drain()
+        {
+            for (int slot=0; slot<chunks; slot++) {
+                Finish(slot);
+            }
+        }
+
+        struct Spare
+        {
+            char* data;
+            std::unique_ptr<AsyncIo> io;
+        };
+
+        struct SpareList
+        {
+            vector<Spare> list;
+
+            ~SpareList() {
+                for (auto& spare : list) {
+                    spare.io.reset();
+                    free(spare.data);
+                }
+            }
+        };
+
+        static SpareList& Spares()
+        {
+            static thread_local SpareList spares;
+            return spares;
+        }
+};
+const size_t AsyncFile::chunk_size;
+const int AsyncFile::chunks;
+const size_t AsyncFile::max_spares;
+
+//=============================================================================
+// The bytes of an AsyncFile as a stream buffer, under the bit streams.
+// Seeks within the chunk at hand are free, others start over there.
+class async_filebuf : public std::streambuf
+{
+    public:
+        ~async_filebuf() {
+            close();
+        }
+
+        bool open(const string& fname, bool for_writing)
+        {
+            writing = for_writing;
+            base = 0;
+            if (! file.open(fname, writing)) {
+                return false;
+            }
+            if (writing) {
+                char* b = file.buffer();
+                setp(b, b + AsyncFile::chunk_size);
+            }
+            return true;
+        }
+
+        bool close()
+        {
+            if (! file.is_open()) {
+                return ! file.failed();
+            }
+            bool ok = (sync() == 0);
+            setg(nullptr, nullptr, nullptr);
+            setp(nullptr, nullptr);
+            return file.close() && ok;
+        }
+
+        // the bytes written so far are dropped, the file is empty again
+        bool restart()
+        {
+            if (! writing) {
+                return false;
+            }
+            base = 0;
+            bool ok = file.truncate(0);
+            char* b = file.buffer();
+            setp(b, b + AsyncFile::chunk_size);
+            return ok;
+        }
+
+    protected:
+        AsyncFile file;
+        bool writing = false;
+        // file offset of the chunk at hand
+        uint64_t base = 0;
+
+        int_type underflow() override
+        {
+            if (gptr() < egptr()) {
+                return traits_type::to_int_type(*gptr());
+            }
+            base += egptr() - eback();
+            setg(nullptr, nullptr, nullptr);
+            const char* chunk = nullptr;
+            uint64_t offset = 0;
+            size_t got = file.next(chunk, offset);
+            if (got == 0) {
+                return traits_type::eof();
+            }
+            char* p = const_cast<char*>(chunk);
+            setg(p, p, p + got);
+            base = offset;
+            return traits_type::to_int_type(*p);
+        }
+
+        int_type overflow(int_type c) override
+        {
+            if (! writing || sync() != 0) {
+                return traits_type::eof();
+            }
+            if (! traits_type::eq_int_type(c, traits_type::eof())) {
+                *pptr() = traits_type::to_char_type(c);
+                pbump(1);
+            }
+            return traits_type::not_eof(c);
+        }
+
+        // the bytes written so far go to the file in the background
+        int sync() override
+        {
+            if (! writing) {
+                return 0;
+            }
+            size_t len = pptr() - pbase();
+            if (len > 0) {
+                file.write(len);
+                base += len;
+                char* b = file.buffer();
+                setp(b, b + AsyncFile::chunk_size);
+            }
+            return file.failed() ? -1 : 0;
+        }
+
+        pos_type seekoff(off_type off, ios::seekdir dir, ios::openmode) override
+        {
+            if (writing) {
+                off_type at = base + (pptr() - pbase());
+                off_type target = (dir == ios::beg) ? off : (dir == ios::cur) ? at + off : -1;
+                if (target < 0 || sync() != 0) {
+                    return pos_type(off_type(-1));
+                }
+                if (target != at) {
+                    file.seek_write(target);
+                    base = target;
+                    char* b = file.buffer();
+                    setp(b, b + AsyncFile::chunk_size);
+                }
+                return pos_type(target);
+            }
+            off_type at = base + (gptr() - eback());
+            off_type target = (dir == ios::beg) ? off : (dir == ios::cur) ? at + off : file.size() + off;
+            if (target < 0) {
+                return pos_type(off_type(-1));
+            }
+            if (target >= off_type(base) && target <= off_type(base + (egptr() - eback()))) {
+                setg(eback(), eback() + (target - base), egptr());
+            } else {
+                file.seek_read(target);
+                setg(nullptr, nullptr, nullptr);
+                base = target;
+            }
+            return pos_type(target);
+        }
+
+        pos_type seekpos(pos_type pos, ios::openmode which) override
+        {
+            return seekoff(off_type(pos), ios::beg, which);
+        }
+};
+
+//=============================================================================
+// UTF-8 bytes of an AsyncFile as a stream buffer of code points, under
+// the symbol streams. It takes what codecvt_utf8 takes: no overlong
+// forms, no surrogates and nothing above U+10FFFF. Input is rewound
+// to the start only.
+class async_utf8buf : public std::basic_streambuf<char32_t>
+{
+    public:
+        async_utf8buf() : text(text_size) {}
+
+        ~async_utf8buf() {
+            close();
+        }
+
+        bool open(const string& fname, bool for_writing)
+        {
+            writing = for_writing;
+            bytes = bytes_end = nullptr;
+            if (! file.open(fname, writing)) {
+                return false;
+            }
+            if (writing) {
+                out = file.buffer();
+                out_fill = 0;
+                setp(text.data(), text.data() + text.size());
+            }
+            return true;
+        }
+
+        bool close()
+        {
+            if (! file.is_open()) {
+                return ! file.failed();
+            }
+            bool ok = (sync() == 0);
+            if (writing) {
+                file.write(out_fill);
+                out_fill = 0;
+            }
+            setg(nullptr, nullptr, nullptr);
+            setp(nullptr, nullptr);
+            return file.close() && ok;
+        }
+
+    protected:
+        static const size_t text_size = 1 << 16;
+        AsyncFile file;
+        bool writing = false;
+        vector<char32_t> text;
+        // reading: the bytes of the chunk at hand not decoded yet
+        const char* bytes = nullptr;
+        const char* bytes_end = nullptr;
+        // writing: the chunk being filled
+        char* out = nullptr;
+        size_t out_fill = 0;
+
+        // bad input bytes fail the stream like codecvt errors do
+        static void Bad()
+        {
+            throw std::ios_base::failure("invalid byte sequence in file");
+        }
+
+        bool Fetch()
+        {
+            uint64_t offset = 0;
+            size_t got = file.next(bytes, offset);
+            if (got == 0) {
+                bytes = bytes_end = nullptr;
+                if (file.failed()) {
+                    Bad();
+                }
+                return false;
+            }
+            bytes_end = bytes + got;
+            return true;
+        }
+
+        int_type underflow() override
+        {
+            if (gptr() < egptr()) {
+                return traits_type::to_int_type(*gptr());
+            }
+            char32_t* t = text.data();
+            size_t n = 0;
+            while (n < text.size()) {
+                if (bytes == bytes_end && ! Fetch()) {
+                    break;
+                }
+                uint8_t lead = *bytes;
+                if (lead < 0x80) {
+                    t[n++] = lead;
+                    bytes++;
+                    continue;
+                }
+                int len = (lead >= 0xf0) ? 4 : (lead >= 0xe0) ? 3 : (lead >= 0xc2) ? 2 : 0;
+                if (len == 0 || lead > 0xf4) {
+                    Bad();
+                }
+                // the sequence may go on in the next chunk
+                char32_t ch = lead & (0x7f >> len);
+                for (int i=1; i<len; i++) {
+                    if (++bytes == bytes_end && ! Fetch()) {
+                        Bad();
+                    }
+                    uint8_t cont = *bytes;
+                    if ((cont & 0xc0) != 0x80) {
+                        Bad();
+                    }
+                    ch = (ch << 6) | (cont & 0x3f);
+                }
+                bytes++;
+                if ((len == 3 && (ch < 0x800 || (ch >= 0xd800 && ch < 0xe000)))
+                        || (len == 4 && (ch < 0x10000 || ch > 0x10ffff))) {
+                    Bad();
+                }
+                t[n++] = ch;
+            }
+            if (n == 0) {
+                return traits_type::eof();
+            }
+            setg(t, t, t + n);
+            return traits_type::to_int_type(*t);
+        }
+
+        int_type overflow(int_type c) override
+        {
+            if (! writing || sync() != 0) {
+                return traits_type::eof();
+            }
+            if (! traits_type::eq_int_type(c, traits_type::eof())) {
+                *pptr() = traits_type::to_char_type(c);
+                pbump(1);
+            }
+            return traits_type::not_eof(c);
+        }
+
+        // the code points written so far as UTF-8 into the chunk,
+        // full chunks go to the file in the background
+        int sync() override
+        {
+            if (! writing) {
+                return 0;
+            }
+            for (const char32_t* p = pbase(); p < pptr(); p++) {
+                if (AsyncFile::chunk_size - out_fill < 4) {
+                    file.write(out_fill);
+                    out = file.buffer();
+                    out_fill = 0;
+                }
+                char32_t ch = *p;
+                char* o = out + out_fill;
+                if (ch < 0x80) {
+                    o[0] = ch;
+                    out_fill += 1;
+                } else if (ch < 0x800) {
+                    o[0] = 0xc0 | (ch >> 6);
+                    o[1] = 0x80 | (ch & 0x3f);
+                    out_fill += 2;
+                } else if (ch < 0x10000) {
+                    if (ch >= 0xd800 && ch < 0xe000) {
+                        return -1;
+                    }
+                    o[0] = 0xe0 | (ch >> 12);
+                    o[1] = 0x80 | ((ch >> 6) & 0x3f);
+                    o[2] = 0x80 | (ch & 0x3f);
+                    out_fill += 3;
+                } else if (ch <= 0x10ffff) {
+                    o[0] = 0xf0 | (ch >> 18);
+                    o[1] = 0x80 | ((ch >> 12) & 0x3f);
+                    o[2] = 0x80 | ((ch >> 6) & 0x3f);
+                    o[3] = 0x80 | (ch & 0x3f);
+                    out_fill += 4;
+                } else {
+                    return -1;
+                }
+            }
+            setp(text.data(), text.data() + text.size());
+            return file.failed() ? -1 : 0;
+        }
+
+        pos_type seekoff(off_type off, ios::seekdir dir, ios::openmode which) override
+        {
+            if (writing || off != 0 || dir != ios::beg) {
+                return pos_type(off_type(-1));
+            }
+            return seekpos(pos_type(0), which);
+        }
+
+        // rewind, the encoders read the text twice
+        pos_type seekpos(pos_type pos, ios::openmode) override
+        {
+            if (writing || pos != pos_type(0)) {
+                return pos_type(off_type(-1));
+            }
+            file.seek_read(0);
+            bytes = bytes_end = nullptr;
+            setg(text.data(), text.data(), text.data());
+            return pos;
+        }
+};
+
+
+/** @} */ // end doxygroup
+/* -----------------------------------------------------------------------------*/
+/**
+ *  @defgroup symbol_file_streams Classes to facilitate reading and writing
+ *  to and from UTF-8 <-> UCS4 streams.
+ *  @{
+ */
+
+
+//=============================================================================
+// number of bytes in the UTF-8 form of ch
+inline int utf8_length(char32_t ch)
+{
+    ops.add(3);
+    return (ch < 0x80) ? 1 : (ch < 0x800) ? 2 : (ch < 0x10000) ? 3 : 4;
+}
+
+//=============================================================================
+// UTF-8 text file read as code points, through an async_utf8buf
+class ucs4_ifstream : public std::basic_istream<char32_t>
+{
+    public:
+        explicit ucs4_ifstream(const string& fname) : std::basic_istream<char32_t>(nullptr) {
+            init(&buf);
+            if (! buf.open(fname, false)) {
+                setstate(ios::failbit);
+            }
+        }
+
+        void close() {
+            if (! buf.close()) {
+                setstate(ios::failbit);
+            }
+        }
+
+    protected:
+        async_utf8buf buf;
+};
+
+//=============================================================================
+// code points written to a UTF-8 text file, through an async_utf8buf
+class ucs4_ofstream : public std::basic_ostream<char32_t>
+{
+    public:
+        explicit ucs4_ofstream(const string& fname) : std::basic_ostream<char32_t>(nullptr) {
+            init(&buf);
+            if (! buf.open(fname, true)) {
+                setstate(ios::failbit);
+            }
+        }
+
+        void close() {
+            if (! buf.close()) {
+                setstate(ios::failbit);
+            }
+        }
+
+    protected:
+        async_utf8buf buf;
+};
+
+
+/** @} */ // end doxygroup
+/* -----------------------------------------------------------------------------*/
+/**
+ *  @defgroup bit_file_streams Classes for bit file IO.
+ *  @{
+ */
+
+
+//=============================================================================
+// CRC32C (Castagnoli polynomial), sliced by 8: each step of
+// the main loop takes 8 bytes with 8 table lookups.
+// Checksums, like the index and the totals, are bookkeeping of the
+// archive and count no operations, the .ops are those of the coder.
+class Crc32c
+{
+    public:
+        static uint32_t Update(uint32_t crc, const char* data, size_t qty)
+        {
+            const Tables& t = tables();
+            const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+            crc = ~crc;
+            while (qty >= 8) {
+                uint32_t lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | static_cast<uint32_t>(p[3]) << 24);
+                uint32_t hi = p[4] | p[5] << 8 | p[6] << 16 | static_cast<uint32_t>(p[7]) << 24;
+                crc = t.t[7][lo & 0xff] ^ t.t[6][(lo >> 8) & 0xff]
+                    ^ t.t[5][(lo >> 16) & 0xff] ^ t.t[4][lo >> 24]
+                    ^ t.t[3][hi & 0xff] ^ t.t[2][(hi >> 8) & 0xff]
+                    ^ t.t[1][(hi >> 16) & 0xff] ^ t.t[0][hi >> 24];
+                p += 8;
+                qty -= 8;
+            }
+            while (qty > 0) {
+                crc = t.t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+                qty--;
+            }
+            return ~crc;
+        }
+
+    protected:
+        struct Tables
+        {
+            uint32_t t[8][256];
+
+            Tables() {
+                for (uint32_t i=0; i<256; i++) {
+                    uint32_t crc = i;
+                    for (int j=0; j<8; j++) {
+                        crc = (crc >> 1) ^ ((crc & 1) ? 0x82f63b78 : 0);
+                    }
+                    t[0][i] = crc;
+                }
+                for (int k=1; k<8; k++) {
+                    for (int i=0; i<256; i++) {
+                        t[k][i] = (t[k-1][i] >> 8) ^ t[0][t[k-1][i] & 0xff];
+                    }
+                }
+            }
+        };
+
+        static const Tables& tables() {
+            static const Tables t{};
+            return t;
+        }
+};
+
+//=============================================================================
+class bit_ifstream : public std::istream
+{
+
+
+    public:
+
+        bit_ifstream(const string& fname) : std::istream(nullptr) {
+            init(&buf);
+            if (! buf.open(fname, false)) {
+                setstate(ios::failbit);
+            }
+            // plus initialisation
+            ops.add(5);
+            getarray(reinterpret_cast<char*>(&trash_size), 8);
+            // the upper bits select the method, the lower bits are trash
+            method_bits = trash_size >> 3;
+            trash_size &= 0x07;
+            // every archive ends with its index, one without is cut short
+            if (! has_index()) {
+                throw std::runtime_error("Bad block index.");
+            }
+            ReadIndex();
+        }
+
+        METHOD method() const {
+            return static_cast<METHOD>(method_bits & ~index_flag);
+        }
+
+        void close() {
+            if (! buf.close()) {
+                setstate(ios::failbit);
+            }
+        }
+
+        bool has_index() const {
+            return method_bits & index_flag;
+        }
+
+        const BlockIndex& index() const {
+            return blocks;
+        }
+
+        const SeekTable& seek_table() const {
+            return seek_points;
+        }
+
+        bool has_totals() const {
+            return with_totals;
+        }
+
+        const Totals& totals() const {
+            return sizes;
+        }
+
+        // bits of coded data after the read position, needs the totals
+        uint64_t bits_left() const {
+            return sizes.payload_bits - (pos * 8 - nbit);
+        }
+
+        // first byte after the coded data
+        std::streamoff payload_size() const {
+            return payload_end;
+        }
+
+        // continue reading at the given bit, needs the index
+        bit_ifstream& seekbit(uint64_t bit) {
+            ops.add(4);
+            clear();
+            pos = bit / 8;
+            nbit = 0;
+            seekg(pos, ios::beg);
+            lastbyte = at_end();
+            for (uint64_t i=0; i<bit%8; i++) {
+                ops.add(1);
+                bool skip = false;
+                getbit(skip);
+            }
+            return *this;
+        }
+
+        bit_ifstream& getbit(bool& bit) {
+            ops.add(2);
+            if (lastbyte && nbit <= trash_size) {
+                ops.add(1);
+                setstate(ios::eofbit);
+                return *this;
+            }
+            if (nbit == 0) {
+                ops.add(3);
+                get(bitbuf);
+                nbit = 8;
+                pos++;
+                if (at_end()) {
+                    ops.add(2);
+                    lastbyte = true;
+                    clear();
+                }
+            }
+            // disregard the last trash_size bits in the last byte
+            ops.add(4);
+            bit = (bitbuf & (1 << --nbit)) ? true : false;
+            return *this;
+        }
+
+        // No end of data check, the caller knows from bits_left()
+        // that the bit is there.
+        bit_ifstream& getbit_unchecked(bool& bit) {
+            ops.add(2);
+            if (nbit == 0) {
+                ops.add(3);
+                get(bitbuf);
+                nbit = 8;
+                pos++;
+            }
+            ops.add(4);
+            bit = (bitbuf & (1 << --nbit)) ? true : false;
+            return *this;
+        }
+
+        // the careful getbit again once the unchecked reads are done
+        void finish_unchecked() {
+            ops.add(1);
+            lastbyte = at_end();
+        }
+
+        bit_ifstream& getucs4(char32_t& ch) {
+            try {
+                ops.add(3);
+                string utf8;
+                getutf8(utf8);
+                basic_string<char32_t> ucs4 = ucs4conv.from_bytes(utf8);
+                ch = *ucs4.begin();
+            } catch(const std::range_error& e) {
+                ops.add(1);
+                cout << "Error!\n" << endl;
+                ops.add(1);
+                this->setstate(ios::failbit);
+            }
+            ops.add(1);
+            return *this;
+        }
+
+        // read qty_bits bits, most significant bit first
+        bit_ifstream& getnumber(uint64_t& value, int qty_bits) {
+            ops.add(2);
+            value = 0;
+            for (int i=0; i<qty_bits; i++) {
+                ops.add(4);
+                bool bit = false;
+                getbit(bit);
+                value = (value << 1) | (bit ? 1 : 0);
+            }
+            return *this;
+        }
+
+        // 7 bits per byte, the high bit says that more bytes follow
+        bit_ifstream& getvarint(uint64_t& value) {
+            ops.add(2);
+            value = 0;
+            for (int shift=0; shift<64; shift+=7) {
+                ops.add(4);
+                uint64_t byte = 0;
+                getnumber(byte, 8);
+                value |= (byte & 0x7f) << shift;
+                if (! (byte & 0x80)) {
+                    return *this;
+                }
+            }
+            setstate(ios::failbit);
+            return *this;
+        }
+
+        // Elias gamma code of a value >= 1
+        bit_ifstream& getgamma(uint64_t& value) {
+            ops.add(2);
+            int zeros = 0;
+            bool bit = false;
+            while (getbit(bit).good() && ! bit) {
+                ops.add(2);
+                if (++zeros == 64) {
+                    setstate(ios::failbit);
+                    return *this;
+                }
+            }
+            uint64_t rest = 0;
+            getnumber(rest, zeros);
+            value = (uint64_t{1} << zeros) | rest;
+            return *this;
+        }
+
+        // skip the unread bits of the current byte
+        void align() {
+            ops.add(1);
+            nbit = 0;
+        }
+
+        // Read up to qty whole bytes, the stream must be aligned.
+        // Returns the number of bytes read, eof is set when the data ends.
+        std::streamsize getbytes(char* pbuf, std::streamsize qty) {
+            ops.add(3);
+            if (nbit != 0 || lastbyte) {
+                ops.add(1);
+                if (lastbyte) {
+                    setstate(ios::eofbit);
+                } else {
+                    setstate(ios::failbit);
+                }
+                return 0;
+            }
+            ops.add(1);
+            qty = std::min<std::streamsize>(qty, payload_end - pos);
+            read(pbuf, qty);
+            std::streamsize got = gcount();
+            pos += got;
+            ops.add(got);
+            if (got < qty) {
+                // short read, the data has ended
+                ops.add(2);
+                lastbyte = true;
+                clear();
+                return got;
+            }
+            if (at_end()) {
+                ops.add(2);
+                lastbyte = true;
+                clear();
+            }
+            return got;
+        }
+
+
+    protected:
+        async_filebuf buf;
+        int nbit = 0;
+        uint8_t trash_size = 0;
+        uint8_t method_bits = 0;
+        bool lastbyte = false;
+        char bitbuf;
+        // bytes consumed so far and the end of the coded data,
+        // the header byte is read before the index sets it
+        std::streamoff pos = 0;
+        std::streamoff payload_end = std::numeric_limits<std::streamoff>::max();
+        BlockIndex blocks{};
+        SeekTable seek_points{};
+        bool with_totals = false;
+        Totals sizes{0, 0, 0};
+
+        bool at_end() {
+            return pos >= payload_end;
+        }
+
+        // read n bytes, most significant first
+        uint64_t getraw(int n) {
+            uint64_t value = 0;
+            for (int i=0; i<n; i++) {
+                value = (value << 8) | static_cast<uint8_t>(get());
+            }
+            return value;
+        }
+
+        // 7 bits per byte, the high bit says that more bytes follow
+        uint64_t getrawvarint() {
+            uint64_t value = 0;
+            for (int shift=0; shift<64; shift+=7) {
+                uint64_t byte = static_cast<uint8_t>(get());
+                value |= (byte & 0x7f) << shift;
+                if (! (byte & 0x80)) {
+                    return value;
+                }
+            }
+            setstate(ios::failbit);
+            return value;
+        }
+
+        // The index is at the end: the count of the entries, the
+        // entries, the totals if the flag says so, then the last word.
+        void ReadIndex() {
+            seekg(0, ios::end);
+            std::streamoff size = tellg();
+            if (size < 5) {
+                throw std::runtime_error("Bad block index.");
+            }
+            seekg(size - 4, ios::beg);
+            uint64_t word = getraw(4);
+            if (word & short_index_flag) {
+                ReadShortIndex(size, word);
+                return;
+            }
+            bool has_seek_table = word & seek_table_flag;
+            with_totals = word & totals_flag;
+            std::streamoff length = word & index_length_mask;
+            if (length < 1 || length > size - 5) {
+                throw std::runtime_error("Bad block index.");
+            }
+            payload_end = size - 4 - length;
+            seekg(payload_end, ios::beg);
+            // an entry takes at least 10 bytes
+            uint64_t count = getrawvarint();
+            if (count == 0 || count > static_cast<uint64_t>(length) / 10) {
+                throw std::runtime_error("Bad block index.");
+            }
+            blocks.resize(count);
+            uint64_t offset = 1;
+            for (auto& b : blocks) {
+                b.offset = offset;
+                b.bytes = getrawvarint();
+                b.crc = getraw(4);
+                b.text_bytes = getrawvarint();
+                b.text_crc = getraw(4);
+                offset += b.bytes;
+            }
+            if (with_totals) {
+                sizes.symbols = getrawvarint();
+                sizes.text_bytes = getrawvarint();
+            }
+            if (! good() || tellg() != size - 4) {
+                throw std::runtime_error("Bad block index.");
+            }
+            if (has_seek_table) {
+                ReadSeekTable();
+            }
+            // the coded bits end in the last payload byte
+            sizes.payload_bits = payload_end * 8 - trash_size;
+            seekg(pos, ios::beg);
+            lastbyte = at_end();
+        }
+
+        // One block from the end of the header byte to the index, its
+        // checksums and sizes; the bits of the payload follow from the
+        // trash size.
+        void ReadShortIndex(std::streamoff size, uint64_t count) {
+            with_totals = count & totals_flag;
+            std::streamoff length = count & index_length_mask;
+            if (length < 9 || length > size - 5) {
+                throw std::runtime_error("Bad block index.");
+            }
+            payload_end = size - 4 - length;
+            seekg(payload_end, ios::beg);
+            BlockEntry b{1, static_cast<uint64_t>(payload_end) - 1, 0, 0, 0};
+            b.crc = getraw(4);
+            b.text_crc = getraw(4);
+            b.text_bytes = getrawvarint();
+            if (with_totals) {
+                sizes.symbols = getrawvarint();
+                sizes.text_bytes = b.text_bytes;
+                sizes.payload_bits = payload_end * 8 - trash_size;
+            }
+            if (! good() || tellg() != size - 4) {
+                throw std::runtime_error("Bad block index.");
+            }
+            blocks.assign(1, b);
+            seekg(pos, ios::beg);
+            lastbyte = at_end();
+        }
+
+        // the seek points, then their count, right before the block index
+        void ReadSeekTable() {
+            ops.add(5);
+            if (payload_end < 5) {
+                throw std::runtime_error("Bad seek table.");
+            }
+            seekg(payload_end - 4, ios::beg);
+            uint64_t count = getraw(4);
+            std::streamoff table_size = 4 + count * seek_entry_size;
+            if (table_size > payload_end - 1) {
+                throw std::runtime_error("Bad seek table.");
+            }
+            payload_end -= table_size;
+            seekg(payload_end, ios::beg);
+            seek_points.resize(count);
+            for (auto& sp : seek_points) {
+                ops.add(3);
+                sp.symbol = getraw(8);
+                sp.bit = getraw(8);
+                sp.context = getraw(4);
+            }
+        }
+        wstring_convert<std::codecvt_utf8<char32_t>, char32_t> ucs4conv{};
+
+        // i is the distance from left byte border
+        bool hasbit(char ch, int i) {
+            ops.add(3);
+            return ch & (1 << (7-i));
+        }
+
+        bit_ifstream& getutf8(string& utf8) {
+            ops.add(2);
+            char firstbyte = '\0';
+            getarray(&firstbyte, 8);
+            // examine first byte
+            ops.add(2);
+            if (hasbit(firstbyte, 0)) {
+                // if multibyte then read as many bytes as necessary
+                ops.add(7);
+                int nbytes = 0;
+                while (hasbit(firstbyte, nbytes)) {
+                    ops.add(1);
+                    nbytes++;
+                }
+                char utf8_code[nbytes];
+                std::fill(utf8_code, utf8_code+nbytes, 0);
+                utf8_code[0] = firstbyte;
+                getarray(&utf8_code[1], (nbytes-1) * 8);
+                utf8.append(&utf8_code[0], nbytes);
+            } else {
+                // if single byte
+                ops.add(1);
+                utf8.push_back(firstbyte);
+            }
+            return *this;
+        }
+
+        bit_ifstream& getarray(char* pbuf, int qty_bits) {
+            ops.add(3);
+            char* cur = pbuf;
+            int i=0;
+            while (i<qty_bits) {
+                ops.add(4);
+                bool bit = false;
+                getbit(bit);
+                if (bit) {
+                    ops.add(4);
+                    *cur |= (1 << (7 - i%8));
+                }
+                i++;
+                if (i % 8 == 0) {
+                    ops.add(1);
+                    cur++;
+                }
+            }
+            return *this;
+        }
+
+
+};
+
+//=============================================================================
+class bit_ofstream : public std::ostream
+{
+
+    public:
+
+        bit_ofstream(const string& fname) : std::ostream(nullptr) {
+            init(&buf);
+            if (! buf.open(fname, true)) {
+                setstate(ios::failbit);
+            }
+            // plus initialisation
+            ops.add(3);
+            start_writing();
+        }
+
+        bit_ofstream& putchar32(const char32_t& ch) {
+            ops.add(1);
+            try {
+                ops.add(3);
+                basic_string<char> utf8 = ucs4conv.to_bytes(ch);
+                pututf8(utf8);
+            } catch(const std::range_error& e) {
+                ops.add(2);
+                cout << "Error occured\n" << endl;
+                this->setstate(ios::failbit);
+            }
+            return *this;
+        }
+
+        bit_ofstream& putbit(const bool bit) {
+            ops.add(2);
+            nbit--;
+            if (bit) {
+                ops.add(2);
+                buffer |= (1 << nbit);
+            }
+            if (nbit == 0) {
+                ops.add(3);
+                put(buffer);
+                crc = Crc32c::Update(crc, &buffer, 1);
+                pos++;
+                nbit = 8;
+                buffer = '\0';
+            }
+            return *this;
+        }
+
+        // The same as putbit of each bit in turn, filling the byte buffer
+        // a run of bits at a time. The ops are those such a loop counts
+        // bit by bit, added at once, so .ops stay comparable with it.
+        bit_ofstream& putbits(uint64_t value, int qty_bits) {
+            uint64_t mask = (qty_bits < 64) ? (UINT64_C(1) << qty_bits) - 1 : ~UINT64_C(0);
+            ops.add(4 * qty_bits + 2 * __builtin_popcountll(value & mask));
+            while (qty_bits > 0) {
+                int take = std::min(nbit, qty_bits);
+                qty_bits -= take;
+                buffer |= static_cast<char>(((value >> qty_bits) & ((1u << take) - 1)) << (nbit - take));
+                nbit -= take;
+                if (nbit == 0) {
+                    ops.add(3);
+                    put(buffer);
+                    crc = Crc32c::Update(crc, &buffer, 1);
+                    pos++;
+                    nbit = 8;
+                    buffer = '\0';
+                }
+            }
+            return *this;
+        }
+
+        // write qty_bits bits of value, most significant bit first
+        bit_ofstream& putnumber(uint64_t value, int qty_bits) {
+            ops.add(2);
+            for (int i=qty_bits-1; i>=0; i--) {
+                ops.add(3);
+                putbit((value >> i) & 1);
+            }
+            return *this;
+        }
+
+        // 7 bits per byte, the high bit says that more bytes follow
+        bit_ofstream& putvarint(uint64_t value) {
+            ops.add(2);
+            while (value >= 0x80) {
+                ops.add(3);
+                putnumber((value & 0x7f) | 0x80, 8);
+                value >>= 7;
+            }
+            putnumber(value, 8);
+            return *this;
+        }
+
+        static int varint_bits(uint64_t value) {
+            ops.add(1);
+            int bits = 8;
+            while (value >= 0x80) {
+                ops.add(2);
+                bits += 8;
+                value >>= 7;
+            }
+            return bits;
+        }
+
+        // Elias gamma code of a value >= 1: the width less one
+        // as zero bits, then the value from its leading one bit
+        bit_ofstream& putgamma(uint64_t value) {
+            ops.add(1);
+            int width = gamma_bits(value) / 2 + 1;
+            putnumber(0, width - 1);
+            putnumber(value, width);
+            return *this;
+        }
+
+        static int gamma_bits(uint64_t value) {
+            ops.add(1);
+            int width = 1;
+            while (value >> width) {
+                ops.add(1);
+                width++;
+            }
+            return 2 * width - 1;
+        }
+
+        // pad the current byte with zero bits
+        bit_ofstream& align() {
+            ops.add(1);
+            while (nbit != 8) {
+                ops.add(1);
+                putbit(false);
+            }
+            return *this;
+        }
+
+        // write whole bytes, the stream must be aligned
+        bit_ofstream& putbytes(const char* data, std::streamsize qty) {
+            ops.add(2);
+            if (nbit != 8) {
+                ops.add(1);
+                setstate(ios::failbit);
+                return *this;
+            }
+            ops.add(qty);
+            write(data, qty);
+            crc = Crc32c::Update(crc, data, qty);
+            pos += qty;
+            return *this;
+        }
+
+        // start a new block of the index at the next whole byte
+        void begin_block() {
+            align();
+            if (pos == blocks.back().offset) {
+                // nothing written since the last block started
+                return;
+            }
+            close_block();
+            blocks.push_back(BlockEntry{pos, 0, 0, 0, 0});
+        }
+
+        // size and checksum of the text that the current block decodes to
+        void set_block_text(uint64_t bytes, uint32_t text_crc) {
+            blocks.back().text_bytes = bytes;
+            blocks.back().text_crc = text_crc;
+        }
+
+        size_t block_count() const {
+            return blocks.size();
+        }
+
+        // symbols and UTF-8 bytes of the whole text, the payload
+        // bits are known when writing stops
+        void set_totals(uint64_t symbols, uint64_t text_bytes) {
+            with_totals = true;
+            sizes.symbols = symbols;
+            sizes.text_bytes = text_bytes;
+        }
+
+        bool has_totals() const {
+            return with_totals;
+        }
+
+        // decoding can start over at the next bit
+        void add_seek_point(uint64_t symbol, char32_t context) {
+            ops.add(2);
+            seek_points.push_back(SeekPoint{symbol, pos * 8 + (8 - nbit), context});
+        }
+
+        void set_method(METHOD m) {
+            method_bits = static_cast<uint8_t>(m);
+        }
+
+        void close() {
+            if (! buf.close()) {
+                setstate(ios::failbit);
+            }
+        }
+
+        // everything written is dropped, the stream is as just opened
+        void restart() {
+            ops.add(10);
+            if (! buf.restart()) {
+                setstate(ios::failbit);
+            }
+            nbit = 8;
+            buffer = '\0';
+            method_bits = 0;
+            pos = 0;
+            crc = 0;
+            blocks.clear();
+            seek_points.clear();
+            with_totals = false;
+            sizes = Totals{0, 0, 0};
+            start_writing();
+        }
+
+        void stop_writing() {
+            // remember the trash size
+            ops.add(4);
+            // write the buffer byte to be filled with data and trash
+            char trash_size = (nbit % 8) | ((method_bits | index_flag) << 3);
+            sizes.payload_bits = pos * 8 + (8 - nbit);
+            // write trash
+            while (nbit != 8) {
+                ops.add(1);
+                putbit(false);
+            }
+            close_block();
+            WriteIndex();
+            // rewind
+            seekp(0, ios::beg);
+            // write the trash size
+            putarray(&trash_size, 8);
+        }
+
+    protected:
+        async_filebuf buf;
+        int nbit = 8;
+        char buffer = '\0';
+        uint8_t method_bits = 0;
+        wstring_convert<std::codecvt_utf8<char32_t>, char32_t> ucs4conv;
+        // bytes written so far, the running checksum of the current block
+        uint64_t pos = 0;
+        uint32_t crc = 0;
+        BlockIndex blocks{};
+        SeekTable seek_points{};
+        bool with_totals = false;
+        Totals sizes{0, 0, 0};
+
+        void close_block() {
+            blocks.back().bytes = pos - blocks.back().offset;
+            blocks.back().crc = crc;
+            crc = 0;
+        }
+
+        // write n bytes of value, most significant first
+        void putraw(uint64_t value, int n) {
+            for (int i=n-1; i>=0; i--) {
+                put(static_cast<char>(value >> (8 * i)));
+            }
+        }
+
+        // 7 bits per byte, the high bit says that more bytes follow,
+        // returns the bytes written
+        int putrawvarint(uint64_t value) {
+            int n = 1;
+            while (value >= 0x80) {
+                put(static_cast<char>((value & 0x7f) | 0x80));
+                value >>= 7;
+                n++;
+            }
+            put(static_cast<char>(value));
+            return n;
+        }
+
+        // the seek table if there is one, the entries, the totals
+        // if they are known, then the count of the entries
+        void WriteIndex() {
+            const BlockEntry& last = blocks.back();
+            if (blocks.size() == 1 && seek_points.empty()
+                    && (! with_totals || sizes.text_bytes == last.text_bytes)) {
+                // the payload is the rest of the archive
+                uint32_t length = 8;
+                putraw(last.crc, 4);
+                putraw(last.text_crc, 4);
+                length += putrawvarint(last.text_bytes);
+                if (with_totals) {
+                    length += putrawvarint(sizes.symbols);
+                    length |= totals_flag;
+                }
+                putraw(length | short_index_flag, 4);
+                return;
+            }
+            uint32_t flags = 0;
+            if (! seek_points.empty()) {
+                ops.add(2);
+                for (const auto& sp : seek_points) {
+                    ops.add(3);
+                    putraw(sp.symbol, 8);
+                    putraw(sp.bit, 8);
+                    putraw(sp.context, 4);
+                }
+                putraw(seek_points.size(), 4);
+                flags |= seek_table_flag;
+            }
+            // the offsets follow from the sizes
+            uint64_t length = putrawvarint(blocks.size());
+            for (const auto& b : blocks) {
+                length += putrawvarint(b.bytes);
+                putraw(b.crc, 4);
+                length += putrawvarint(b.text_bytes);
+                putraw(b.text_crc, 4);
+                length += 8;
+            }
+            if (with_totals) {
+                length += putrawvarint(sizes.symbols);
+                length += putrawvarint(sizes.text_bytes);
+                flags |= totals_flag;
+            }
+            if (length > index_length_mask) {
+                throw std::runtime_error("Block index too large.");
+            }
+            putraw(length | flags, 4);
+        }
+
+        bit_ofstream& putarray(const char* data, int qty_bits) {
+            ops.add(3);
+            const char* cur = data;
+            int i=0;
+            while (i<qty_bits) {
+                ops.add(7);
+                putbit( *cur & (1 << (7-(i%8))) );
+                i++;
+                if (i % 8 == 0) {
+                    ops.add(1);
+                    cur++;
+                }
+            }
+            return *this;
+        }
+
+        bit_ofstream& pututf8(const string& utf8) {
+            ops.add(4);
+            putarray(utf8.c_str(), utf8.size() * 8);
+            return *this;
+        }
+
+        void start_writing() {
+            // write an empty byte, which will get overriden in stop_writing()
+            ops.add(2);
+            put('\0');
+            pos = 1;
+            blocks.push_back(BlockEntry{pos, 0, 0, 0, 0});
+        }
+
+};
+
+
+/** @} */ // end doxygroup
+
+/* -----------------------------------------------------------------------------*/
+/**
+ *  @defgroup symbol_tables Flat code tables of the order-0 coders,
+ *  compiled for the narrowest symbol type that holds the alphabet.
+ *  @{
+ */
+
+
+//=============================================================================
+// Symbol types the code trees are compiled for, and the number of
+// symbols each holds. Every tree is read with char32_t symbols, the
+// order-0 coders narrow it to the smallest type that holds them.
+template <typename T> struct SymbolTraits;
+
+template <> struct SymbolTraits<uint8_t>
+{
+    static constexpr uint32_t limit = 0x100;
+};
+
+template <> struct SymbolTraits<uint16_t>
+{
+    static constexpr uint32_t limit = 0x10000;
+};
+
+template <> struct SymbolTraits<char32_t>
+{
+    static constexpr uint32_t limit = 0x110000;
+};
+
+// a code right aligned in bits
+struct PackedCode
+{
+    uint64_t bits;
+    uint32_t len;
+};
+
+//=============================================================================
+// Codes by symbol, kept as the tree they make: every node links to its
+// parent, every symbol to its leaf. A code adds a node per bit that no
+// code before it shares, so the codes of a tree take a node per tree
+// node however deep it is. A code is spelled out from its leaf up only
+// where it is written.
+class EncodeHuffmanMap
+{
+    public:
+        // the symbols in increasing order with their leaves
+        typedef std::map<char32_t, uint32_t>::const_iterator const_iterator;
+
+        EncodeHuffmanMap() {
+            clear();
+        }
+
+        // no codes, only the root
+        void clear() {
+            nodes.assign(1, Node{0, {0, 0}, 0, false});
+            leaves.clear();
+        }
+
+        size_t size() const {
+            return leaves.size();
+        }
+
+        bool empty() const {
+            return leaves.empty();
+        }
+
+        const_iterator begin() const {
+            return leaves.begin();
+        }
+
+        const_iterator end() const {
+            return leaves.end();
+        }
+
+        const_iterator find(char32_t ch) const {
+            return leaves.find(ch);
+        }
+
+        void swap(EncodeHuffmanMap& other) {
+            nodes.swap(other.nodes);
+            leaves.swap(other.leaves);
+        }
+
+        // the highest symbol with a code, 0 if there is none
+        char32_t widest() const {
+            return leaves.empty() ? 0 : leaves.rbegin()->first;
+        }
+
+        // the node a bit below node, made if there is none; 0 is the root
+        uint32_t Child(uint32_t node, bool bit)
+        {
+            if (nodes[node].child[bit] == 0) {
+                Node child{node, {0, 0}, nodes[node].depth + 1, bit};
+                nodes[node].child[bit] = nodes.size();
+                nodes.push_back(child);
+            }
+            return nodes[node].child[bit];
+        }
+
+        // the code that leads to node is that of ch
+        void SetLeaf(char32_t ch, uint32_t node) {
+            leaves[ch] = node;
+        }
+
+        void Add(char32_t ch, const VariableCode& code)
+        {
+            uint32_t node = 0;
+            for (const auto& bit : code) {
+                node = Child(node, bit);
+            }
+            leaves[ch] = node;
+        }
+
+        // length of the code of ch, 0 if it has none
+        size_t Length(char32_t ch) const {
+            auto found = leaves.find(ch);
+            return (found != leaves.end()) ? nodes[found->second].depth : 0;
+        }
+
+        // length of the code that ends in leaf
+        size_t Depth(uint32_t leaf) const {
+            return nodes[leaf].depth;
+        }
+
+        // the code of ch, empty if it has none
+        VariableCode Code(char32_t ch) const
+        {
+            auto found = leaves.find(ch);
+            if (found == leaves.end()) {
+                return VariableCode{};
+            }
+            uint32_t node = found->second;
+            VariableCode code(nodes[node].depth);
+            for (size_t i=code.size(); i-- > 0; node = nodes[node].parent) {
+                code[i] = nodes[node].bit;
+            }
+            return code;
+        }
+
+        // the code that ends in leaf, false if it is longer than 64 bits
+        bool Pack(uint32_t leaf, PackedCode& code) const
+        {
+            code = PackedCode{0, nodes[leaf].depth};
+            if (code.len > 64) {
+                return false;
+            }
+            uint32_t node = leaf;
+            for (uint32_t i=0; i<code.len; i++, node = nodes[node].parent) {
+                code.bits |= static_cast<uint64_t>(nodes[node].bit) << i;
+            }
+            return true;
+        }
+
+        // the code of ch, nothing if it has none; counted as a putbit
+        // loop over its bits
+        void Write(char32_t ch, bit_ofstream& os) const
+        {
+            auto found = leaves.find(ch);
+            if (found == leaves.end()) {
+                return;
+            }
+            PackedCode code;
+            if (Pack(found->second, code)) {
+                os.putbits(code.bits, code.len);
+                return;
+            }
+            for (const auto& bit : Code(ch)) {
+                ops.add(2);
+                os.putbit(bit);
+            }
+        }
+
+    private:
+        struct Node
+        {
+            uint32_t parent;
+            uint32_t child[2];
+            uint32_t depth;
+            bool bit;
+        };
+
+        vector<Node> nodes;
+        std::map<char32_t, uint32_t> leaves;
+};
+
+typedef std::map<char32_t, EncodeHuffmanMap> ContextEncodeMap;
+
+//=============================================================================
+// The codes of EncodeHuffmanMap in an array indexed by the symbol, as
+// long as the highest symbol coded so far
+template <typename T>
+class CodeTable
+{
+    public:
+        static constexpr uint32_t size = SymbolTraits<T>::limit;
+
+        // false if a symbol does not fit T or a code does not fit 64 bits
+        bool Fill(const EncodeHuffmanMap& ch2code)
+        {
+            ops.add(2);
+            // a table filled before clears only the codes it was given
+            for (const auto& ch : filled) {
+                codes[ch] = PackedCode{0, 0};
+            }
+            filled.clear();
+            if (ch2code.empty()) {
+                return true;
+            }
+            char32_t widest = ch2code.widest();
+            if (widest >= size) {
+                return false;
+            }
+            if (codes.size() <= widest) {
+                codes.resize(widest + 1, PackedCode{0, 0});
+            }
+            for (const auto& entry : ch2code) {
+                ops.add(3);
+                PackedCode code;
+                if (! ch2code.Pack(entry.second, code)) {
+                    return false;
+                }
+                ops.add(2 * code.len);
+                filled.push_back(entry.first);
+                codes[entry.first] = code;
+            }
+            return true;
+        }
+
+        const PackedCode& operator[](T ch) const {
+            return codes[ch];
+        }
+
+        // whether ch has a code in the table
+        bool Has(char32_t ch) const {
+            return ch < codes.size() && codes[ch].len > 0;
+        }
+
+        // A table of the thread that is filled again for every text: the
+        // workers of a batch or a server code many small texts, where
+        // clearing the whole table would take longer than coding them.
+        static CodeTable& OfThread()
+        {
+            static thread_local std::unique_ptr<CodeTable> table{new CodeTable};
+            return *table;
+        }
+
+    private:
+        vector<PackedCode> codes;
+        vector<T> filled;
+};
+
+//=============================================================================
+// A code tree as an array of nodes, node 0 the root, walked a bit at a
+// time. The decoder reads every tree into one of char32_t symbols as it
+// comes, a node per tree node however deep the tree is; the order-0
+// loops copy it into one of the narrowest type that holds its symbols.
+template <typename T>
+class DecodeTree
+{
+    template <typename> friend class DecodeTree;
+
+    public:
+        DecodeTree() {
+            clear();
+        }
+
+        // no codes, only the root
+        void clear() {
+            nodes.assign(1, Node{{0, 0}, 0, false});
+            leaves = 0;
+            depth = 0;
+            top = 0;
+        }
+
+        // the number of codes
+        size_t size() const {
+            return leaves;
+        }
+
+        bool empty() const {
+            return leaves == 0;
+        }
+
+        void swap(DecodeTree& other) {
+            nodes.swap(other.nodes);
+            std::swap(leaves, other.leaves);
+            std::swap(depth, other.depth);
+            std::swap(top, other.top);
+        }
+
+        // the node a bit below node, made if there is none
+        uint32_t Child(uint32_t node, bool bit)
+        {
+            if (nodes[node].child[bit] == 0) {
+                nodes[node].child[bit] = nodes.size();
+                nodes.push_back(Node{{0, 0}, 0, false});
+            }
+            return nodes[node].child[bit];
+        }
+
+        // node, length bits below the root, is the leaf of symbol
+        void SetLeaf(uint32_t node, T symbol, size_t length)
+        {
+            nodes[node].leaf = true;
+            nodes[node].symbol = symbol;
+            leaves++;
+            depth = std::max(depth, length);
+            top = std::max(top, symbol);
+        }
+
+        // false if code is the prefix of a code added before or has one
+        bool Add(const VariableCode& code, T symbol)
+        {
+            uint32_t node = 0;
+            for (const auto& bit : code) {
+                if (nodes[node].leaf) {
+                    return false;
+                }
+                node = Child(node, bit);
+            }
+            if (node == 0 || nodes[node].leaf || nodes[node].child[0] != 0 || nodes[node].child[1] != 0) {
+                return false;
+            }
+            SetLeaf(node, symbol, code.size());
+            return true;
+        }
+
+        // False, and no codes, unless the symbols of codes fit T and its
+        // codes make a full binary tree: then every walk of longest()
+        // bits ends in a leaf.
+        template <typename U>
+        bool Fill(const DecodeTree<U>& codes)
+        {
+            ops.add(3);
+            if (codes.size() < 2 || codes.widest() >= SymbolTraits<T>::limit) {
+                clear();
+                return false;
+            }
+            nodes.resize(codes.nodes.size());
+            for (size_t i=0; i<nodes.size(); i++) {
+                ops.add(2);
+                const typename DecodeTree<U>::Node& from = codes.nodes[i];
+                if (! from.leaf && (from.child[0] == 0 || from.child[1] == 0)) {
+                    clear();
+                    return false;
+                }
+                nodes[i] = Node{{from.child[0], from.child[1]}, static_cast<T>(from.symbol), from.leaf};
+            }
+            leaves = codes.leaves;
+            depth = codes.depth;
+            top = static_cast<T>(codes.top);
+            return true;
+        }
+
+        size_t longest() const {
+            return depth;
+        }
+
+        // the highest symbol, the symbol of a tree of one code
+        T widest() const {
+            return top;
+        }
+
+        // where bit leads from node, 0 if no code goes on that way
+        uint32_t Next(uint32_t node, bool bit) const {
+            return nodes[node].child[bit];
+        }
+
+        bool Leaf(uint32_t node) const {
+            return nodes[node].leaf;
+        }
+
+        T Symbol(uint32_t node) const {
+            return nodes[node].symbol;
+        }
+
+        // one code, false at the end of the coded data or at a bit no
+        // code has
+        bool Decode(bit_ifstream& is, T& symbol) const
+        {
+            uint32_t node = 0;
+            bool bit = false;
+            do {
+                ops.add(2);
+                if (! is.getbit(bit).good()) {
+                    return false;
+                }
+                node = nodes[node].child[bit];
+            } while (node != 0 && ! nodes[node].leaf);
+            symbol = nodes[node].symbol;
+            return node != 0;
+        }
+
+        // one code of a full tree, the caller knows from bits_left()
+        // that it is there
+        T DecodeUnchecked(bit_ifstream& is) const
+        {
+            uint32_t node = 0;
+            bool bit = false;
+            do {
+                // as the bit by bit DecodeSymbol counts it
+                ops.add(2);
+                is.getbit_unchecked(bit);
+                node = nodes[node].child[bit];
+            } while (! nodes[node].leaf);
+            return nodes[node].symbol;
+        }
+
+    private:
+        struct Node
+        {
+            uint32_t child[2];
+            T symbol;
+            bool leaf;
+        };
+
+        vector<Node> nodes;
+        size_t leaves = 0;
+        size_t depth = 0;
+        T top = 0;
+};
+
+// codes to symbols as the decoder reads them
+typedef DecodeTree<char32_t> DecodeMap;
+typedef std::map<char32_t, DecodeMap> ContextDecodeMap;
+
+template <typename T> constexpr uint32_t CodeTable<T>::size;
+
+// Sampled archives code a symbol the sample did not see as this one,
+// then its code point in escape_bits bits. A surrogate is never a
+// character of the text.
+const char32_t escape_symbol = 0xD800;
+const int escape_bits = 21;
+
+//=============================================================================
+// Code lengths instead of a tree, for the small texts where the tree is
+// a large share of the archive. The codes are the canonical codes of
+// the lengths: shorter codes first, equal lengths in symbol order.
+//
+// The symbols in increasing order:
+//   1 bit             - an ASCII bitmap follows
+//   128 bits          - bit c is set if symbol c is there
+//   gamma(n + 1)      - the number of the other symbols
+//   gamma(gap)        - per symbol, the distance from the previous one
+//                       (from 127 for the first, or -1 without a bitmap)
+// Their code lengths, coded with a code of lengths:
+//   gamma(longest)    - the longest code length
+//   gamma(len + 1)    - per length 1..longest, the length of its code,
+//                       0 if no symbol has it
+//   the code of each symbol's length, in symbol order; none at all
+//   if every symbol has the same length
+class CompactHeader
+{
+    public:
+        typedef std::map<char32_t, uint32_t> Lengths;
+
+        // codes longer than this are left to the tree
+        static const uint32_t max_length = 64;
+
+        static Lengths Of(const EncodeHuffmanMap& ch2code)
+        {
+            ops.add(1);
+            Lengths lengths;
+            for (const auto& entry : ch2code) {
+                ops.add(2);
+                lengths[entry.first] = ch2code.Depth(entry.second);
+            }
+            return lengths;
+        }
+
+        // size of the header, UINT64_MAX if it can not hold the lengths
+        static uint64_t Bits(const Lengths& lengths)
+        {
+            ops.add(2);
+            if (! Usable(lengths)) {
+                return UINT64_MAX;
+            }
+            return std::min(SymbolBits(lengths, false), SymbolBits(lengths, true))
+                + LengthBits(lengths);
+        }
+
+        static void Write(const Lengths& lengths, bit_ofstream& os)
+        {
+            ops.add(5);
+            // the bitmap only if it makes the header smaller
+            bool bitmap = SymbolBits(lengths, true) < SymbolBits(lengths, false);
+            os.putbit(bitmap);
+            char32_t next = 0;
+            if (bitmap) {
+                ops.add(1);
+                for (char32_t c=0; c<ascii; c++) {
+                    ops.add(2);
+                    os.putbit(lengths.count(c) > 0);
+                }
+                next = ascii;
+            }
+            os.putgamma(std::distance(lengths.lower_bound(next), lengths.end()) + 1);
+            for (auto it=lengths.lower_bound(next); it!=lengths.end(); ++it) {
+                ops.add(3);
+                os.putgamma(it->first - next + 1);
+                next = it->first + 1;
+            }
+
+            vector<uint32_t> code_lengths = LengthCode(lengths);
+            os.putgamma(code_lengths.size() - 1);
+            for (size_t len=1; len<code_lengths.size(); len++) {
+                ops.add(1);
+                os.putgamma(code_lengths[len] + 1);
+            }
+            if (Used(code_lengths) == 1) {
+                return;
+            }
+            vector<VariableCode> codes = Canonical(code_lengths);
+            for (const auto& entry : lengths) {
+                ops.add(1);
+                for (const auto& bit : codes[entry.second]) {
+                    ops.add(2);
+                    os.putbit(bit);
+                }
+            }
+        }
+
+        static Lengths Read(bit_ifstream& is)
+        {
+            ops.add(5);
+            Lengths lengths;
+            bool bitmap = false;
+            is.getbit(bitmap);
+            uint64_t next = 0;
+            if (bitmap) {
+                ops.add(1);
+                for (char32_t c=0; c<ascii; c++) {
+                    ops.add(2);
+                    bool there = false;
+                    is.getbit(there);
+                    if (there) {
+                        lengths[c] = 0;
+                    }
+                }
+                next = ascii;
+            }
+            uint64_t n = 0;
+            is.getgamma(n);
+            if (! is.good() || n - 1 > symbol_limit) {
+                throw runtime_error("Bad code lengths.");
+            }
+            for (uint64_t i=1; i<n; i++) {
+                ops.add(3);
+                uint64_t gap = 0;
+                is.getgamma(gap);
+                if (! is.good() || gap > symbol_limit) {
+                    throw runtime_error("Bad code lengths.");
+                }
+                next += gap - 1;
+                if (next >= symbol_limit) {
+                    throw runtime_error("Bad code lengths.");
+                }
+                lengths[next++] = 0;
+            }
+
+            uint64_t longest = 0;
+            is.getgamma(longest);
+            if (! is.good() || longest == 0 || longest > max_length || lengths.empty()) {
+                throw runtime_error("Bad code lengths.");
+            }
+            vector<uint32_t> code_lengths(longest + 1, 0);
+            for (size_t len=1; len<code_lengths.size(); len++) {
+                ops.add(2);
+                uint64_t value = 0;
+                is.getgamma(value);
+                if (! is.good() || value - 1 > max_length) {
+                    throw runtime_error("Bad code lengths.");
+                }
+                code_lengths[len] = value - 1;
+            }
+            if (Used(code_lengths) == 0) {
+                throw runtime_error("Bad code lengths.");
+            }
+            if (Used(code_lengths) == 1) {
+                ops.add(1);
+                uint32_t only = std::find_if(code_lengths.begin(), code_lengths.end(),
+                        [](uint32_t len) { return len > 0; }) - code_lengths.begin();
+                for (auto& entry : lengths) {
+                    ops.add(1);
+                    entry.second = only;
+                }
+            } else {
+                ops.add(2);
+                if (! Fits(code_lengths)) {
+                    throw runtime_error("Bad code lengths.");
+                }
+                vector<VariableCode> codes = Canonical(code_lengths);
+                std::map<VariableCode, uint32_t> length_of;
+                for (size_t len=1; len<codes.size(); len++) {
+                    ops.add(1);
+                    if (code_lengths[len] > 0) {
+                        length_of[codes[len]] = len;
+                    }
+                }
+                for (auto& entry : lengths) {
+                    ops.add(2);
+                    VariableCode code{};
+                    bool bit = false;
+                    auto found = length_of.end();
+                    while (found == length_of.end() && is.getbit(bit).good()) {
+                        ops.add(3);
+                        code.push_back(bit);
+                        found = length_of.find(code);
+                    }
+                    if (found == length_of.end()) {
+                        throw runtime_error("Bad code lengths.");
+                    }
+                    entry.second = found->second;
+                }
+            }
+            vector<uint32_t> by_symbol;
+            for (const auto& entry : lengths) {
+                ops.add(1);
+                by_symbol.push_back(entry.second);
+            }
+            if (! Fits(by_symbol)) {
+                throw runtime_error("Bad code lengths.");
+            }
+            return lengths;
+        }
+
+        // the canonical codes of the symbols
+        static void Codes(const Lengths& lengths, EncodeHuffmanMap& ch2code)
+        {
+            ops.add(2);
+            vector<uint32_t> by_symbol;
+            for (const auto& entry : lengths) {
+                ops.add(1);
+                by_symbol.push_back(entry.second);
+            }
+            vector<VariableCode> codes = Canonical(by_symbol);
+            ch2code.clear();
+            size_t i = 0;
+            for (const auto& entry : lengths) {
+                ops.add(2);
+                ch2code.Add(entry.first, codes[i++]);
+            }
+        }
+
+        static void Codes(const Lengths& lengths, DecodeMap& code2ch)
+        {
+            ops.add(4);
+            vector<uint32_t> by_symbol;
+            for (const auto& entry : lengths) {
+                ops.add(1);
+                by_symbol.push_back(entry.second);
+            }
+            vector<VariableCode> codes = Canonical(by_symbol);
+            code2ch.clear();
+            size_t i = 0;
+            for (const auto& entry : lengths) {
+                ops.add(4);
+                if (! code2ch.Add(codes[i++], entry.first)) {
+                    throw runtime_error("Bad code lengths.");
+                }
+            }
+        }
+
+    private:
+        static const char32_t ascii = 0x80;
+        static const uint64_t symbol_limit = 0x110000;
+
+        static bool Usable(const Lengths& lengths)
+        {
+            ops.add(1);
+            for (const auto& entry : lengths) {
+                ops.add(2);
+                if (entry.second == 0 || entry.second > max_length) {
+                    return false;
+                }
+            }
+            return ! lengths.empty();
+        }
+
+        // the symbol set with or without the ASCII bitmap
+        static uint64_t SymbolBits(const Lengths& lengths, bool bitmap)
+        {
+            ops.add(3);
+            char32_t next = bitmap ? ascii : 0;
+            uint64_t bits = 1 + (bitmap ? ascii : 0);
+            bits += bit_ofstream::gamma_bits(std::distance(lengths.lower_bound(next), lengths.end()) + 1);
+            for (auto it=lengths.lower_bound(next); it!=lengths.end(); ++it) {
+                ops.add(3);
+                bits += bit_ofstream::gamma_bits(it->first - next + 1);
+                next = it->first + 1;
+            }
+            return bits;
+        }
+
+        // the lengths and the code that codes them
+        static uint64_t LengthBits(const Lengths& lengths)
+        {
+            ops.add(3);
+            vector<uint32_t> code_lengths = LengthCode(lengths);
+            uint64_t bits = bit_ofstream::gamma_bits(code_lengths.size() - 1);
+            for (size_t len=1; len<code_lengths.size(); len++) {
+                ops.add(1);
+                bits += bit_ofstream::gamma_bits(code_lengths[len] + 1);
+            }
+            if (Used(code_lengths) == 1) {
+                return bits;
+            }
+            for (const auto& entry : lengths) {
+                ops.add(1);
+                bits += code_lengths[entry.second];
+            }
+            return bits;
+        }
+
+        // Huffman code lengths of the code lengths, indexed by the length,
+        // a lone length gets 1
+        static vector<uint32_t> LengthCode(const Lengths& lengths)
+        {
+            ops.add(3);
+            vector<uint64_t> freq(1, 0);
+            for (const auto& entry : lengths) {
+                ops.add(2);
+                if (freq.size() <= entry.second) {
+                    freq.resize(entry.second + 1, 0);
+                }
+                freq[entry.second]++;
+            }
+            // nodes 0..freq.size()-1 are the lengths, the rest join two of them
+            typedef std::pair<uint64_t, size_t> Weight;
+            std::priority_queue<Weight, vector<Weight>, std::greater<Weight>> trees;
+            vector<size_t> parent(freq.size(), 0);
+            for (size_t len=1; len<freq.size(); len++) {
+                ops.add(1);
+                if (freq[len] > 0) {
+                    trees.push(Weight{freq[len], len});
+                }
+            }
+            vector<uint32_t> code_lengths(freq.size(), 0);
+            if (trees.size() == 1) {
+                ops.add(1);
+                code_lengths[trees.top().second] = 1;
+                return code_lengths;
+            }
+            while (trees.size() > 1) {
+                ops.add(6);
+                Weight a = trees.top();
+                trees.pop();
+                Weight b = trees.top();
+                trees.pop();
+                parent.push_back(0);
+                parent[a.second] = parent[b.second] = parent.size() - 1;
+                trees.push(Weight{a.first + b.first, parent.size() - 1});
+            }
+            size_t root = trees.top().second;
+            for (size_t len=1; len<freq.size(); len++) {
+                ops.add(1);
+                if (freq[len] == 0) {
+                    continue;
+                }
+                for (size_t node=len; node!=root; node=parent[node]) {
+                    ops.add(2);
+                    code_lengths[len]++;
+                }
+            }
+            return code_lengths;
+        }
+
+        static size_t Used(const vector<uint32_t>& code_lengths)
+        {
+            ops.add(1);
+            return code_lengths.size() - std::count(code_lengths.begin(), code_lengths.end(), 0);
+        }
+
+        // no more codes of each length than the shorter ones leave room for
+        static bool Fits(const vector<uint32_t>& lens)
+        {
+            ops.add(2);
+            vector<uint64_t> count(max_length + 1, 0);
+            for (const auto& len : lens) {
+                ops.add(2);
+                if (len > max_length) {
+                    return false;
+                }
+                count[len]++;
+            }
+            // free codes of the current length, never more than the symbols
+            uint64_t room = 1;
+            for (uint32_t len=1; len<=max_length; len++) {
+                ops.add(3);
+                room = std::min<uint64_t>(2 * room, symbol_limit + 1);
+                if (count[len] > room) {
+                    return false;
+                }
+                room -= count[len];
+            }
+            return true;
+        }
+
+        // Canonical codes for lens in their order, 0 - no code.
+        // lens must fit.
+        static vector<VariableCode> Canonical(const vector<uint32_t>& lens)
+        {
+            ops.add(3);
+            vector<uint64_t> count(max_length + 1, 0);
+            for (const auto& len : lens) {
+                ops.add(1);
+                count[len]++;
+            }
+            count[0] = 0;
+            vector<uint64_t> next(max_length + 1, 0);
+            uint64_t code = 0;
+            for (uint32_t len=1; len<=max_length; len++) {
+                ops.add(2);
+                code = (code + count[len - 1]) << 1;
+                next[len] = code;
+            }
+            vector<VariableCode> codes(lens.size());
+            for (size_t i=0; i<lens.size(); i++) {
+                ops.add(2);
+                uint32_t len = lens[i];
+                if (len == 0) {
+                    continue;
+                }
+                uint64_t value = next[len]++;
+                for (uint32_t bit=len; bit>0; bit--) {
+                    ops.add(2);
+                    codes[i].push_back((value >> (bit - 1)) & 1);
+                }
+            }
+            return codes;
+        }
+};
+
+const uint32_t CompactHeader::max_length;
+const char32_t CompactHeader::ascii;
+const uint64_t CompactHeader::symbol_limit;
+
+
+/** @} */ // end doxygroup
+
+/* -----------------------------------------------------------------------------*/
+/**
+ *  @defgroup transforms Reversible transforms applied to a block of
+ *  symbols before it reaches the entropy coder.
+ *  @{
+ */
+
+
+//=============================================================================
+class BwtTransform
+{
+    public:
+        // text holds symbol ranks 0..k-1. Returns the last column of the
+        // sorted rotations of text + end marker, without the row that ends
+        // with the marker. The index of that row is returned in primary.
+        static vector<uint32_t> Forward(const vector<uint32_t>& text, uint32_t k, uint32_t& primary)
+        {
+            ops.add(4);
+            int32_t n = text.size();
+            vector<int32_t> s(n + 1);
+            for (int32_t i=0; i<n; i++) {
+                ops.add(2);
+                s[i] = text[i] + 1;
+            }
+            s[n] = 0;
+            vector<int32_t> sa(n + 1);
+            SaIs(s.data(), sa.data(), n + 1, k + 1);
+            vector<uint32_t> last;
+            last.reserve(n);
+            primary = 0;
+            for (int32_t i=0; i<=n; i++) {
+                ops.add(3);
+                if (sa[i] == 0) {
+                    primary = i;
+                } else {
+                    last.push_back(text[sa[i] - 1]);
+                }
+            }
+            return last;
+        }
+
+        static vector<uint32_t> Inverse(const vector<uint32_t>& last, uint32_t primary, uint32_t k)
+        {
+            ops.add(4);
+            uint32_t n = last.size();
+            vector<uint32_t> text(n);
+            if (n == 0) {
+                return text;
+            }
+            if (primary > n) {
+                throw runtime_error("Bad BWT primary index.");
+            }
+            // the end marker sorts first, so symbol c starts at row 1 + count(< c)
+            vector<uint32_t> start(k + 1, 0);
+            for (const auto& c : last) {
+                ops.add(2);
+                if (c >= k) {
+                    throw runtime_error("Bad BWT symbol.");
+                }
+                ++start[c + 1];
+            }
+            start[0] = 1;
+            for (uint32_t c=1; c<=k; c++) {
+                ops.add(2);
+                start[c] += start[c - 1];
+            }
+            // LF mapping over all n + 1 rows, the marker row maps to row 0
+            vector<uint32_t> lf(n + 1);
+            for (uint32_t r=0; r<=n; r++) {
+                ops.add(3);
+                if (r == primary) {
+                    lf[r] = 0;
+                } else {
+                    lf[r] = start[last[r < primary ? r : r - 1]]++;
+                }
+            }
+            // row 0 is the rotation starting with the marker,
+            // its last symbol is the last symbol of the text
+            uint32_t r = 0;
+            for (uint32_t i=n; i>0; i--) {
+                ops.add(4);
+                if (r == primary) {
+                    throw runtime_error("Bad BWT primary index.");
+                }
+                text[i - 1] = last[r < primary ? r : r - 1];
+                r = lf[r];
+            }
+            return text;
+        }
+
+    protected:
+        // Suffix array by induced sorting (SA-IS, Nong, Zhang & Chan 2009).
+        // s[n-1] must be the unique smallest symbol, all symbols < k.
+        static void SaIs(const int32_t* s, int32_t* sa, int32_t n, int32_t k)
+        {
+            ops.add(4);
+            // true for S-type suffixes
+            vector<bool> t(n);
+            t[n - 1] = true;
+            for (int32_t i=n-2; i>=0; i--) {
+                ops.add(4);
+                t[i] = s[i] < s[i + 1] || (s[i] == s[i + 1] && t[i + 1]);
+            }
+            auto is_lms = [&t](int32_t i) {
+                return i > 0 && t[i] && ! t[i - 1];
+            };
+            vector<int32_t> bkt(k);
+            auto get_buckets = [&](bool end) {
+                std::fill(bkt.begin(), bkt.end(), 0);
+                for (int32_t i=0; i<n; i++) {
+                    ops.add(2);
+                    ++bkt[s[i]];
+                }
+                int32_t sum = 0;
+                for (int32_t c=0; c<k; c++) {
+                    ops.add(3);
+                    sum += bkt[c];
+                    bkt[c] = end ? sum : sum - bkt[c];
+                }
+            };
+            auto induce = [&]() {
+                get_buckets(false);
+                for (int32_t i=0; i<n; i++) {
+                    ops.add(4);
+                    int32_t j = sa[i] - 1;
+                    if (sa[i] > 0 && ! t[j]) {
+                        sa[bkt[s[j]]++] = j;
+                    }
+                }
+                get_buckets(true);
+                for (int32_t i=n-1; i>=0; i--) {
+                    ops.add(4);
+                    int32_t j = sa[i] - 1;
+                    if (sa[i] > 0 && t[j]) {
+                        sa[--bkt[s[j]]] = j;
+                    }
+                }
+            };
+
+            // stage 1: sort the LMS substrings
+            get_buckets(true);
+            std::fill(sa, sa + n, -1);
+            for (int32_t i=1; i<n; i++) {
+                ops.add(2);
+                if (is_lms(i)) {
+                    sa[--bkt[s[i]]] = i;
+                }
+            }
+            induce();
+
+            // compact the sorted LMS positions and name the substrings
+            int32_t n1 = 0;
+            for (int32_t i=0; i<n; i++) {
+                ops.add(2);
+                if (is_lms(sa[i])) {
+                    sa[n1++] = sa[i];
+                }
+            }
+            std::fill(sa + n1, sa + n, -1);
+            int32_t name = 0;
+            int32_t prev = -1;
+            for (int32_t i=0; i<n1; i++) {
+                int32_t pos = sa[i];
+                bool diff = false;
+                for (int32_t d=0; d<n; d++) {
+                    ops.add(6);
+                    if (prev == -1 || s[pos + d] != s[prev + d] || t[pos + d] != t[prev + d]) {
+                        diff = true;
+                        break;
+                    } else if (d > 0 && (is_lms(pos + d) || is_lms(prev + d))) {
+                        break;
+                    }
+                }
+                if (diff) {
+                    ++name;
+                    prev = pos;
+                }
+                sa[n1 + pos / 2] = name - 1;
+            }
+            for (int32_t i=n-1, j=n-1; i>=n1; i--) {
+                ops.add(2);
+                if (sa[i] >= 0) {
+                    sa[j--] = sa[i];
+                }
+            }
+
+            // stage 2: sort the reduced string, recurse if names repeat
+            int32_t* s1 = sa + n - n1;
+            if (name < n1) {
+                SaIs(s1, sa, n1, name);
+            } else {
+                for (int32_t i=0; i<n1; i++) {
+                    ops.add(2);
+                    sa[s1[i]] = i;
+                }
+            }
+
+            // stage 3: induce the full order from the sorted LMS suffixes
+            get_buckets(true);
+            for (int32_t i=1, j=0; i<n; i++) {
+                ops.add(2);
+                if (is_lms(i)) {
+                    s1[j++] = i;
+                }
+            }
+            for (int32_t i=0; i<n1; i++) {
+                ops.add(2);
+                sa[i] = s1[sa[i]];
+            }
+            std::fill(sa + n1, sa + n, -1);
+            for (int32_t i=n1-1; i>=0; i--) {
+                ops.add(3);
+                int32_t j = sa[i];
+                sa[i] = -1;
+                sa[--bkt[s[j]]] = j;
+            }
+            induce();
+        }
+};
+
+
+//=============================================================================
+class MtfRleTransform
+{
+    public:
+        // zero runs are written in bijective base 2 with these two digits,
+        // a move-to-front index j > 0 is written as j + 1
+        enum : uint32_t { runa = 0, runb = 1 };
+
+        // number of bits needed for any value produced from a k symbol alphabet
+        static int SymbolBits(uint32_t k)
+        {
+            ops.add(2);
+            int bits = 1;
+            while ((uint64_t(1) << bits) <= k) {
+                ops.add(2);
+                bits++;
+            }
+            return bits;
+        }
+
+        static vector<uint32_t> Forward(const vector<uint32_t>& last, uint32_t k)
+        {
+            ops.add(4);
+            vector<uint32_t> order(k);
+            for (uint32_t i=0; i<k; i++) {
+                order[i] = i;
+            }
+            vector<uint32_t> out;
+            uint64_t run = 0;
+            for (const auto& c : last) {
+                ops.add(3);
+                uint32_t j = 0;
+                while (order[j] != c) {
+                    ops.add(2);
+                    j++;
+                }
+                if (j == 0) {
+                    ops.add(1);
+                    run++;
+                    continue;
+                }
+                PutRun(out, run);
+                run = 0;
+                std::copy_backward(order.begin(), order.begin() + j, order.begin() + j + 1);
+                order[0] = c;
+                ops.add(j + 2);
+                out.push_back(j + 1);
+            }
+            PutRun(out, run);
+            return out;
+        }
+
+        static vector<uint32_t> Inverse(const vector<uint32_t>& coded, uint32_t k, uint32_t n)
+        {
+            ops.add(4);
+            vector<uint32_t> order(k);
+            for (uint32_t i=0; i<k; i++) {
+                order[i] = i;
+            }
+            vector<uint32_t> out;
+            out.reserve(n);
+            uint64_t run = 0;
+            uint64_t weight = 1;
+            for (const auto& v : coded) {
+                ops.add(3);
+                if (v <= runb) {
+                    ops.add(3);
+                    run += (v + 1) * weight;
+                    weight <<= 1;
+                    if (run > n) {
+                        throw runtime_error("Bad run length.");
+                    }
+                    continue;
+                }
+                FlushRun(out, run, order, n);
+                weight = 1;
+                uint32_t j = v - 1;
+                if (j >= k || out.size() >= n) {
+                    throw runtime_error("Bad move-to-front index.");
+                }
+                uint32_t c = order[j];
+                std::copy_backward(order.begin(), order.begin() + j, order.begin() + j + 1);
+                order[0] = c;
+                ops.add(j + 2);
+                out.push_back(c);
+            }
+            FlushRun(out, run, order, n);
+            if (out.size() != n) {
+                throw runtime_error("Bad block length.");
+            }
+            return out;
+        }
+
+    protected:
+        static void PutRun(vector<uint32_t>& out, uint64_t run)
+        {
+            ops.add(1);
+            while (run > 0) {
+                ops.add(4);
+                if (run & 1) {
+                    out.push_back(runa);
+                    run = (run - 1) >> 1;
+                } else {
+                    out.push_back(runb);
+                    run = (run - 2) >> 1;
+                }
+            }
+        }
+
+        static void FlushRun(vector<uint32_t>& out, uint64_t& run, const vector<uint32_t>& order, uint32_t n)
+        {
+            ops.add(2);
+            if (run == 0) {
+                return;
+            }
+            if (order.empty() || out.size() + run > n) {
+                throw runtime_error("Bad run length.");
+            }
+            ops.add(run);
+            out.insert(out.end(), run, order[0]);
+            run = 0;
+        }
+};
+
+
+//=============================================================================
+class Lz77Transform
+{
+    public:
+        // length == 0 marks a literal
+        struct Token
+        {
+            char32_t literal;
+            uint32_t length;
+            uint32_t distance;
+        };
+
+        enum : uint32_t {
+            window = 32768,
+            min_match = 3,
+            max_match = 258,
+            max_chain = 64,
+            hash_bits = 15,
+            // literal/length alphabet: code points, then the length codes
+            length_base = 0x110000,
+            length_codes = 29,
+            distance_codes = 30,
+            code_bits = 5
+        };
+
+        // greedy parse of the block with a hash chain match finder
+        static vector<Token> Forward(const vector<char32_t>& block)
+        {
+            ops.add(6);
+            vector<Token> tokens;
+            vector<int32_t> head(1 << hash_bits, -1);
+            vector<int32_t> prev(window, -1);
+            int32_t n = block.size();
+            int32_t pos = 0;
+            while (pos < n) {
+                ops.add(6);
+                uint32_t best_len = 0;
+                uint32_t best_dist = 0;
+                if (pos + int32_t(min_match) <= n) {
+                    int32_t cand = head[Hash(&block[pos])];
+                    uint32_t chain = max_chain;
+                    uint32_t limit = std::min<int32_t>(max_match, n - pos);
+                    while (cand >= 0 && pos - cand <= int32_t(window) && chain-- > 0) {
+                        ops.add(5);
+                        uint32_t len = 0;
+                        while (len < limit && block[cand + len] == block[pos + len]) {
+                            ops.add(3);
+                            len++;
+                        }
+                        if (len > best_len) {
+                            ops.add(2);
+                            best_len = len;
+                            best_dist = pos - cand;
+                            if (len == limit) {
+                                break;
+                            }
+                        }
+                        // the slot may already hold a newer position
+                        int32_t next = prev[cand & (window - 1)];
+                        if (next >= cand) {
+                            break;
+                        }
+                        cand = next;
+                    }
+                }
+                if (best_len >= min_match) {
+                    ops.add(2);
+                    tokens.push_back(Token{0, best_len, best_dist});
+                } else {
+                    ops.add(2);
+                    best_len = 1;
+                    tokens.push_back(Token{block[pos], 0, 0});
+                }
+                // every covered position goes into the hash chains
+                for (int32_t end = pos + best_len; pos < end; pos++) {
+                    ops.add(4);
+                    if (pos + int32_t(min_match) <= n) {
+                        uint32_t h = Hash(&block[pos]);
+                        prev[pos & (window - 1)] = head[h];
+                        head[h] = pos;
+                    }
+                }
+            }
+            return tokens;
+        }
+
+        // append the symbols of one token to the decoded block
+        static void Inverse(const Token& token, vector<char32_t>& out)
+        {
+            ops.add(2);
+            if (token.length == 0) {
+                out.push_back(token.literal);
+                return;
+            }
+            if (token.distance == 0 || token.distance > out.size()) {
+                throw runtime_error("Bad match distance.");
+            }
+            // the source may overlap the symbols being written
+            size_t from = out.size() - token.distance;
+            for (uint32_t i=0; i<token.length; i++) {
+                ops.add(3);
+                out.push_back(out[from + i]);
+            }
+        }
+
+        // code of the length, extra_bits and extra hold the remainder
+        static uint32_t LengthCode(uint32_t len, int& extra_bits, uint32_t& extra)
+        {
+            ops.add(4);
+            const uint32_t* base = LengthBase();
+            uint32_t code = std::upper_bound(base, base + length_codes, len) - base - 1;
+            extra_bits = LengthExtra()[code];
+            extra = len - base[code];
+            return code;
+        }
+
+        static uint32_t DistanceCode(uint32_t dist, int& extra_bits, uint32_t& extra)
+        {
+            ops.add(4);
+            const uint32_t* base = DistanceBase();
+            uint32_t code = std::upper_bound(base, base + distance_codes, dist) - base - 1;
+            extra_bits = DistanceExtra()[code];
+            extra = dist - base[code];
+            return code;
+        }
+
+        // same tables as deflate (RFC 1951, 3.2.5)
+        static const uint32_t* LengthBase()
+        {
+            static const uint32_t base[length_codes] = {
+                3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+            return base;
+        }
+
+        static const int* LengthExtra()
+        {
+            static const int extra[length_codes] = {
+                0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+            return extra;
+        }
+
+        static const uint32_t* DistanceBase()
+        {
+            static const uint32_t base[distance_codes] = {
+                1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+                257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+                8193, 12289, 16385, 24577};
+            return base;
+        }
+
+        static const int* DistanceExtra()
+        {
+            static const int extra[distance_codes] = {
+                0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+                7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+            return extra;
+        }
+
+    protected:
+        static uint32_t Hash(const char32_t* p)
+        {
+            ops.add(6);
+            uint32_t h = p[0] * 2654435761u ^ p[1] * 2246822519u ^ p[2] * 3266489917u;
+            return h >> (32 - hash_bits);
+        }
+};
+
+//=============================================================================
+// Words and the runs between them as the symbols of the coder. A word
+// is a run of letters and digits, the symbols up to the next word are
+// one separator token: " ", ", " and ".\n" are tokens. Tokens are cut
+// after max_token symbols.
+class WordTransform
+{
+    public:
+        enum : uint32_t {
+            max_token = 64,
+            // the dictionary holds at most this many tokens, the next
+            // index is the escape of a token spelled out
+            max_words = 0xFFFF
+        };
+
+        // ASCII letters and digits, and the code points past Latin-1
+        // outside the punctuation and symbol blocks
+        static bool IsWordSymbol(char32_t ch)
+        {
+            ops.add(3);
+            if (ch < 0x80) {
+                return (ch >= '0' && ch <= '9') || ((ch | 0x20) >= 'a' && (ch | 0x20) <= 'z');
+            }
+            if (ch < 0xC0 || ch == 0xD7 || ch == 0xF7) {
+                return false;
+            }
+            return ! ((ch >= 0x2000 && ch < 0x2C00) || (ch >= 0x3000 && ch < 0x3040)
+                    || (ch >= 0xFE30 && ch < 0xFE70) || (ch >= 0xFF00 && ch < 0xFF10) || ch == 0xFEFF);
+        }
+
+        // bits of a dictionary index or the escape after it
+        static int IndexBits(uint64_t words)
+        {
+            ops.add(1);
+            int bits = 1;
+            while ((uint64_t{1} << bits) <= words) {
+                ops.add(1);
+                bits++;
+            }
+            return bits;
+        }
+
+        // the tokens of a text one at a time
+        class Reader
+        {
+            public:
+                explicit Reader(ucs4_ifstream& is) : is(is) {}
+
+                // false at the end of the text
+                bool Next(std::u32string& token)
+                {
+                    ops.add(3);
+                    token.clear();
+                    char32_t ch;
+                    if (has_pending) {
+                        ch = pending;
+                        has_pending = false;
+                    } else if (! is.get(ch).good()) {
+                        return false;
+                    }
+                    bool word = IsWordSymbol(ch);
+                    token.push_back(ch);
+                    while (token.size() < max_token && is.get(ch).good()) {
+                        ops.add(3);
+                        if (IsWordSymbol(ch) != word) {
+                            pending = ch;
+                            has_pending = true;
+                            break;
+                        }
+                        token.push_back(ch);
+                    }
+                    return true;
+                }
+
+            private:
+                ucs4_ifstream& is;
+                char32_t pending = 0;
+                bool has_pending = false;
+        };
+};
+
+//=============================================================================
+// --max-memory: the working memory of a job. The text is streamed,
+// only the blocks of bwt and lz77 grow with it, so the encoder picks
+// the largest block that fits and the decoder refuses one that does
+// not. The costs are the vectors alive at once per block symbol. The
+// order-1 contexts and the words dictionary grow with the distinct
+// pairs and tokens instead, they are counted by the entry.
+class MemoryBudget
+{
+    public:
+        enum : uint32_t {
+            // block, alphabet, ranks, SA-IS text and suffix array,
+            // the last column, the MTF output and the UTF-8 copy
+            bwt_encode = 40,
+            // last column, text, LF mapping and the coded symbols
+            bwt_decode = 20,
+            // block, tokens and their growth
+            lz77_encode = 40,
+            lz77_decode = 8,
+            // an order-1 count or code, the map node and the code
+            context_entry = 96,
+            // a distinct token of -t words: its characters come on
+            // top, the hash node, the count and the dictionary entry
+            word_entry = 128,
+            // smallest block worth transforming
+            min_block = 4096
+        };
+
+        // "512K", "64M", "1G" or bytes, 0 if it is not a size
+        static uint64_t Parse(const string& text)
+        {
+            if (text.empty() || text.find_first_not_of("0123456789kKmMgG") != string::npos) {
+                return 0;
+            }
+            char* end = nullptr;
+            uint64_t value = std::strtoull(text.c_str(), &end, 10);
+            string unit = end;
+            if (unit.empty()) {
+                return value;
+            }
+            if (unit.size() != 1) {
+                return 0;
+            }
+            int shift = (unit == "k" || unit == "K") ? 10 : (unit == "m" || unit == "M") ? 20 : 30;
+            return value << shift;
+        }
+
+        // Symbols per block of the transform that fit bytes of working
+        // memory, at most max_block. Throws if not even a small one fits.
+        // Without a transform and with words the whole text is one block,
+        // its tables are held to TableBytes instead.
+        static uint32_t BlockSize(uint64_t bytes, TRANSFORM transform, uint32_t max_block)
+        {
+            if (transform == TRANSFORM::none || transform == TRANSFORM::words) {
+                if (TableBytes(bytes) < min_block * context_entry) {
+                    throw runtime_error("--max-memory is too small for the tables.");
+                }
+                return max_block;
+            }
+            uint64_t per_symbol = (transform == TRANSFORM::bwt) ? bwt_encode : lz77_encode;
+            bytes = (bytes > StreamBytes()) ? bytes - StreamBytes() : 0;
+            uint64_t n = bytes / per_symbol;
+            if (n < min_block) {
+                throw runtime_error("--max-memory is too small for a block.");
+            }
+            return static_cast<uint32_t>(std::min<uint64_t>(n, max_block));
+        }
+
+        // working memory of decoding a block of n symbols
+        static uint64_t DecodeBytes(uint64_t n, TRANSFORM transform)
+        {
+            return n * ((transform == TRANSFORM::bwt) ? bwt_decode : lz77_decode) + StreamBytes();
+        }
+
+        // what the order-1 contexts or the words dictionary of a whole
+        // text may take of bytes of working memory
+        static uint64_t TableBytes(uint64_t bytes)
+        {
+            return (bytes > StreamBytes()) ? bytes - StreamBytes() : 0;
+        }
+
+        // the chunks of the input and the output file in flight
+        static uint64_t StreamBytes()
+        {
+            return 2 * AsyncFile::chunks * AsyncFile::chunk_size;
+        }
+
+        // peak resident size of the process so far
+        static uint64_t PeakBytes()
+        {
+            struct rusage usage{};
+            getrusage(RUSAGE_SELF, &usage);
+            // kilobytes on Linux
+            return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+        }
+};
+
+
+/** @} */ // end doxygroup
+
+/* -----------------------------------------------------------------------------*/
+/**
+ *  @defgroup encoders Classes to facitilate encoding.
+ *  @{
+ */
+
+//=============================================================================
+class EncodeStored
+{
+    public:
+        // a seek point at the start of every chunk if seek_interval is set
+        explicit EncodeStored(uint64_t seek_interval = 0) : seek_interval(seek_interval) {}
+
+        // The text is copied as is after the header byte. Symbols are
+        // converted in chunks and written as whole bytes, not bit by bit.
+        void Encode(ucs4_ifstream& in, bit_ofstream& out)
+        {
+            ProfileScope scope{STAGE::transform};
+            ops.add(4);
+            out.set_method(METHOD::stored);
+            vector<char32_t> buf(seek_interval > 0 ? std::min<uint64_t>(seek_interval, chunk_size) : chunk_size);
+            uint64_t symbols = 0;
+            while (in.read(buf.data(), buf.size()) || in.gcount() > 0) {
+                ops.add(3);
+                if (seek_interval > 0) {
+                    ops.add(1);
+                    out.add_seek_point(symbols, no_context);
+                }
+                symbols += in.gcount();
+                string utf8 = ucs4conv.to_bytes(buf.data(), buf.data() + in.gcount());
+                out.putbytes(utf8.data(), utf8.size());
+            }
+            ops.add(1);
+            if (! in.eof()) {
+                ops.add(1);
+                throw std::runtime_error("Could not read file");
+            }
+        }
+
+        // aligned byte count and the UTF-8 bytes of the block
+        void WriteBlock(const vector<char32_t>& block, bit_ofstream& out)
+        {
+            ops.add(4);
+            string utf8 = ucs4conv.to_bytes(block.data(), block.data() + block.size());
+            out.align();
+            out.putvarint(utf8.size());
+            out.putbytes(utf8.data(), utf8.size());
+        }
+
+        // upper bound, the alignment takes up to 7 bits
+        static uint64_t BlockBits(const vector<char32_t>& block)
+        {
+            ops.add(3);
+            uint64_t bytes = 0;
+            for (const auto& ch : block) {
+                ops.add(2);
+                bytes += utf8_length(ch);
+            }
+            return 7 + bit_ofstream::varint_bits(bytes) + 8 * bytes;
+        }
+
+    protected:
+        static const size_t chunk_size = 1 << 16;
+        uint64_t seek_interval;
+        wstring_convert<std::codecvt_utf8<char32_t>, char32_t> ucs4conv{};
+};
+const size_t EncodeStored::chunk_size;
+
+//=============================================================================
+class EncodeRuns
+{
+    public:
+        // (length, symbol) pairs, a zero length ends the list
+        void Encode(ucs4_ifstream& in, bit_ofstream& out)
+        {
+            ProfileScope scope{STAGE::transform};
+            ops.add(4);
+            out.set_method(METHOD::rle);
+            char32_t ch;
+            char32_t prev = 0;
+            uint64_t run = 0;
+            while (in.get(ch).good()) {
+                ops.add(3);
+                if (run > 0 && ch != prev) {
+                    PutRun(prev, run, out);
+                    run = 0;
+                }
+                prev = ch;
+                run++;
+            }
+            PutRun(prev, run, out);
+            out.putvarint(0);
+            ops.add(1);
+            if (! in.eof()) {
+                ops.add(1);
+                throw std::runtime_error("Could not read file");
+            }
+        }
+
+        static void WriteBlock(const vector<char32_t>& block, bit_ofstream& out)
+        {
+            ops.add(2);
+            size_t i = 0;
+            while (i < block.size()) {
+                ops.add(3);
+                size_t j = i + 1;
+                while (j < block.size() && block[j] == block[i]) {
+                    ops.add(3);
+                    j++;
+                }
+                PutRun(block[i], j - i, out);
+                i = j;
+            }
+            out.putvarint(0);
+        }
+
+        // exact size of WriteBlock output
+        static uint64_t BlockBits(const vector<char32_t>& block)
+        {
+            ops.add(2);
+            uint64_t bits = 8;
+            size_t i = 0;
+            while (i < block.size()) {
+                ops.add(3);
+                size_t j = i + 1;
+                while (j < block.size() && block[j] == block[i]) {
+                    ops.add(3);
+                    j++;
+                }
+                bits += bit_ofstream::varint_bits(j - i) + 8 * utf8_length(block[i]);
+                i = j;
+            }
+            return bits;
+        }
+
+    protected:
+        static void PutRun(char32_t ch, uint64_t run, bit_ofstream& out)
+        {
+            ops.add(1);
+            if (run == 0) {
+                return;
+            }
+            out.putvarint(run);
+            out.putchar32(ch);
+        }
+};
+
+//=============================================================================
+class IEncoder
+{
+    public:
+
+        void Encode(ucs4_ifstream& in, bit_ofstream& out)
+        {
+            if (transform == TRANSFORM::bwt) {
+                EncodeBwt(in, out);
+                return;
+            }
+            if (transform == TRANSFORM::lz77) {
+                EncodeLz77(in, out);
+                return;
+            }
+            // words and order 1 fall back to order 0 if their
+            // tables outgrow the memory limit
+            if (transform == TRANSFORM::words && EncodeWords(in, out)) {
+                return;
+            }
+            if (order == 1 && EncodeOrder1(in, out)) {
+                return;
+            }
+            if (sample_bytes > 0 && EncodeSampled(in, out)) {
+                return;
+            }
+            ops.add(5);
+            FillFrequencyTable(in);
+            // degenerate texts are not worth a tree
+            if (table.empty()) {
+                ops.add(1);
+                EncodeStored{seek_interval}.Encode(in, out);
+                return;
+            }
+            if (table.size() == 1) {
+                ops.add(1);
+                EncodeRuns{}.Encode(in, out);
+                return;
+            }
+            BuildTree();
+            GenerateCodes();
+            if (TreeBits() >= StoredBits()) {
+                ops.add(1);
+                EncodeStored{seek_interval}.Encode(in, out);
+                return;
+            }
+            CompactHeader::Lengths lengths = CompactHeader::Of(ch2code);
+            if (CompactHeader::Bits(lengths) < TreeHeaderBits()) {
+                ops.add(3);
+                ProfileScope scope{STAGE::tree_write};
+                out.set_method(METHOD::lengths);
+                CompactHeader::Write(lengths, out);
+                CompactHeader::Codes(lengths, ch2code);
+            } else {
+                WriteTree(out);
+            }
+            TransformTextEncode(in, out);
+        }
+
+        // 0 - one code table for the whole text
+        // 1 - one code table per previous symbol
+        void SetOrder(int new_order) {
+            order = new_order;
+        }
+
+        // Forget the last text and the settings, as if just constructed.
+        // A worker that codes file after file keeps one encoder.
+        void Clear() {
+            ops.add(4);
+            root.reset();
+            table.clear();
+            ctx_table.clear();
+            fallback_table.clear();
+            ch2code.clear();
+            ctx2code.clear();
+            fallback_code.clear();
+            order = 0;
+            transform = TRANSFORM::none;
+            block_size = default_block_size;
+            seek_interval = 0;
+            block_start = 0;
+            member_tables.clear();
+            member_shared.clear();
+            shared_codes.clear();
+            next_member = 0;
+            leaf_format = LEAF::utf8;
+            leaf_bits = 0;
+            block_code.clear();
+            block_dist_code.clear();
+            sample_path.clear();
+            sample_bytes = 0;
+            sampled_bits = 0;
+            exact_bits = 0;
+            table_limit = 0;
+        }
+
+        // Bytes the order-1 contexts or the words dictionary may take,
+        // past them the text is coded with order 0. 0 - no limit.
+        void SetTableLimit(uint64_t bytes) {
+            table_limit = bytes;
+        }
+
+        // Order 0 in one pass: the tree of about bytes of fname, read in
+        // windows spread over the file, 0 - the tree of the whole text
+        void SetSample(const string& fname, uint64_t bytes) {
+            sample_path = fname;
+            sample_bytes = bytes;
+        }
+
+        // whether the last Encode used a sample, the size of its
+        // archive and the one the whole text would have given
+        bool Sampled() const {
+            return sampled_bits > 0;
+        }
+
+        uint64_t SampledBits() const {
+            return sampled_bits;
+        }
+
+        uint64_t ExactBits() const {
+            return exact_bits;
+        }
+
+        // the codes of the last tree
+        const EncodeHuffmanMap& Codes() const {
+            return ch2code;
+        }
+
+        // Multi-file archive: the number of members and their names,
+        // then whether a tree of the combined histogram of all members
+        // follows. It is written if the members that code smaller with
+        // it than with trees of their own save more than it costs.
+        void WritePackHeader(const vector<string>& paths, const vector<string>& names,
+                bit_ofstream& out)
+        {
+            ops.add(6);
+            out.set_method(METHOD::pack);
+            out.putvarint(names.size());
+            // a name keeps the bytes it shares with the name before
+            string last;
+            for (const auto& name : names) {
+                ops.add(3);
+                size_t common = 0;
+                while (common < std::min(name.size(), last.size()) && name[common] == last[common]) {
+                    ops.add(1);
+                    common++;
+                }
+                out.putvarint(common);
+                out.putvarint(name.size() - common);
+                for (size_t j=common; j<name.size(); j++) {
+                    ops.add(1);
+                    out.putnumber(static_cast<uint8_t>(name[j]), 8);
+                }
+                last = name;
+            }
+            // the histogram of every member and of all of them, and the
+            // bits of every member with a tree of its own
+            member_tables.clear();
+            member_shared.clear();
+            next_member = 0;
+            FrequencyTable all;
+            vector<uint64_t> own_bits;
+            for (const auto& path : paths) {
+                ops.add(4);
+                table.clear();
+                ucs4_ifstream in{path};
+                FillFrequencyTable(in);
+                for (const auto& stats : table) {
+                    ops.add(1);
+                    all[stats.first] += stats.second;
+                }
+                member_tables.push_back(table);
+                own_bits.push_back(MemberBits(table));
+            }
+            if (all.empty()) {
+                out.putbit(false);
+                return;
+            }
+            CodedBits(all);
+            uint64_t without = 0;
+            uint64_t with_shared = std::min(TreeHeaderBits(), CompactHeader::Bits(CompactHeader::Of(ch2code)));
+            vector<uint64_t> shared_bits;
+            for (size_t i=0; i<member_tables.size(); i++) {
+                ops.add(4);
+                uint64_t bits = 0;
+                for (const auto& stats : member_tables[i]) {
+                    ops.add(3);
+                    bits += stats.second * ch2code.Length(stats.first);
+                }
+                shared_bits.push_back(bits);
+                without += own_bits[i];
+                with_shared += std::min(own_bits[i], bits);
+            }
+            bool shared = with_shared < without;
+            out.putbit(shared);
+            for (size_t i=0; i<member_tables.size(); i++) {
+                ops.add(2);
+                member_shared.push_back(shared && shared_bits[i] < own_bits[i]);
+            }
+            if (shared) {
+                ops.add(2);
+                WriteMemberTree(out);
+                shared_codes = ch2code;
+            }
+        }
+
+        // One member in a block of its own: the symbol count, then
+        // whether it takes the shared tree, else its own tree, then the
+        // codes. A tree of one symbol leaves nothing to code.
+        void EncodeMember(ucs4_ifstream& in, bit_ofstream& out)
+        {
+            ops.add(4);
+            size_t i = next_member++;
+            table = std::move(member_tables.at(i));
+            member_tables[i].clear();
+            uint64_t n = 0;
+            for (const auto& stats : table) {
+                ops.add(1);
+                n += stats.second;
+            }
+            out.putvarint(n);
+            if (n > 0) {
+                ops.add(2);
+                out.putbit(member_shared[i]);
+                if (member_shared[i]) {
+                    ch2code = shared_codes;
+                } else {
+                    BuildTree();
+                    ch2code.clear();
+                    GenerateCodes();
+                    WriteMemberTree(out);
+                }
+            }
+            if (ch2code.size() > 1) {
+                ops.add(1);
+                TransformTextEncode(in, out);
+            }
+        }
+
+        // write a seek point every n symbols, 0 - no seek table
+        void SetSeekInterval(uint64_t n) {
+            seek_interval = n;
+        }
+
+        void SetTransform(TRANSFORM new_transform) {
+            transform = new_transform;
+        }
+
+        // symbols per bwt or lz77 block
+        void SetBlockSize(uint32_t n) {
+            block_size = n;
+        }
+
+        uint32_t BlockSize() const {
+            return block_size;
+        }
+
+        // One pass over the text. first gets the symbol without a context,
+        // pairs gets one histogram per previous symbol. Rewinds the stream.
+        // Stops with both empty and returns false once there are more than
+        // max_pairs distinct (context, symbol) pairs, 0 - no limit.
+        static bool CountContexts(ucs4_ifstream& is, FrequencyTable& first, ContextFrequencyTable& pairs,
+                uint64_t max_pairs = 0)
+        {
+            ProfileScope scope{STAGE::histogram};
+            ops.add(1);
+            if (is.good()) {
+                char32_t ch;
+                char32_t prev = 0;
+                bool is_first = true;
+                uint64_t distinct = 0;
+                ops.add(3);
+                while (is.get(ch).good()) {
+                    ops.add(3);
+                    if (is_first) {
+                        ++first[ch];
+                        is_first = false;
+                    } else if (pairs[prev][ch]++ == 0 && max_pairs > 0 && ++distinct > max_pairs) {
+                        first.clear();
+                        pairs.clear();
+                        is.clear();
+                        is.seekg(0, std::ios::beg);
+                        return false;
+                    }
+                    prev = ch;
+                }
+                ops.add(1);
+                if (is.eof()) {
+                    ops.add(2);
+                    is.clear();
+                    is.seekg(0, std::ios::beg);
+                } else {
+                    ops.add(1);
+                    throw std::runtime_error("Could not read file");
+                }
+            }
+            return true;
+        }
+
+        // Exact number of bits the tree and the text take when coded
+        // with the tree this encoder builds for freq (order 0).
+        // compact - the header may be code lengths instead of the tree.
+        uint64_t CodedBits(const FrequencyTable& freq, bool compact = true)
+        {
+            ops.add(4);
+            table = freq;
+            BuildTree();
+            ch2code.clear();
+            GenerateCodes();
+            return TreeBits(compact);
+        }
+
+    protected:
+        IEncoder() { }
+
+        shared_ptr<INode> root;
+        FrequencyTable table;
+
+        int order = 0;
+        ContextFrequencyTable ctx_table;
+        FrequencyTable fallback_table;
+
+        TRANSFORM transform = TRANSFORM::none;
+        // symbols per transform block
+        static const uint32_t default_block_size = 900000;
+        uint32_t block_size = default_block_size;
+        // symbols between seek points, blocks always start at one
+        uint64_t seek_interval = 0;
+        // symbols written before the current block
+        uint64_t block_start = 0;
+        // members of a multi-file archive share the tree,
+        // the symbols of each member in that case
+        // histograms of the members still to code, which of them take
+        // the shared tree and its codes
+        vector<FrequencyTable> member_tables;
+        vector<bool> member_shared;
+        EncodeHuffmanMap shared_codes;
+        size_t next_member = 0;
+        LEAF leaf_format = LEAF::utf8;
+        // width of LEAF::number leaves
+        int leaf_bits = 0;
+        // codes of the last coded bwt or lz77 block, the next block
+        // may repeat them instead of writing trees of its own
+        EncodeHuffmanMap block_code;
+        EncodeHuffmanMap block_dist_code;
+        // the text a sampled histogram is taken of
+        string sample_path;
+        uint64_t sample_bytes = 0;
+        uint64_t sampled_bits = 0;
+        uint64_t exact_bits = 0;
+        // bytes for the order-1 contexts or the words dictionary, 0 - any
+        uint64_t table_limit = 0;
+        wstring_convert<std::codecvt_utf8<char32_t>, char32_t> ucs4conv{};
+
+        // mark the class as polymorphic
+        virtual void BuildTree() = 0;
+
+        // the block starts on a whole byte, the index keeps the checksum of its text
+        void BeginBlock(const vector<char32_t>& block, bit_ofstream& out)
+        {
+            ops.add(3);
+            string utf8 = ucs4conv.to_bytes(block.data(), block.data() + block.size());
+            out.begin_block();
+            out.set_block_text(utf8.size(), Crc32c::Update(0, utf8.data(), utf8.size()));
+            if (seek_interval > 0) {
+                ops.add(1);
+                out.add_seek_point(block_start, no_context);
+            }
+            block_start += block.size();
+        }
+
+        // windows a sample is read in, and the least bytes of one
+        static const uint64_t sample_windows = 64;
+        static const uint64_t min_window = 4096;
+
+        // The tree of a sample, then the text in one pass: symbols the
+        // sample missed are escaped. The exact histogram is counted on
+        // the way for the size it would have given. False, with nothing
+        // read or written, if the sample would be the whole text, or if
+        // the codes grew past the stored text and were dropped.
+        bool EncodeSampled(ucs4_ifstream& in, bit_ofstream& out)
+        {
+            ops.add(6);
+            struct stat st;
+            if (stat(sample_path.c_str(), &st) != 0 || static_cast<uint64_t>(st.st_size) <= sample_bytes) {
+                return false;
+            }
+            table = SampleFrequencyTable(st.st_size);
+            if (table.size() < 2) {
+                return false;
+            }
+            BuildTree();
+            ch2code.clear();
+            GenerateCodes();
+            CompactHeader::Lengths lengths = CompactHeader::Of(ch2code);
+            uint64_t header = CompactHeader::Bits(lengths);
+            if (header == UINT64_MAX) {
+                return false;
+            }
+            {
+                ProfileScope scope{STAGE::tree_write};
+                out.set_method(METHOD::sampled);
+                CompactHeader::Write(lengths, out);
+                CompactHeader::Codes(lengths, ch2code);
+            }
+            uint64_t bits = TextEncodeSampled(header, in, out);
+            if (bits == UINT64_MAX) {
+                ops.add(2);
+                ch2code.clear();
+                out.restart();
+                return false;
+            }
+            sampled_bits = header + bits;
+            // what the full first pass would have given
+            ops.add(4);
+            BuildTree();
+            ch2code.clear();
+            GenerateCodes();
+            exact_bits = std::min(TreeBits(), StoredBits());
+            return true;
+        }
+
+        // Symbol counts of windows spread evenly over the file, scaled up
+        // to its size. The escape symbol stands for the symbols no window
+        // saw and is given the count of those seen once (Good-Turing).
+        FrequencyTable SampleFrequencyTable(uint64_t file_bytes)
+        {
+            ProfileScope scope{STAGE::histogram};
+            ops.add(6);
+            uint64_t windows = std::max<uint64_t>(1, std::min(sample_windows, sample_bytes / min_window));
+            uint64_t window = sample_bytes / windows;
+            ifstream in{sample_path, ios::binary | ios::in};
+            string raw(window, '\0');
+            FrequencyTable seen;
+            uint64_t sampled = 0;
+            for (uint64_t w=0; w<windows; w++) {
+                ops.add(5);
+                in.clear();
+                in.seekg(w * (file_bytes / windows), ios::beg);
+                in.read(&raw[0], window);
+                size_t got = in.gcount();
+                sampled += got;
+                for (const auto& ch : WindowText(raw.data(), got)) {
+                    ops.add(2);
+                    ++seen[ch];
+                }
+            }
+            FrequencyTable estimate;
+            double scale = double(file_bytes) / std::max<uint64_t>(1, sampled);
+            uint64_t once = 0;
+            for (const auto& stats : seen) {
+                ops.add(4);
+                estimate[stats.first] = std::max<uint64_t>(1, stats.second * scale);
+                once += (stats.second == 1) ? 1 : 0;
+            }
+            if (! estimate.empty()) {
+                ops.add(1);
+                estimate[escape_symbol] = std::max<uint64_t>(1, once * scale);
+            }
+            return estimate;
+        }
+
+        // the whole UTF-8 symbols of a window that may start or end
+        // inside one
+        std::u32string WindowText(const char* data, size_t qty)
+        {
+            ops.add(4);
+            size_t first = 0;
+            while (first < qty && first < 3 && (data[first] & 0xC0) == 0x80) {
+                ops.add(2);
+                first++;
+            }
+            size_t last = qty;
+            for (size_t back=1; back<=3 && back<=qty; back++) {
+                ops.add(3);
+                unsigned char c = data[qty - back];
+                if ((c & 0xC0) == 0xC0) {
+                    size_t len = (c >= 0xF0) ? 4 : (c >= 0xE0) ? 3 : 2;
+                    if (len > back) {
+                        last = qty - back;
+                    }
+                    break;
+                }
+                if (c < 0x80) {
+                    break;
+                }
+            }
+            if (first >= last) {
+                return std::u32string{};
+            }
             try {
+                return ucs4conv.from_bytes(data + first, data + last);
+            } catch (const std::range_error&) {
+                throw std::runtime_error("Could not read file");
+            }
+        }
+
+        // The text with ch2code, escapes for the symbols not in it. The
+        // exact histogram goes to table, the checksum and the totals of
+        // the text to os, as the pass reads it all. Returns the bits, or
+        // UINT64_MAX with the input rewound as soon as they and the
+        // header bits are more than the text read so far stored.
+        uint64_t TextEncodeSampled(uint64_t header, ucs4_ifstream& is, bit_ofstream& os)
+        {
+            ProfileScope scope{STAGE::transform};
+            ops.add(8);
+            // the flat table covers the BMP, which holds the escape symbol
+            CodeTable<uint16_t>* flat = &CodeTable<uint16_t>::OfThread();
+            if (! flat->Fill(ch2code)) {
+                flat = nullptr;
+            }
+            const size_t escape_length = ch2code.Length(escape_symbol);
+            table.clear();
+            std::array<char32_t, 4096> run;
+            uint64_t i = 0;
+            uint64_t bits = 0;
+            uint64_t bytes = 0;
+            uint32_t crc = 0;
+            while (is.read(run.data(), run.size()) || is.gcount() > 0) {
+                ops.add(4);
+                std::streamsize got = is.gcount();
+                string utf8 = ucs4conv.to_bytes(run.data(), run.data() + got);
+                crc = Crc32c::Update(crc, utf8.data(), utf8.size());
+                bytes += utf8.size();
+                for (std::streamsize j=0; j<got; j++) {
+                    ops.add(4);
+                    char32_t ch = run[j];
+                    if (seek_interval > 0 && i % seek_interval == 0) {
+                        ops.add(1);
+                        os.add_seek_point(i, no_context);
+                    }
+                    i++;
+                    ++table[ch];
+                    if (flat && ch != escape_symbol && flat->Has(ch)) {
+                        ops.add(1);
+                        const PackedCode& code = (*flat)[ch];
+                        os.putbits(code.bits, code.len);
+                        bits += code.len;
+                        continue;
+                    }
+                    auto found = ch2code.find(ch);
+                    if (found != ch2code.end() && ch != escape_symbol) {
+                        ops.add(1);
+                        ch2code.Write(ch, os);
+                        bits += ch2code.Depth(found->second);
+                    } else {
+                        ops.add(2);
+                        ch2code.Write(escape_symbol, os);
+                        os.putnumber(ch, escape_bits);
+                        bits += escape_length + escape_bits;
+                    }
+                }
+                ops.add(1);
+                if (header + bits > 8 * bytes) {
+                    ops.add(3);
+                    table.clear();
+                    is.clear();
+                    is.seekg(0, std::ios::beg);
+                    return UINT64_MAX;
+                }
+            }
+            ops.add(1);
+            if (! is.eof()) {
+                ops.add(1);
+                throw std::runtime_error("Could not encode");
+            }
+            ops.add(3);
+            is.clear();
+            is.seekg(0, std::ios::beg);
+            if (os.block_count() == 1) {
+                os.set_block_text(bytes, crc);
+            }
+            os.set_totals(i, bytes);
+            return bits;
+        }
+
+        void FillFrequencyTable(ucs4_ifstream& is) {
+            ProfileScope scope{STAGE::histogram};
+            ops.add(1);
+            // write the trash size
+            if (is.good()) {
+                // we can continue
+                char32_t ch;
+                ops.add(2);
+                while (is.get(ch).good()) {
+                    ops.add(2);
+                    ++(this->table)[ch];
+                }
+                ops.add(1);
+                if (is.eof()) {
+                    // clear eof and rewind input stream
+                    ops.add(2);
+                    is.clear();
+                    is.seekg(0, std::ios::beg);
+                } else {
+                    // we stopped reading the file, but it is not EOF yet.
+                    ops.add(1);
+                    throw std::runtime_error("Could not read file");
+                }
+                // we reached eof. all ok
+            }
+        }
+
+        // Depth first with a stack of the nodes still to visit, each with
+        // its node in ch2code: a child links to its parent there and a
+        // leaf gives its symbol that node. No code is spelled out, so the
+        // walk is O(1) a node however deep the tree.
+        void GenerateCodes()
+        {
+            ProfileScope scope{STAGE::code_gen};
+            ops.add(1);
+            this->ch2code.clear();
+            struct Visit
+            {
+                const INode* node;
+                uint32_t code;
+            };
+            vector<Visit> stack{Visit{root.get(), 0}};
+            while (! stack.empty()) {
+                Visit next = stack.back();
+                stack.pop_back();
+                if (const LeafNode* lf = dynamic_cast<const LeafNode*>(next.node))
+                {
+                    ops.add(2);
+                    this->ch2code.SetLeaf(lf->c, next.code);
+                }
+                else if (const InternalNode* in = dynamic_cast<const InternalNode*>(next.node))
+                {
+                    ops.add(6);
+                    stack.push_back(Visit{in->right.get(), ch2code.Child(next.code, true)});
+                    stack.push_back(Visit{in->left.get(), ch2code.Child(next.code, false)});
+                }
+            }
+            // a tree of one leaf would give an empty code,
+            // which can not be found in the bit stream
+            if (const LeafNode* lf = dynamic_cast<const LeafNode*>(root.get())) {
+                ops.add(2);
+                this->ch2code.SetLeaf(lf->c, ch2code.Child(0, false));
+            }
+        }
+
+        // a member with a tree of its own, the text of one symbol is not coded
+        uint64_t MemberBits(const FrequencyTable& freq)
+        {
+            ops.add(2);
+            if (freq.size() < 2) {
+                return freq.empty() ? 0 : CodedBits(freq) - freq.begin()->second;
+            }
+            return CodedBits(freq);
+        }
+
+        // the smaller of the code-length header and the tree, after a bit
+        // that says which
+        void WriteMemberTree(bit_ofstream& out)
+        {
+            ops.add(3);
+            CompactHeader::Lengths lengths = CompactHeader::Of(ch2code);
+            bool compact = CompactHeader::Bits(lengths) < TreeHeaderBits();
+            out.putbit(compact);
+            if (compact) {
+                ops.add(2);
+                ProfileScope scope{STAGE::tree_write};
+                CompactHeader::Write(lengths, out);
+                CompactHeader::Codes(lengths, ch2code);
+            } else {
+                WriteTree(out);
+            }
+        }
+
+        // the nodes in preorder, a stack holds the right children still to write
+        void WriteTree(bit_ofstream& os)
+        {
+            ProfileScope scope{STAGE::tree_write};
+            ops.add(1);
+            vector<const INode*> stack{root.get()};
+            while (! stack.empty()) {
+                const INode* node = stack.back();
+                stack.pop_back();
+                if (const LeafNode* lf = dynamic_cast<const LeafNode*>(node))
+                {
+                    ops.add(2);
+                    os.putbit(true);
+                    WriteLeaf(lf->c, os);
+                }
+                else if (const InternalNode* in = dynamic_cast<const InternalNode*>(node))
+                {
+                    ops.add(3);
+                    os.putbit(false);
+                    stack.push_back(in->right.get());
+                    stack.push_back(in->left.get());
+                }
+            }
+        }
+
+        void WriteLeaf(char32_t c, bit_ofstream& os)
+        {
+            if (leaf_format == LEAF::number) {
+                ops.add(1);
+                os.putnumber(c, leaf_bits);
+                return;
+            }
+            if (leaf_format == LEAF::litlen) {
+                ops.add(2);
+                bool is_length = c >= Lz77Transform::length_base;
+                os.putbit(is_length);
+                if (is_length) {
+                    os.putnumber(c - Lz77Transform::length_base, Lz77Transform::code_bits);
+                    return;
+                }
+            }
+            os.putchar32(c);
+        }
+
+        void TransformTextEncode(ucs4_ifstream& is, bit_ofstream& os)
+        {
+            ProfileScope scope{STAGE::transform};
+            ops.add(3);
+            // the narrowest symbol type that holds the alphabet
+            char32_t widest = ch2code.widest();
+            if (widest < SymbolTraits<uint8_t>::limit) {
+                CodeTable<uint8_t> codes;
+                if (codes.Fill(ch2code)) {
+                    TransformTextEncodeAs(codes, widest, is, os);
+                    return;
+                }
+            } else if (widest < SymbolTraits<uint16_t>::limit) {
+                CodeTable<uint16_t>& codes = CodeTable<uint16_t>::OfThread();
+                if (codes.Fill(ch2code)) {
+                    TransformTextEncodeAs(codes, widest, is, os);
+                    return;
+                }
+            }
+            if (is.good() && os.good()) {
+                // we can continue
+                char32_t in_ch;
+                uint64_t i = 0;
+                ops.add(3);
+                while (is.get(in_ch).good())
+                {
+                    if (seek_interval > 0 && i % seek_interval == 0) {
+                        ops.add(1);
+                        os.add_seek_point(i, no_context);
+                    }
+                    i++;
+                    this->ch2code.Write(in_ch, os);
+                }
+                ops.add(1);
+                if (is.eof()) {
+                    // clear eof and rewind input stream
+                    ops.add(2);
+                    is.clear();
+                    is.seekg(0, std::ios::beg);
+                } else {
+                    // we stopped reading the file, but it is not EOF yet.
+                    ops.add(1);
+                    throw std::runtime_error("Could not encode");
+                }
+                // we reached eof. all ok
+            }
+        }
+
+        // TransformTextEncode with a flat table of T symbols, read in runs
+        template <typename T>
+        void TransformTextEncodeAs(const CodeTable<T>& codes, char32_t widest,
+                ucs4_ifstream& is, bit_ofstream& os)
+        {
+            ops.add(3);
+            if (! is.good() || ! os.good()) {
+                return;
+            }
+            std::array<char32_t, 4096> run;
+            uint64_t i = 0;
+            while (is.read(run.data(), run.size()) || is.gcount() > 0) {
+                ops.add(2);
+                std::streamsize got = is.gcount();
+                // a symbol counts as its bits, like the map loop counted it
+                for (std::streamsize j=0; j<got; j++) {
+                    char32_t ch = run[j];
+                    if (ch > widest) {
+                        throw std::runtime_error("Could not encode");
+                    }
+                    if (seek_interval > 0 && i % seek_interval == 0) {
+                        ops.add(1);
+                        os.add_seek_point(i, no_context);
+                    }
+                    i++;
+                    const PackedCode& code = codes[static_cast<T>(ch)];
+                    os.putbits(code.bits, code.len);
+                }
+            }
+            ops.add(1);
+            if (is.eof()) {
+                // clear eof and rewind input stream
+                ops.add(2);
+                is.clear();
+                is.seekg(0, std::ios::beg);
+            } else {
+                ops.add(1);
+                throw std::runtime_error("Could not encode");
+            }
+        }
+
+        // size of the current table and the text coded with ch2code,
+        // the smaller of the two headers if compact
+        uint64_t TreeBits(bool compact = true)
+        {
+            ops.add(1);
+            uint64_t bits = TreeHeaderBits();
+            if (compact) {
+                ops.add(1);
+                bits = std::min(bits, CompactHeader::Bits(CompactHeader::Of(ch2code)));
+            }
+            for (const auto& stats : table) {
+                ops.add(4);
+                bits += stats.second * ch2code.Length(stats.first);
+            }
+            return bits;
+        }
+
+        // one bit per node, a UTF-8 symbol per leaf
+        uint64_t TreeHeaderBits()
+        {
+            ops.add(1);
+            uint64_t bits = 2 * table.size() - 1;
+            for (const auto& stats : table) {
+                ops.add(2);
+                bits += 8 * utf8_length(stats.first);
+            }
+            return bits;
+        }
+
+        // size of the text copied as UTF-8, the current table counts every symbol once
+        uint64_t StoredBits()
+        {
+            ops.add(1);
+            uint64_t bits = 0;
+            for (const auto& stats : table) {
+                ops.add(4);
+                bits += 8 * stats.second * utf8_length(stats.first);
+            }
+            return bits;
+        }
+
+        // size of the order-1 header and text for the merged context tables
+        uint64_t ContextBits()
+        {
+            ops.add(2);
+            // context count and the fallback flag
+            uint64_t bits = 32 + 1;
+            for (const auto& ctx : ctx_table) {
+                ops.add(3);
+                bits += 8 * utf8_length(ctx.first) + CodedBits(ctx.second, false);
+            }
+            if (! fallback_table.empty()) {
+                ops.add(1);
+                bits += CodedBits(fallback_table, false);
+            }
+            return bits;
+        }
+
+        // false - the contexts outgrew table_limit, nothing was written
+        bool EncodeOrder1(ucs4_ifstream& in, bit_ofstream& out)
+        {
+            ops.add(6);
+            if (! FillContextTables(in)) {
+                return false;
+            }
+            // the tables are rebuilt below, this only checks that they pay off
+            uint64_t coded_bits = ContextBits();
+            table = fallback_table;
+            for (const auto& ctx : ctx_table) {
+                for (const auto& stats : ctx.second) {
+                    ops.add(2);
+                    table[stats.first] += stats.second;
+                }
+            }
+            if (table.size() == 1) {
+                ops.add(1);
+                EncodeRuns{}.Encode(in, out);
+                return true;
+            }
+            if (coded_bits >= StoredBits()) {
+                ops.add(1);
+                EncodeStored{seek_interval}.Encode(in, out);
+                return true;
+            }
+            out.set_method(METHOD::order1);
+            // header: number of contexts, then (context, tree) pairs,
+            // then the fallback tree if there is anything to code with it
+            out.putnumber(ctx_table.size(), 32);
+            for (const auto& ctx : ctx_table) {
+                ops.add(3);
+                out.putchar32(ctx.first);
+                WriteCodeTable(ctx.second, ctx2code[ctx.first], out);
+            }
+            ops.add(1);
+            out.putbit(! fallback_table.empty());
+            if (! fallback_table.empty()) {
+                WriteCodeTable(fallback_table, fallback_code, out);
+            }
+            TransformContextEncode(in, out);
+            return true;
+        }
+
+        bool FillContextTables(ucs4_ifstream& is)
+        {
+            ops.add(1);
+            if (! CountContexts(is, fallback_table, ctx_table, table_limit / MemoryBudget::context_entry)) {
+                return false;
+            }
+            MergeRareContexts();
+            return true;
+        }
+
+        void MergeRareContexts()
+        {
+            // order-0 statistics estimate what a symbol costs in the fallback table
+            FrequencyTable global = fallback_table;
+            uint64_t total = 0;
+            for (const auto& ctx : ctx_table) {
+                for (const auto& stats : ctx.second) {
+                    ops.add(3);
+                    global[stats.first] += stats.second;
+                    total += stats.second;
+                }
+            }
+            // merge a context into the fallback table when the tree stored
+            // in the header costs more than the context model saves
+            auto it = ctx_table.begin();
+            while (it != ctx_table.end()) {
+                ops.add(4);
+                uint64_t count = 0;
+                for (const auto& stats : it->second) {
+                    ops.add(1);
+                    count += stats.second;
+                }
+                // context symbol, one bit per node and a symbol per leaf
+                double own_bits = 8.0 * utf8_length(it->first) + 2.0 * it->second.size() - 1;
+                double shared_bits = 0;
+                for (const auto& stats : it->second) {
+                    ops.add(8);
+                    own_bits += 8.0 * utf8_length(stats.first);
+                    own_bits += stats.second * std::log2(double(count) / stats.second);
+                    shared_bits += stats.second * std::log2(double(total) / global[stats.first]);
+                }
+                if (own_bits >= shared_bits) {
+                    for (const auto& stats : it->second) {
+                        ops.add(2);
+                        fallback_table[stats.first] += stats.second;
+                    }
+                    it = ctx_table.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+
+        // build the tree for freq, return its root and codes
+        NodePtr BuildCodeTable(const FrequencyTable& freq, EncodeHuffmanMap& codes)
+        {
+            ops.add(5);
+            table = freq;
+            BuildTree();
+            ch2code.clear();
+            GenerateCodes();
+            codes.swap(ch2code);
+            return root;
+        }
+
+        void WriteCodeTable(const FrequencyTable& freq, EncodeHuffmanMap& codes, bit_ofstream& out)
+        {
+            ops.add(1);
+            BuildCodeTable(freq, codes);
+            WriteTree(out);
+        }
+
+        // Bits of the symbols of freq coded with codes, plus bits.
+        // UINT64_MAX if a symbol has no code.
+        static uint64_t RepeatBits(const FrequencyTable& freq, const EncodeHuffmanMap& codes, uint64_t bits = 0)
+        {
+            ops.add(1);
+            for (const auto& stats : freq) {
+                ops.add(3);
+                auto found = codes.find(stats.first);
+                if (bits == UINT64_MAX || found == codes.end()) {
+                    return UINT64_MAX;
+                }
+                bits += stats.second * codes.Depth(found->second);
+            }
+            return bits;
+        }
+
+        // No prefix code takes fewer bits for freq than its entropy,
+        // rounded down.
+        static uint64_t EntropyBits(const FrequencyTable& freq)
+        {
+            ops.add(2);
+            uint64_t n = 0;
+            for (const auto& stats : freq) {
+                ops.add(1);
+                n += stats.second;
+            }
+            double bits = 0;
+            for (const auto& stats : freq) {
+                ops.add(3);
+                bits += stats.second * std::log2(double(n) / stats.second);
+            }
+            // leave room for the rounding of the sum
+            return static_cast<uint64_t>(bits * (1 - 1e-9));
+        }
+
+        // The last trees are kept for the next block, unless blocks
+        // start at seek points and have to decode on their own.
+        void KeepBlockCodes(EncodeHuffmanMap& codes, EncodeHuffmanMap& dist_codes)
+        {
+            ops.add(1);
+            if (seek_interval == 0) {
+                ops.add(2);
+                block_code.swap(codes);
+                block_dist_code.swap(dist_codes);
+            }
+        }
+
+        // Write the block as a stored copy or as runs if one of them is
+        // smaller than coded_bits. Returns false if the block should be coded.
+        bool WriteFallbackBlock(const vector<char32_t>& block, uint64_t coded_bits, bit_ofstream& out)
+        {
+            ops.add(4);
+            uint64_t stored_bits = EncodeStored::BlockBits(block);
+            uint64_t run_bits = EncodeRuns::BlockBits(block);
+            if (coded_bits <= stored_bits && coded_bits <= run_bits) {
+                return false;
+            }
+            out.putbit(true);
+            if (run_bits < stored_bits) {
+                ops.add(2);
+                out.putnumber(static_cast<uint8_t>(BLOCK::runs), 2);
+                EncodeRuns::WriteBlock(block, out);
+            } else {
+                ops.add(2);
+                out.putnumber(static_cast<uint8_t>(BLOCK::stored), 2);
+                EncodeStored{}.WriteBlock(block, out);
+            }
+            return true;
+        }
+
+        void TransformContextEncode(ucs4_ifstream& is, bit_ofstream& os)
+        {
+            ProfileScope scope{STAGE::transform};
+            ops.add(2);
+            if (is.good() && os.good()) {
+                char32_t in_ch;
+                char32_t prev = no_context;
+                uint64_t i = 0;
+                // the first symbol is coded with the fallback table
+                EncodeHuffmanMap* codes = &fallback_code;
+                ops.add(4);
+                while (is.get(in_ch).good())
+                {
+                    if (seek_interval > 0 && i % seek_interval == 0) {
+                        ops.add(1);
+                        os.add_seek_point(i, prev);
+                    }
+                    i++;
+                    prev = in_ch;
+                    codes->Write(in_ch, os);
+                    ops.add(3);
+                    auto next = ctx2code.find(in_ch);
+                    codes = (next != ctx2code.end()) ? &next->second : &fallback_code;
+                }
+                ops.add(1);
+                if (is.eof()) {
+                    ops.add(2);
+                    is.clear();
+                    is.seekg(0, std::ios::beg);
+                } else {
+                    ops.add(1);
+                    throw std::runtime_error("Could not encode");
+                }
+            }
+        }
+
+        // returns false when there are no more symbols
+        bool ReadBlock(ucs4_ifstream& is, vector<char32_t>& block)
+        {
+            ops.add(3);
+            block.clear();
+            char32_t ch;
+            while (block.size() < block_size && is.get(ch).good()) {
+                ops.add(3);
+                block.push_back(ch);
+            }
+            if (! is.good() && ! is.eof()) {
+                ops.add(1);
+                throw std::runtime_error("Could not read file");
+            }
+            return ! block.empty();
+        }
+
+        void EncodeBwt(ucs4_ifstream& in, bit_ofstream& out)
+        {
+            ops.add(3);
+            out.set_method(METHOD::bwt);
+            block_code.clear();
+            block_dist_code.clear();
+            vector<char32_t> block;
+            while (ReadBlock(in, block)) {
+                ops.add(1);
+                EncodeBwtBlock(block, out);
+            }
+            // no more blocks
+            out.align();
+            out.putbit(false);
+        }
+
+        void EncodeBwtBlock(const vector<char32_t>& block, bit_ofstream& out)
+        {
+            ProfileScope scope{STAGE::transform};
+            ops.add(8);
+            BeginBlock(block, out);
+            // the block alphabet in sorted order, the transforms work on ranks
+            vector<char32_t> alphabet(block);
+            sort(alphabet.begin(), alphabet.end());
+            alphabet.erase(std::unique(alphabet.begin(), alphabet.end()), alphabet.end());
+            vector<uint32_t> ranks(block.size());
+            for (size_t i=0; i<block.size(); i++) {
+                ops.add(3);
+                ranks[i] = std::lower_bound(alphabet.begin(), alphabet.end(), block[i]) - alphabet.begin();
+            }
+            uint32_t k = alphabet.size();
+            uint32_t primary = 0;
+            vector<uint32_t> coded = MtfRleTransform::Forward(BwtTransform::Forward(ranks, k, primary), k);
+
+            table.clear();
+            for (const auto& c : coded) {
+                ops.add(2);
+                ++table[c];
+            }
+
+            // block header, then a tree and the codes or the codes of
+            // the last block, whichever is smaller
+            int symbol_bits = MtfRleTransform::SymbolBits(k);
+            uint64_t header_bits = 4 * 32;
+            for (const auto& ch : alphabet) {
+                ops.add(2);
+                header_bits += 8 * utf8_length(ch);
+            }
+            uint64_t tree_bits = 2 * table.size() - 1 + table.size() * symbol_bits;
+            uint64_t repeat_bits = RepeatBits(table, block_code);
+            // a new tree can not save more than its own size over the entropy
+            bool repeat = repeat_bits != UINT64_MAX && repeat_bits <= EntropyBits(table) + tree_bits;
+            uint64_t fresh_bits = UINT64_MAX;
+            if (! repeat) {
+                ops.add(3);
+                BuildTree();
+                ch2code.clear();
+                GenerateCodes();
+                fresh_bits = tree_bits;
+                for (const auto& stats : table) {
+                    ops.add(3);
+                    fresh_bits += stats.second * ch2code.Length(stats.first);
+                }
+                repeat = repeat_bits <= fresh_bits;
+            }
+            if (WriteFallbackBlock(block, header_bits + std::min(repeat_bits, fresh_bits), out)) {
+                return;
+            }
+
+            // block header
+            out.putbit(true);
+            out.putnumber(static_cast<uint8_t>(repeat ? BLOCK::repeat : BLOCK::coded), 2);
+            out.putnumber(block.size(), 32);
+            out.putnumber(primary, 32);
+            out.putnumber(k, 32);
+            for (const auto& ch : alphabet) {
+                ops.add(1);
+                out.putchar32(ch);
+            }
+            out.putnumber(coded.size(), 32);
+            if (! repeat) {
+                leaf_format = LEAF::number;
+                leaf_bits = symbol_bits;
+                WriteTree(out);
+                leaf_format = LEAF::utf8;
+            }
+
+            EncodeHuffmanMap& codes = repeat ? block_code : ch2code;
+            for (const auto& c : coded) {
+                codes.Write(c, out);
+            }
+            if (! repeat) {
+                EncodeHuffmanMap none;
+                KeepBlockCodes(ch2code, none);
+            }
+        }
+
+        void EncodeLz77(ucs4_ifstream& in, bit_ofstream& out)
+        {
+            ops.add(3);
+            out.set_method(METHOD::lz77);
+            block_code.clear();
+            block_dist_code.clear();
+            vector<char32_t> block;
+            while (ReadBlock(in, block)) {
+                ops.add(1);
+                EncodeLz77Block(block, out);
+            }
+            // no more blocks
+            out.align();
+            out.putbit(false);
+        }
+
+        void EncodeLz77Block(const vector<char32_t>& block, bit_ofstream& out)
+        {
+            ProfileScope scope{STAGE::transform};
+            ops.add(8);
+            BeginBlock(block, out);
+            typedef Lz77Transform LZ;
+            vector<LZ::Token> tokens = LZ::Forward(block);
+            int extra_bits;
+            uint32_t extra;
+            uint64_t total_extra = 0;
+            FrequencyTable litlen_table;
+            FrequencyTable dist_table;
+            for (const auto& t : tokens) {
+                ops.add(3);
+                if (t.length == 0) {
+                    ++litlen_table[t.literal];
+                } else {
+                    ops.add(4);
+                    ++litlen_table[LZ::length_base + LZ::LengthCode(t.length, extra_bits, extra)];
+                    total_extra += extra_bits;
+                    ++dist_table[LZ::DistanceCode(t.distance, extra_bits, extra)];
+                    total_extra += extra_bits;
+                }
+            }
+            // block header and the extra bits, then both trees and the
+            // tokens or the tokens with the codes of the last block
+            uint64_t header_bits = 2 * 32 + total_extra;
+            uint64_t tree_bits = 2 * litlen_table.size() - 1 + 1;
+            for (const auto& stats : litlen_table) {
+                ops.add(3);
+                tree_bits += 1 + ((stats.first >= LZ::length_base) ? static_cast<int>(LZ::code_bits) : 8 * utf8_length(stats.first));
+            }
+            if (! dist_table.empty()) {
+                ops.add(2);
+                tree_bits += 2 * dist_table.size() - 1 + dist_table.size() * LZ::code_bits;
+            }
+            uint64_t repeat_bits = RepeatBits(dist_table, block_dist_code, RepeatBits(litlen_table, block_code));
+            // new trees can not save more than their own size over the entropy
+            bool repeat = repeat_bits != UINT64_MAX
+                && repeat_bits <= EntropyBits(litlen_table) + EntropyBits(dist_table) + tree_bits;
+            EncodeHuffmanMap litlen_code;
+            EncodeHuffmanMap dist_code;
+            NodePtr litlen_root;
+            NodePtr dist_root;
+            uint64_t fresh_bits = UINT64_MAX;
+            if (! repeat) {
+                ops.add(2);
+                litlen_root = BuildCodeTable(litlen_table, litlen_code);
+                if (! dist_table.empty()) {
+                    ops.add(1);
+                    dist_root = BuildCodeTable(dist_table, dist_code);
+                }
+                fresh_bits = tree_bits;
+                for (const auto& stats : litlen_table) {
+                    ops.add(3);
+                    fresh_bits += stats.second * litlen_code.Length(stats.first);
+                }
+                for (const auto& stats : dist_table) {
+                    ops.add(3);
+                    fresh_bits += stats.second * dist_code.Length(stats.first);
+                }
+                repeat = repeat_bits <= fresh_bits;
+            }
+            if (WriteFallbackBlock(block, header_bits + std::min(repeat_bits, fresh_bits), out)) {
+                return;
+            }
+
+            // block header
+            out.putbit(true);
+            out.putnumber(static_cast<uint8_t>(repeat ? BLOCK::repeat : BLOCK::coded), 2);
+            out.putnumber(block.size(), 32);
+            out.putnumber(tokens.size(), 32);
+            if (! repeat) {
+                root = litlen_root;
+                leaf_format = LEAF::litlen;
+                WriteTree(out);
+                ops.add(1);
+                out.putbit(! dist_table.empty());
+                if (! dist_table.empty()) {
+                    root = dist_root;
+                    leaf_format = LEAF::number;
+                    leaf_bits = LZ::code_bits;
+                    WriteTree(out);
+                }
+                leaf_format = LEAF::utf8;
+            } else {
+                litlen_code.swap(block_code);
+                dist_code.swap(block_dist_code);
+            }
+
+            for (const auto& t : tokens) {
+                ops.add(1);
+                if (t.length == 0) {
+                    litlen_code.Write(t.literal, out);
+                    continue;
+                }
+                ops.add(4);
+                uint32_t code = LZ::LengthCode(t.length, extra_bits, extra);
+                litlen_code.Write(LZ::length_base + code, out);
+                out.putnumber(extra, extra_bits);
+                code = LZ::DistanceCode(t.distance, extra_bits, extra);
+                dist_code.Write(code, out);
+                out.putnumber(extra, extra_bits);
+            }
+            KeepBlockCodes(litlen_code, dist_code);
+        }
+
+        // The tokens of WordTransform: those seen more than once make the
+        // dictionary, the rest are escaped. Dictionary words and escaped
+        // tokens are spelled with a tree of their symbols, the text is
+        // coded with a tree of the dictionary indices and the escape.
+        // false - the distinct tokens outgrew table_limit, nothing was written
+        bool EncodeWords(ucs4_ifstream& in, bit_ofstream& out)
+        {
+            typedef WordTransform WT;
+            ops.add(4);
+            std::unordered_map<std::u32string, uint64_t> counts;
+            uint64_t tokens = 0;
+            {
+                ProfileScope scope{STAGE::histogram};
+                WT::Reader reader{in};
+                std::u32string token;
+                uint64_t table_bytes = 0;
+                while (reader.Next(token)) {
+                    ops.add(2);
+                    if (counts[token]++ == 0 && table_limit > 0) {
+                        table_bytes += MemoryBudget::word_entry + sizeof(char32_t) * token.size();
+                        if (table_bytes > table_limit) {
+                            in.clear();
+                            in.seekg(0, std::ios::beg);
+                            return false;
+                        }
+                    }
+                    tokens++;
+                }
+                Rewind(in);
+            }
+            if (tokens == 0) {
+                ops.add(1);
+                EncodeStored{seek_interval}.Encode(in, out);
+                return true;
+            }
+
+            // the most frequent tokens first, ties in code point order
+            vector<std::pair<uint64_t, std::u32string>> words;
+            for (const auto& entry : counts) {
+                ops.add(2);
+                if (entry.second > 1) {
+                    words.push_back(std::make_pair(entry.second, entry.first));
+                }
+            }
+            ops.add(words.size());
+            sort(words.begin(), words.end(), [](const std::pair<uint64_t, std::u32string>& a,
+                    const std::pair<uint64_t, std::u32string>& b) {
+                return a.first != b.first ? a.first > b.first : a.second < b.second;
+            });
+            if (words.size() > WT::max_words) {
+                words.resize(WT::max_words);
+            }
+            const uint32_t escape = words.size();
+            std::unordered_map<std::u32string, uint16_t> index;
+            FrequencyTable token_table;
+            FrequencyTable symbol_table;
+            for (uint32_t i=0; i<escape; i++) {
+                ops.add(3);
+                index[words[i].second] = i;
+                token_table[i] = words[i].first;
+                for (const auto& ch : words[i].second) {
+                    ops.add(1);
+                    ++symbol_table[ch];
+                }
+            }
+            uint64_t stored_bits = 0;
+            for (const auto& entry : counts) {
+                ops.add(3);
+                bool spelled = index.find(entry.first) == index.end();
+                if (spelled) {
+                    token_table[escape] += entry.second;
+                }
+                for (const auto& ch : entry.first) {
+                    ops.add(2);
+                    stored_bits += 8 * entry.second * utf8_length(ch);
+                    if (spelled) {
+                        symbol_table[ch] += entry.second;
+                    }
+                }
+            }
+            EncodeHuffmanMap symbol_code;
+            EncodeHuffmanMap token_code;
+            NodePtr symbol_root = BuildCodeTable(symbol_table, symbol_code);
+            NodePtr token_root = BuildCodeTable(token_table, token_code);
+            int index_bits = WT::IndexBits(escape);
+
+            // both trees, the dictionary and the text
+            uint64_t bits = 2 * symbol_table.size() - 1 + 2 * token_table.size() - 1
+                + token_table.size() * index_bits
+                + bit_ofstream::varint_bits(escape) + bit_ofstream::varint_bits(tokens);
+            for (const auto& ch : symbol_table) {
+                ops.add(3);
+                bits += 8 * utf8_length(ch.first) + ch.second * symbol_code.Length(ch.first);
+            }
+            for (const auto& word : words) {
+                ops.add(1);
+                bits += bit_ofstream::gamma_bits(word.second.size());
+            }
+            for (const auto& entry : counts) {
+                ops.add(2);
+                if (index.find(entry.first) == index.end()) {
+                    bits += entry.second * bit_ofstream::gamma_bits(entry.first.size());
+                }
+            }
+            for (const auto& stats : token_table) {
+                ops.add(3);
+                bits += stats.second * token_code.Length(stats.first);
+            }
+            if (bits >= stored_bits) {
+                ops.add(1);
+                EncodeStored{seek_interval}.Encode(in, out);
+                return true;
+            }
+
+            out.set_method(METHOD::words);
+            root = symbol_root;
+            WriteTree(out);
+            out.putvarint(escape);
+            for (const auto& word : words) {
+                ops.add(1);
+                WriteToken(word.second, symbol_code, out);
+            }
+            root = token_root;
+            leaf_format = LEAF::number;
+            leaf_bits = index_bits;
+            WriteTree(out);
+            leaf_format = LEAF::utf8;
+            out.putvarint(tokens);
+            TokenTextEncode(in, index, token_code, symbol_code, out);
+            return true;
+        }
+
+        // the length of a token, then its symbols
+        void WriteToken(const std::u32string& token, EncodeHuffmanMap& symbol_code, bit_ofstream& out)
+        {
+            ops.add(1);
+            out.putgamma(token.size());
+            for (const auto& ch : token) {
+                ops.add(1);
+                symbol_code.Write(ch, out);
+            }
+        }
+
+        void TokenTextEncode(ucs4_ifstream& in, const std::unordered_map<std::u32string, uint16_t>& index,
+                EncodeHuffmanMap& token_code, EncodeHuffmanMap& symbol_code, bit_ofstream& out)
+        {
+            ProfileScope scope{STAGE::transform};
+            ops.add(5);
+            const uint16_t escape = index.size();
+            CodeTable<uint16_t>* flat = &CodeTable<uint16_t>::OfThread();
+            if (! flat->Fill(token_code)) {
+                flat = nullptr;
+            }
+            WordTransform::Reader reader{in};
+            std::u32string token;
+            uint64_t done = 0;
+            uint64_t next_seek = 0;
+            while (reader.Next(token)) {
+                ops.add(3);
+                // seek points fall on the first token from every interval on
+                if (seek_interval > 0 && done >= next_seek) {
+                    ops.add(2);
+                    out.add_seek_point(done, no_context);
+                    next_seek = (done / seek_interval + 1) * seek_interval;
+                }
+                done += token.size();
+                auto found = index.find(token);
+                uint16_t i = (found != index.end()) ? found->second : escape;
+                if (flat) {
+                    const PackedCode& code = (*flat)[i];
+                    out.putbits(code.bits, code.len);
+                } else {
+                    token_code.Write(i, out);
+                }
+                if (i == escape) {
+                    ops.add(1);
+                    WriteToken(token, symbol_code, out);
+                }
+            }
+            Rewind(in);
+        }
+
+        // back to the start after a pass over the whole text
+        static void Rewind(ucs4_ifstream& in)
+        {
+            ops.add(1);
+            if (! in.eof()) {
+                ops.add(1);
+                throw std::runtime_error("Could not read file");
+            }
+            ops.add(2);
+            in.clear();
+            in.seekg(0, std::ios::beg);
+        }
+
+    private:
+        EncodeHuffmanMap ch2code;
+        ContextEncodeMap ctx2code;
+        EncodeHuffmanMap fallback_code;
+};
+const uint32_t IEncoder::default_block_size;
+const uint64_t IEncoder::sample_windows;
+const uint64_t IEncoder::min_window;
+
+//=============================================================================
+class EncodeHuffman : public IEncoder
+{
+    public:
+        void BuildTree() override
+        {
+            ProfileScope scope{STAGE::tree_build};
+            std::priority_queue<NodePtr, std::vector<NodePtr>, NodeCmp> trees;
+            for (const auto& stats : table)
+            {
+                ops.add(2);
+                NodePtr np{new LeafNode{stats.second, stats.first}};
+                trees.push(np);
+            }
+            while (trees.size() > 1)
+            {
+                ops.add(7);
+                NodePtr childR = trees.top();
+                trees.pop();
+                NodePtr childL = trees.top();
+                trees.pop();
+                // Internal node constructor also requiers +1 ops
+                NodePtr parent{new InternalNode{childR, childL}};
+                trees.push(parent);
+            }
+            ops.add(2);
+            root = shared_ptr<INode>{trees.top()};
+        }
+};
+
+//=============================================================================
+class EncodeShannon : public IEncoder
+{
+    typedef vector<NodePtr> LeafVec;
+
+    public:
+        void BuildTree() override
+        {
+            ProfileScope scope{STAGE::tree_build};
+            LeafVec leaves;
+            for (const auto& stats : table)
+            {
+                ops.add(2);
+                NodePtr np{new LeafNode{stats.second, stats.first}};
+                leaves.push_back(np);
+            }
+            ops.add(1);
+            sort(leaves.begin(), leaves.end(), NodeCmp{});
+            ops.add(2);
+            sums.assign(1, 0);
+            for (const auto& leaf : leaves) {
+                ops.add(1);
+                sums.push_back(sums.back() + leaf->f);
+            }
+            root = SplitLeaves(leaves);
+            sums.clear();
+        }
+
+    protected:
+
+        // The ranges of leaves still to split are kept on a stack. A
+        // range is split when first met and comes back once both halves
+        // are trees, which are then the last two of the built ones.
+        NodePtr SplitLeaves(const LeafVec& leaves)
+        {
+            struct Range
+            {
+                size_t first;
+                size_t last;
+                bool split;
+            };
+            vector<Range> todo{Range{0, leaves.size() - 1, false}};
+            vector<NodePtr> built;
+            while (! todo.empty()) {
+                ops.add(1);
+                Range& range = todo.back();
+                if (range.first == range.last) {
+                    ops.add(1);
+                    built.push_back(leaves[range.first]);
+                    todo.pop_back();
+                }
+                else if (! range.split) {
+                    ops.add(4);
+                    range.split = true;
+                    size_t split = FindBreakingIndex(range.first, range.last);
+                    Range right{split + 1, range.last, false};
+                    Range left{range.first, split, false};
+                    todo.push_back(right);
+                    todo.push_back(left);
+                }
+                else {
+                    ops.add(3);
+                    NodePtr childR = std::move(built.back());
+                    built.pop_back();
+                    NodePtr childL = std::move(built.back());
+                    built.pop_back();
+                    // Internal node constructor also requiers +1 ops
+                    built.push_back(NodePtr{new InternalNode{childL, childR}});
+                    todo.pop_back();
+                }
+            }
+            return built.back();
+        }
+
+        // The last leaf of the left part of first..last, the split whose
+        // parts differ least in frequency, the first one of a tie. The
+        // sum of the left part grows with the split, so the first split
+        // that holds half the sum is searched for from both ends at once
+        // in growing steps, then halving them: O(log) of the smaller
+        // part, and a chain of n leaves is split in O(n).
+        size_t FindBreakingIndex(size_t first, size_t last) const
+        {
+            ops.add(6);
+            const uint64_t total = sums[last + 1] - sums[first];
+            auto half = [&](size_t k) {
+                return 2 * (sums[k + 1] - sums[first]) >= total;
+            };
+            // the split is in lo..hi
+            size_t lo = first;
+            size_t hi = last;
+            for (size_t step = 1; lo < hi; step *= 2) {
+                ops.add(4);
+                size_t left = first + step - 1;
+                if (left >= hi) {
+                    break;
+                }
+                if (half(left)) {
+                    hi = left;
+                    break;
+                }
+                lo = left + 1;
+                if (last < lo + step) {
+                    break;
+                }
+                size_t right = last - step;
+                if (! half(right)) {
+                    lo = right + 1;
+                    break;
+                }
+                hi = right;
+            }
+            while (lo < hi) {
+                ops.add(3);
+                size_t mid = lo + (hi - lo) / 2;
+                if (half(mid)) {
+                    hi = mid;
+                } else {
+                    lo = mid + 1;
+                }
+            }
+            // the split before may be as close to half
+            auto gap = [&](size_t k) {
+                int64_t func = 2 * (sums[k + 1] - sums[first]) - total;
+                return func < 0 ? -func : func;
+            };
+            size_t split = std::min(lo, last - 1);
+            if (split > first && gap(split - 1) <= gap(split)) {
+                ops.add(2);
+                split--;
+            }
+            return split;
+        }
+
+    private:
+        // sums[i] is the frequency of the leaves before leaf i
+        vector<uint64_t> sums;
+};
+
+//=============================================================================
+// The coders -a auto tries. Every one writes the whole archive in turn
+// and the smallest is kept, so the sizes compared are those of real
+// archives: headers, fallbacks and the index included.
+class AutoSelector
+{
+    public:
+        struct Choice
+        {
+            ALGORITHM algo;
+            int order;
+            TRANSFORM transform;
+            // the text copied as it is
+            bool stored;
+        };
+
+        // simpler coders first, a tie keeps the earlier one
+        static vector<Choice> Candidates()
+        {
+            vector<Choice> all{Choice{ALGORITHM::huffman, 0, TRANSFORM::none, true}};
+            for (int order=0; order<2; order++) {
+                all.push_back(Choice{ALGORITHM::huffman, order, TRANSFORM::none, false});
+                all.push_back(Choice{ALGORITHM::shennon, order, TRANSFORM::none, false});
+            }
+            for (TRANSFORM transform : {TRANSFORM::bwt, TRANSFORM::lz77, TRANSFORM::words}) {
+                all.push_back(Choice{ALGORITHM::huffman, 0, transform, false});
+                all.push_back(Choice{ALGORITHM::shennon, 0, transform, false});
+            }
+            return all;
+        }
+};
+
+/** @} */ // end doxygroup
+
+/* -----------------------------------------------------------------------------*/
+/**
+ *  @defgroup decoders Class to facilitate decoding
+ *  @{
+ */
+
+//=============================================================================
+class Decoder
+{
+    public:
+        void Decode(bit_ifstream& is, ucs4_ofstream& os) {
+            ProfileScope scope{STAGE::decode};
+            if (is.method() == METHOD::bwt) {
+                DecodeBwt(is, os);
+                return;
+            }
+            if (is.method() == METHOD::lz77) {
+                DecodeLz77(is, os);
+                return;
+            }
+            if (is.method() == METHOD::words) {
+                DecodeWords(is, os);
+                return;
+            }
+            if (is.method() == METHOD::order1) {
+                DecodeOrder1(is, os);
+                return;
+            }
+            if (is.method() == METHOD::stored) {
+                DecodeStored(is, os);
+                return;
+            }
+            if (is.method() == METHOD::rle) {
+                DecodeRuns(is, os);
+                return;
+            }
+            if (is.method() == METHOD::pack) {
+                throw runtime_error("Multi-file archive, use unpack.");
+            }
+            ops.add(2);
+            if (is.method() == METHOD::sampled) {
+                ReadLengths(is);
+                TransformDecodeEscaped(is, os);
+                return;
+            }
+            if (is.method() == METHOD::lengths) {
+                ReadLengths(is);
+            } else {
+                ReadTree(is);
+            }
+            TransformDecode(is, os);
+        }
+
+        // member names of a multi-file archive, reads the shared tree
+        vector<string> ReadPackHeader(bit_ifstream& is)
+        {
+            ops.add(4);
+            if (is.method() != METHOD::pack) {
+                throw runtime_error("Not a multi-file archive.");
+            }
+            uint64_t count = 0;
+            is.getvarint(count);
+            vector<string> names;
+            for (uint64_t i=0; i<count && is.good(); i++) {
+                ops.add(4);
+                // the bytes shared with the name before, then the rest
+                uint64_t common = 0;
+                uint64_t len = 0;
+                is.getvarint(common);
+                is.getvarint(len);
+                if (common > (names.empty() ? 0 : names.back().size())) {
+                    throw runtime_error("Bad archive header.");
+                }
+                string name = names.empty() ? string{} : names.back().substr(0, common);
+                for (uint64_t j=0; j<len && is.good(); j++) {
+                    ops.add(2);
+                    uint64_t c = 0;
+                    is.getnumber(c, 8);
+                    name.push_back(static_cast<char>(c));
+                }
+                names.push_back(name);
+            }
+            pack_shared = false;
+            if (is.getbit(pack_shared).good() && pack_shared) {
+                ops.add(2);
+                ReadMemberTree(is);
+                shared_code2ch = std::move(code2ch);
+            }
+            if (! is.good()) {
+                throw runtime_error("Bad archive header.");
+            }
+            return names;
+        }
+
+        // the member coded in the given block of the archive
+        void DecodeMember(bit_ifstream& is, const BlockEntry& block, ucs4_ofstream& os)
+        {
+            ProfileScope scope{STAGE::decode};
+            ops.add(4);
+            is.seekbit(block.offset * 8);
+            uint64_t n = 0;
+            is.getvarint(n);
+            bool shared = false;
+            if (n > 0 && is.getbit(shared).good() && ! shared) {
+                ops.add(1);
+                ReadMemberTree(is);
+            }
+            if (shared && ! pack_shared) {
+                throw runtime_error("Bad archive member.");
+            }
+            const DecodeMap& codes = shared ? shared_code2ch : code2ch;
+            // a tree of one symbol leaves nothing to decode
+            if (codes.size() == 1) {
+                ops.add(1);
+                for (uint64_t i=0; i<n; i++) {
+                    ops.add(1);
+                    os << codes.widest();
+                }
+                return;
+            }
+            for (uint64_t i=0; i<n; i++) {
+                ops.add(2);
+                char32_t ch;
+                DecodeSymbol(is, codes, ch);
+                os << ch;
+            }
+        }
+
+        // Decode only len symbols from start on. The tables are read
+        // as usual, then decoding jumps to the nearest seek point.
+        void DecodeRange(bit_ifstream& is, ucs4_ofstream& os, uint64_t start, uint64_t len)
+        {
+            ops.add(4);
+            if (len == 0) {
+                return;
+            }
+            skip = start;
+            left = len;
+            const SeekTable& table = is.seek_table();
+            auto after = std::upper_bound(table.begin(), table.end(), start,
+                    [](uint64_t symbol, const SeekPoint& sp) { return symbol < sp.symbol; });
+            if (after != table.begin()) {
+                ops.add(1);
+                resume = &*(after - 1);
+            }
+            Decode(is, os);
+        }
+
+        // bytes of working memory a block may take, 0 - no limit
+        void SetMemoryLimit(uint64_t bytes) {
+            memory_limit = bytes;
+        }
+
+        // forget the last archive and the limit, as if just constructed
+        void Clear() {
+            ops.add(3);
+            memory_limit = 0;
+            skip = 0;
+            left = UINT64_MAX;
+            resume = nullptr;
+            pack_shared = false;
+            shared_code2ch.clear();
+            code2ch.clear();
+            ctx2ch.clear();
+            fallback_ch.clear();
+            leaf_format = LEAF::utf8;
+            leaf_bits = 0;
+        }
+
+    protected:
+
+        static const size_t chunk_size = 1 << 16;
+        uint64_t memory_limit = 0;
+        // symbols to drop before the range and to write after that
+        uint64_t skip = 0;
+        uint64_t left = UINT64_MAX;
+        // where decoding of the range starts
+        const SeekPoint* resume = nullptr;
+        // the tree of a multi-file archive its members may share
+        bool pack_shared = false;
+        DecodeMap shared_code2ch{};
+        DecodeMap code2ch{};
+        ContextDecodeMap ctx2ch{};
+        wstring_convert<std::codecvt_utf8<char32_t>, char32_t> ucs4conv{};
+        DecodeMap fallback_ch{};
+        LEAF leaf_format = LEAF::utf8;
+        // width of LEAF::number leaves
+        int leaf_bits = 0;
+
+        // jump to the seek point of the range, once
+        void Resume(bit_ifstream& is)
+        {
+            ops.add(1);
+            if (resume != nullptr) {
                 ops.add(3);
-                string utf8;
-                getutf8(utf8);
-                basic_string<char32_t> ucs4 = ucs4conv.from_bytes(utf8);
-                ch = *ucs4.begin();
-            } catch(const std::range_error& e) {
+                is.seekbit(resume->bit);
+                skip -= resume->symbol;
+                resume = nullptr;
+            }
+        }
+
+        // symbols before the range are dropped, false once the range is written
+        bool Emit(ucs4_ofstream& os, char32_t ch)
+        {
+            ops.add(1);
+            if (skip > 0) {
+                skip--;
+                return true;
+            }
+            os << ch;
+            return --left > 0;
+        }
+
+        bool EmitSpan(ucs4_ofstream& os, const char32_t* data, uint64_t qty)
+        {
+            ops.add(4);
+            uint64_t drop = std::min(skip, qty);
+            skip -= drop;
+            qty = std::min(qty - drop, left);
+            os.write(data + drop, qty);
+            left -= qty;
+            return left > 0;
+        }
+
+        void ReadTree(bit_ifstream& is)
+        {
+            ProfileScope scope{STAGE::tree_read};
+            ops.add(2);
+            code2ch.clear();
+            InnerReadTree(is);
+            // the encoder gives a lone leaf the code "0"
+            if (code2ch.size() == 1 && code2ch.longest() == 0) {
+                ops.add(2);
+                char32_t ch = code2ch.widest();
+                code2ch.clear();
+                code2ch.Add(VariableCode{false}, ch);
+            }
+        }
+
+        // the canonical codes of the lengths in a compact header
+        void ReadLengths(bit_ifstream& is)
+        {
+            ProfileScope scope{STAGE::tree_read};
+            ops.add(1);
+            CompactHeader::Codes(CompactHeader::Read(is), code2ch);
+        }
+
+        // a code-length header or a tree, as the bit before it says
+        void ReadMemberTree(bit_ifstream& is)
+        {
+            ops.add(2);
+            bool compact = false;
+            is.getbit(compact);
+            code2ch.clear();
+            if (compact) {
+                ReadLengths(is);
+            } else {
+                ReadTree(is);
+            }
+        }
+
+        // The nodes come in preorder. node is the next one in code2ch; an
+        // internal node goes on to its left child and leaves itself and
+        // the depth of its children on a stack for the right one after
+        // the left subtree. Each node read is a node of code2ch, so the
+        // tree is read in O(1) a node however deep it is.
+        void InnerReadTree(bit_ifstream& is)
+        {
+            struct Pending
+            {
+                uint32_t node;
+                size_t depth;
+            };
+            uint32_t node = 0;
+            size_t depth = 0;
+            vector<Pending> right;
+            while (true) {
+                ops.add(1);
+                if (! is.good()) {
+                    throw runtime_error("Could not reconstruct tree.");
+                }
+                bool bit = false;
+                ops.add(1);
+                is.getbit(bit);
+                if (! bit) {
+                    ops.add(6);
+                    right.push_back(Pending{node, depth + 1});
+                    node = code2ch.Child(node, false);
+                    depth++;
+                    continue;
+                }
+                // read letter
+                ops.add(3);
+                char32_t ch = 0;
+                ReadLeaf(ch, is);
+                code2ch.SetLeaf(node, ch, depth);
+                if (right.empty()) {
+                    return;
+                }
+                node = code2ch.Child(right.back().node, true);
+                depth = right.back().depth;
+                right.pop_back();
+            }
+        }
+
+        void TransformDecode(bit_ifstream& is, ucs4_ofstream& os)
+        {
+            ops.add(2);
+            if (is.good() && os.good() && is.has_totals() && resume == nullptr) {
+                ops.add(1);
+                TransformDecodeCounted(is, os);
+                return;
+            }
+            if (is.good() && os.good()) {
+                // we can continue
+                bool bit;
+                // a bit no code has leaves the rest of the data undecoded
+                uint32_t node = 0;
+                bool lost = false;
+                ops.add(2);
+                Resume(is);
+                while (is.getbit(bit).good())
+                {
+                    ops.add(2);
+                    if (lost) {
+                        continue;
+                    }
+                    node = code2ch.Next(node, bit);
+                    lost = (node == 0);
+                    if (! lost && code2ch.Leaf(node)) {
+                        ops.add(3);
+                        if (! Emit(os, code2ch.Symbol(node))) {
+                            return;
+                        }
+                        node = 0;
+                    }
+                }
+                ops.add(1);
+                if (! is.eof()) {
+                    // we stopped reading the file, but it is not EOF yet.
+                    ops.add(1);
+                    throw std::runtime_error("Could not encode");
+                }
+                // we reached eof. all ok
+            }
+        }
+
+        // The text of a sampled archive, escaped symbols follow the escape
+        // code. Sampled archives always have the totals.
+        void TransformDecodeEscaped(bit_ifstream& is, ucs4_ofstream& os)
+        {
+            ops.add(4);
+            if (! is.has_totals()) {
+                throw runtime_error("Could not decode");
+            }
+            if (code2ch.widest() < SymbolTraits<uint16_t>::limit) {
+                DecodeTree<uint16_t> tree;
+                if (tree.Fill(code2ch)) {
+                    DecodeEscaped(is, os, [&](char32_t& ch) -> bool {
+                        uint16_t symbol = 0;
+                        if (! tree.Decode(is, symbol)) {
+                            return false;
+                        }
+                        ch = symbol;
+                        return true;
+                    });
+                    return;
+                }
+            }
+            DecodeEscaped(is, os, [&](char32_t& ch) -> bool {
+                DecodeSymbol(is, code2ch, ch);
+                return true;
+            });
+        }
+
+        // next(ch) reads a code, false at the end of the coded data
+        template <typename Next>
+        void DecodeEscaped(bit_ifstream& is, ucs4_ofstream& os, Next next)
+        {
+            ops.add(3);
+            uint64_t n = is.totals().symbols;
+            uint64_t done = (resume != nullptr) ? resume->symbol : 0;
+            Resume(is);
+            char32_t ch = 0;
+            while (done < n) {
+                ops.add(3);
+                if (! next(ch)) {
+                    throw runtime_error("Could not decode");
+                }
+                if (ch == escape_symbol) {
+                    ops.add(2);
+                    uint64_t value = 0;
+                    is.getnumber(value, escape_bits);
+                    if (! is.good() || value > 0x10FFFF) {
+                        throw runtime_error("Could not decode");
+                    }
+                    ch = value;
+                }
+                done++;
+                if (! Emit(os, ch)) {
+                    return;
+                }
+            }
+        }
+
+        // The totals give the number of symbols. As many codes as can not
+        // reach past the coded data are read in a loop of fixed trip
+        // count without end checks, the last few by the careful path.
+        void TransformDecodeCounted(bit_ifstream& is, ucs4_ofstream& os)
+        {
+            ops.add(4);
+            // the narrowest symbol type that holds the alphabet
+            char32_t widest = code2ch.widest();
+            if (widest < SymbolTraits<uint8_t>::limit) {
+                DecodeTree<uint8_t> tree;
+                if (tree.Fill(code2ch)) {
+                    DecodeCountedAs(tree, is, os);
+                    return;
+                }
+            } else if (widest < SymbolTraits<uint16_t>::limit) {
+                DecodeTree<uint16_t> tree;
+                if (tree.Fill(code2ch)) {
+                    DecodeCountedAs(tree, is, os);
+                    return;
+                }
+            }
+            size_t longest = code2ch.longest();
+            uint64_t n = is.totals().symbols;
+            uint64_t done = 0;
+            while (done < n && longest > 0) {
+                ops.add(4);
+                uint64_t safe = std::min<uint64_t>(n - done, is.bits_left() / longest);
+                if (safe == 0) {
+                    break;
+                }
+                for (uint64_t i=0; i<safe; i++) {
+                    // per bit and per symbol as the getbit loop counted them
+                    ops.add(3);
+                    uint32_t node = 0;
+                    bool bit = false;
+                    do {
+                        ops.add(2);
+                        is.getbit_unchecked(bit);
+                        node = code2ch.Next(node, bit);
+                    } while (node != 0 && ! code2ch.Leaf(node));
+                    if (node == 0) {
+                        throw std::runtime_error("Could not decode");
+                    }
+                    if (! Emit(os, code2ch.Symbol(node))) {
+                        return;
+                    }
+                }
+                done += safe;
+            }
+            is.finish_unchecked();
+            for (; done < n; done++) {
+                ops.add(2);
+                char32_t ch;
+                DecodeSymbol(is, code2ch, ch);
+                if (! Emit(os, ch)) {
+                    return;
+                }
+            }
+        }
+
+        // TransformDecodeCounted with a flat tree of T symbols,
+        // the symbols are written in runs
+        template <typename T>
+        void DecodeCountedAs(const DecodeTree<T>& tree, bit_ifstream& is, ucs4_ofstream& os)
+        {
+            ops.add(3);
+            uint64_t n = is.totals().symbols;
+            uint64_t done = 0;
+            std::array<char32_t, 4096> run;
+            while (done < n) {
+                ops.add(4);
+                uint64_t safe = std::min<uint64_t>(n - done, is.bits_left() / tree.longest());
+                if (safe == 0) {
+                    break;
+                }
+                for (uint64_t i=0; i<safe; ) {
+                    ops.add(2);
+                    size_t qty = std::min<uint64_t>(safe - i, run.size());
+                    for (size_t j=0; j<qty; j++) {
+                        // the symbol and its Emit, as the map loop counted them
+                        ops.add(3);
+                        run[j] = tree.DecodeUnchecked(is);
+                    }
+                    if (! EmitSpan(os, run.data(), qty)) {
+                        return;
+                    }
+                    i += qty;
+                }
+                done += safe;
+            }
+            is.finish_unchecked();
+            for (; done < n; done++) {
+                ops.add(2);
+                char32_t ch;
+                DecodeSymbol(is, code2ch, ch);
+                if (! Emit(os, ch)) {
+                    return;
+                }
+            }
+        }
+
+        void ReadLeaf(char32_t& ch, bit_ifstream& is)
+        {
+            uint64_t value = 0;
+            if (leaf_format == LEAF::number) {
+                ops.add(2);
+                is.getnumber(value, leaf_bits);
+                ch = value;
+                return;
+            }
+            if (leaf_format == LEAF::litlen) {
+                ops.add(2);
+                bool is_length = false;
+                is.getbit(is_length);
+                if (is_length) {
+                    is.getnumber(value, Lz77Transform::code_bits);
+                    ch = Lz77Transform::length_base + value;
+                    return;
+                }
+            }
+            is.getucs4(ch);
+        }
+
+        // read one symbol coded with the given table
+        void DecodeSymbol(bit_ifstream& is, const DecodeMap& codes, char32_t& ch)
+        {
+            ops.add(2);
+            bool bit = false;
+            uint32_t node = 0;
+            while (is.getbit(bit).good())
+            {
+                ops.add(3);
+                node = codes.Next(node, bit);
+                if (node == 0) {
+                    break;
+                }
+                if (codes.Leaf(node)) {
+                    ops.add(1);
+                    ch = codes.Symbol(node);
+                    return;
+                }
+            }
+            throw std::runtime_error("Could not decode");
+        }
+
+        // read exactly qty symbols coded with code2ch
+        void DecodeSymbols(bit_ifstream& is, uint64_t qty, vector<uint32_t>& out)
+        {
+            ops.add(3);
+            out.clear();
+            for (uint64_t i=0; i<qty; i++) {
+                ops.add(2);
+                char32_t ch;
+                DecodeSymbol(is, code2ch, ch);
+                out.push_back(ch);
+            }
+        }
+
+        // the block size is chosen by the encoder, a block
+        // too large for --max-memory can not be decoded
+        void CheckBlockMemory(uint64_t n, TRANSFORM transform)
+        {
+            if (memory_limit == 0) {
+                return;
+            }
+            ops.add(2);
+            if (MemoryBudget::DecodeBytes(n, transform) > memory_limit) {
+                throw runtime_error("Block of " + std::to_string(n) + " symbols needs more than --max-memory.");
+            }
+        }
+
+        // the order-1 contexts and the words dictionary are
+        // read whole, checked as they grow
+        void CheckTableMemory(uint64_t bytes, const char* what)
+        {
+            if (memory_limit == 0) {
+                return;
+            }
+            ops.add(2);
+            if (bytes > MemoryBudget::TableBytes(memory_limit)) {
+                throw runtime_error(string(what) + " needs more than --max-memory.");
+            }
+        }
+
+        // blocks start on whole bytes
+        bit_ifstream& NextBlock(bit_ifstream& is)
+        {
+            ops.add(1);
+            is.align();
+            return is;
+        }
+
+        // read the block kind, decode stored and run blocks.
+        // repeat - the block is coded with the trees of the last one
+        bool DecodeFallbackBlock(bit_ifstream& is, ucs4_ofstream& os, bool& repeat)
+        {
+            ops.add(3);
+            uint64_t kind = 0;
+            is.getnumber(kind, 2);
+            repeat = kind == static_cast<uint8_t>(BLOCK::repeat);
+            if (kind == static_cast<uint8_t>(BLOCK::coded) || repeat) {
+                return false;
+            }
+            if (kind == static_cast<uint8_t>(BLOCK::stored)) {
+                DecodeStoredBlock(is, os);
+            } else if (kind == static_cast<uint8_t>(BLOCK::runs)) {
+                DecodeRuns(is, os);
+            } else {
+                throw runtime_error("Bad block kind.");
+            }
+            return true;
+        }
+
+        void DecodeBwt(bit_ifstream& is, ucs4_ofstream& os)
+        {
+            ops.add(2);
+            bool more = false;
+            bool repeat = false;
+            vector<uint32_t> coded;
+            code2ch.clear();
+            Resume(is);
+            while (left > 0 && NextBlock(is).getbit(more).good() && more) {
+                if (DecodeFallbackBlock(is, os, repeat)) {
+                    continue;
+                }
+                ops.add(8);
+                uint64_t n, primary, k, m;
+                is.getnumber(n, 32);
+                is.getnumber(primary, 32);
+                is.getnumber(k, 32);
+                if (k == 0 || k > n) {
+                    throw runtime_error("Bad block header.");
+                }
+                CheckBlockMemory(n, TRANSFORM::bwt);
+                vector<char32_t> alphabet(k);
+                for (auto& ch : alphabet) {
+                    ops.add(1);
+                    is.getucs4(ch);
+                }
+                is.getnumber(m, 32);
+                if (repeat && code2ch.empty()) {
+                    throw runtime_error("Bad block kind.");
+                }
+                if (! repeat) {
+                    ops.add(2);
+                    code2ch.clear();
+                    leaf_format = LEAF::number;
+                    leaf_bits = MtfRleTransform::SymbolBits(k);
+                    ReadTree(is);
+                    leaf_format = LEAF::utf8;
+                }
+                DecodeSymbols(is, m, coded);
+                vector<uint32_t> last = MtfRleTransform::Inverse(coded, k, n);
+                for (const auto& r : BwtTransform::Inverse(last, primary, k)) {
+                    ops.add(2);
+                    if (! Emit(os, alphabet[r])) {
+                        break;
+                    }
+                }
+            }
+            if (! is.good()) {
+                ops.add(1);
+                throw std::runtime_error("Could not decode");
+            }
+        }
+
+        void DecodeLz77(bit_ifstream& is, ucs4_ofstream& os)
+        {
+            ops.add(2);
+            typedef Lz77Transform LZ;
+            bool more = false;
+            bool repeat = false;
+            vector<char32_t> block;
+            // the trees of the last coded block
+            DecodeMap litlen_ch;
+            DecodeMap dist_ch;
+            Resume(is);
+            while (left > 0 && NextBlock(is).getbit(more).good() && more) {
+                if (DecodeFallbackBlock(is, os, repeat)) {
+                    continue;
+                }
+                ops.add(8);
+                uint64_t n, ntokens;
+                is.getnumber(n, 32);
+                is.getnumber(ntokens, 32);
+                CheckBlockMemory(n, TRANSFORM::lz77);
+                if (repeat && litlen_ch.empty()) {
+                    throw runtime_error("Bad block kind.");
+                }
+                if (! repeat) {
+                    leaf_format = LEAF::litlen;
+                    code2ch.clear();
+                    ReadTree(is);
+                    litlen_ch.swap(code2ch);
+                    dist_ch.clear();
+                    bool has_dist = false;
+                    is.getbit(has_dist);
+                    if (has_dist) {
+                        ops.add(3);
+                        leaf_format = LEAF::number;
+                        leaf_bits = LZ::code_bits;
+                        code2ch.clear();
+                        ReadTree(is);
+                        dist_ch.swap(code2ch);
+                    }
+                    leaf_format = LEAF::utf8;
+                }
+
+                block.clear();
+                for (uint64_t i=0; i<ntokens; i++) {
+                    ops.add(3);
+                    char32_t sym;
+                    DecodeSymbol(is, litlen_ch, sym);
+                    LZ::Token t{sym, 0, 0};
+                    if (sym >= LZ::length_base) {
+                        ops.add(8);
+                        uint32_t code = sym - LZ::length_base;
+                        if (code >= LZ::length_codes) {
+                            throw runtime_error("Bad length code.");
+                        }
+                        uint64_t extra = 0;
+                        is.getnumber(extra, LZ::LengthExtra()[code]);
+                        t.length = LZ::LengthBase()[code] + extra;
+                        char32_t dcode;
+                        DecodeSymbol(is, dist_ch, dcode);
+                        if (dcode >= LZ::distance_codes) {
+                            throw runtime_error("Bad distance code.");
+                        }
+                        is.getnumber(extra, LZ::DistanceExtra()[dcode]);
+                        t.distance = LZ::DistanceBase()[dcode] + extra;
+                    }
+                    LZ::Inverse(t, block);
+                    if (block.size() > n) {
+                        throw runtime_error("Bad block length.");
+                    }
+                }
+                if (block.size() != n) {
+                    throw runtime_error("Bad block length.");
+                }
+                ops.add(block.size());
+                EmitSpan(os, block.data(), block.size());
+            }
+            if (! is.good()) {
                 ops.add(1);
-                cout << "Error!\n" << endl;
+                throw std::runtime_error("Could not decode");
+            }
+        }
+
+        // The symbol tree, the dictionary spelled with it, the tree of the
+        // dictionary indices, then the tokens. The index past the last
+        // word is the escape of a token spelled out.
+        void DecodeWords(bit_ifstream& is, ucs4_ofstream& os)
+        {
+            typedef WordTransform WT;
+            ops.add(6);
+            code2ch.clear();
+            ReadTree(is);
+            DecodeMap symbols;
+            symbols.swap(code2ch);
+            std::unique_ptr<DecodeTree<uint16_t>> symbol_tree{new DecodeTree<uint16_t>};
+            if (! symbol_tree->Fill(symbols)) {
+                symbol_tree.reset();
+            }
+            uint64_t words = 0;
+            if (! is.getvarint(words).good() || words > WT::max_words) {
+                throw runtime_error("Bad dictionary.");
+            }
+            uint64_t table_bytes = words * MemoryBudget::word_entry;
+            CheckTableMemory(table_bytes, "Dictionary");
+            vector<std::u32string> dictionary(words);
+            for (auto& word : dictionary) {
                 ops.add(1);
-                this->setstate(ios::failbit);
+                ReadToken(is, symbols, symbol_tree.get(), word);
+                table_bytes += sizeof(char32_t) * word.size();
+                CheckTableMemory(table_bytes, "Dictionary");
             }
+            leaf_format = LEAF::number;
+            leaf_bits = WT::IndexBits(words);
+            ReadTree(is);
+            leaf_format = LEAF::utf8;
             ops.add(1);
-            return *this;
+            if (code2ch.widest() > words) {
+                throw runtime_error("Bad dictionary.");
+            }
+            std::unique_ptr<DecodeTree<uint16_t>> tree{new DecodeTree<uint16_t>};
+            if (! tree->Fill(code2ch)) {
+                tree.reset();
+            }
+            uint64_t tokens = 0;
+            is.getvarint(tokens);
+            // after a seek the symbols left tell where the text ends
+            bool counted = (resume == nullptr);
+            uint64_t done = counted ? 0 : resume->symbol;
+            uint64_t total = is.has_totals() ? is.totals().symbols : UINT64_MAX;
+            Resume(is);
+            std::u32string spelled;
+            while (counted ? tokens > 0 : done < total) {
+                ops.add(3);
+                char32_t i = 0;
+                uint16_t symbol = 0;
+                if (! tree) {
+                    DecodeSymbol(is, code2ch, i);
+                } else if (tree->Decode(is, symbol)) {
+                    i = symbol;
+                } else {
+                    throw runtime_error("Could not decode");
+                }
+                const std::u32string* token = &spelled;
+                if (i < words) {
+                    token = &dictionary[i];
+                } else {
+                    ops.add(1);
+                    ReadToken(is, symbols, symbol_tree.get(), spelled);
+                }
+                tokens--;
+                done += token->size();
+                if (! EmitSpan(os, token->data(), token->size())) {
+                    return;
+                }
+            }
+            if (! is.good()) {
+                ops.add(1);
+                throw std::runtime_error("Could not decode");
+            }
         }
 
+        // the length of a token, then its symbols, with the tree if it
+        // could be made flat
+        void ReadToken(bit_ifstream& is, const DecodeMap& symbols,
+                const DecodeTree<uint16_t>* tree, std::u32string& token)
+        {
+            ops.add(2);
+            uint64_t len = 0;
+            if (! is.getgamma(len).good() || len > WordTransform::max_token) {
+                throw runtime_error("Bad dictionary.");
+            }
+            token.resize(len);
+            for (auto& ch : token) {
+                ops.add(1);
+                uint16_t symbol = 0;
+                if (! tree) {
+                    DecodeSymbol(is, symbols, ch);
+                } else if (tree->Decode(is, symbol)) {
+                    ch = symbol;
+                } else {
+                    throw runtime_error("Could not decode");
+                }
+            }
+        }
 
-    protected:
-        int nbit = 0;
-        uint8_t trash_size = 0;
-        bool lastbyte = false;
-        char bitbuf;
-        wstring_convert<std::codecvt_utf8<char32_t>, char32_t> ucs4conv{};
-
-        // i is the distance from left byte border
-        bool hasbit(char ch, int i) {
+        // the text follows the header byte as is, read it in chunks
+        void DecodeStored(bit_ifstream& is, ucs4_ofstream& os)
+        {
             ops.add(3);
-            return ch & (1 << (7-i));
+            string pending;
+            vector<char> buf(chunk_size);
+            std::streamsize got;
+            Resume(is);
+            while ((got = is.getbytes(buf.data(), buf.size())) > 0) {
+                ops.add(2);
+                pending.append(buf.data(), got);
+                if (! WriteUtf8(pending, os)) {
+                    return;
+                }
+            }
+            ops.add(1);
+            if (! pending.empty() || ! is.eof()) {
+                ops.add(1);
+                throw std::runtime_error("Could not decode");
+            }
         }
 
-        bit_ifstream& getutf8(string& utf8) {
+        // a stored block inside a block stream
+        void DecodeStoredBlock(bit_ifstream& is, ucs4_ofstream& os)
+        {
+            ops.add(4);
+            uint64_t bytes = 0;
+            is.align();
+            if (! is.getvarint(bytes).good()) {
+                throw std::runtime_error("Could not decode");
+            }
+            string pending(bytes, '\0');
+            if (bytes > 0 && is.getbytes(&pending[0], bytes) != static_cast<std::streamsize>(bytes)) {
+                throw std::runtime_error("Could not decode");
+            }
+            if (WriteUtf8(pending, os) && ! pending.empty()) {
+                throw std::runtime_error("Could not decode");
+            }
+        }
+
+        // (length, symbol) pairs up to a zero length
+        void DecodeRuns(bit_ifstream& is, ucs4_ofstream& os)
+        {
             ops.add(2);
-            char firstbyte = '\0';
-            getarray(&firstbyte, 8);
-            // examine first byte
+            uint64_t run = 0;
+            vector<char32_t> buf;
+            while (is.getvarint(run).good() && run > 0) {
+                ops.add(3);
+                char32_t ch;
+                if (! is.getucs4(ch).good()) {
+                    break;
+                }
+                buf.assign(std::min<uint64_t>(run, chunk_size), ch);
+                while (run > 0) {
+                    ops.add(3);
+                    uint64_t qty = std::min<uint64_t>(run, buf.size());
+                    if (! EmitSpan(os, buf.data(), qty)) {
+                        return;
+                    }
+                    run -= qty;
+                }
+            }
+            if (! is.good()) {
+                ops.add(1);
+                throw std::runtime_error("Could not decode");
+            }
+        }
+
+        // Convert the complete UTF-8 sequences, keep an incomplete tail.
+        // Returns false once the requested range is written.
+        bool WriteUtf8(string& pending, ucs4_ofstream& os)
+        {
+            ops.add(4);
+            size_t lead = pending.size();
+            while (lead > 0 && pending.size() - lead < 4) {
+                ops.add(2);
+                --lead;
+                if ((static_cast<unsigned char>(pending[lead]) & 0xc0) != 0x80) {
+                    break;
+                }
+            }
+            size_t cut = pending.size();
+            if (lead < cut) {
+                ops.add(3);
+                unsigned char c = pending[lead];
+                size_t need = (c >= 0xf0) ? 4 : (c >= 0xe0) ? 3 : (c >= 0xc0) ? 2 : 1;
+                if (lead + need > cut) {
+                    cut = lead;
+                }
+            }
+            try {
+                ops.add(cut);
+                basic_string<char32_t> ucs4 = ucs4conv.from_bytes(pending.data(), pending.data() + cut);
+                pending.erase(0, cut);
+                return EmitSpan(os, ucs4.data(), ucs4.size());
+            } catch(const std::range_error& e) {
+                throw std::runtime_error("Could not decode");
+            }
+        }
+
+        void DecodeOrder1(bit_ifstream& is, ucs4_ofstream& os)
+        {
+            ops.add(4);
+            uint64_t nctx = 0;
+            is.getnumber(nctx, 32);
+            uint64_t entries = 0;
+            for (uint64_t i=0; i<nctx; i++) {
+                ops.add(4);
+                char32_t ctx;
+                is.getucs4(ctx);
+                code2ch.clear();
+                ReadTree(is);
+                entries += code2ch.size();
+                CheckTableMemory(entries * MemoryBudget::context_entry, "Order-1 header");
+                ctx2ch[ctx].swap(code2ch);
+            }
+            bool has_fallback = false;
+            is.getbit(has_fallback);
+            if (has_fallback) {
+                ops.add(2);
+                code2ch.clear();
+                ReadTree(is);
+                fallback_ch.swap(code2ch);
+            }
+            TransformContextDecode(is, os);
+        }
+
+        void TransformContextDecode(bit_ifstream& is, ucs4_ofstream& os)
+        {
             ops.add(2);
-            if (hasbit(firstbyte, 0)) {
-                // if multibyte then read as many bytes as necessary
-                ops.add(7);
-                int nbytes = 0;
-                while (hasbit(firstbyte, nbytes)) {
+            if (is.good() && os.good()) {
+                bool bit = false;
+                // a bit no code has leaves the rest of the data undecoded
+                uint32_t node = 0;
+                bool lost = false;
+                // the first symbol was coded with the fallback table
+                const DecodeMap* codes = &fallback_ch;
+                ops.add(3);
+                if (resume != nullptr && resume->context != no_context) {
+                    ops.add(2);
+                    auto ctx = ctx2ch.find(resume->context);
+                    codes = (ctx != ctx2ch.end()) ? &ctx->second : &fallback_ch;
+                }
+                Resume(is);
+                while (is.getbit(bit).good())
+                {
+                    ops.add(2);
+                    if (lost) {
+                        continue;
+                    }
+                    node = codes->Next(node, bit);
+                    lost = (node == 0);
+                    if (! lost && codes->Leaf(node)) {
+                        ops.add(6);
+                        char32_t ch = codes->Symbol(node);
+                        if (! Emit(os, ch)) {
+                            return;
+                        }
+                        node = 0;
+                        auto next = ctx2ch.find(ch);
+                        codes = (next != ctx2ch.end()) ? &next->second : &fallback_ch;
+                    }
+                }
+                ops.add(1);
+                if (! is.eof()) {
                     ops.add(1);
-                    nbytes++;
+                    throw std::runtime_error("Could not decode");
                 }
-                char utf8_code[nbytes];
-                std::fill(utf8_code, utf8_code+nbytes, 0);
-                utf8_code[0] = firstbyte;
-                getarray(&utf8_code[1], (nbytes-1) * 8);
-                utf8.append(&utf8_code[0], nbytes);
+            }
+        }
+
+};
+const size_t Decoder::chunk_size;
+
+//=============================================================================
+class ArchiveChecker
+{
+    public:
+        // The totals of the input file, counted along with its checksum.
+        // Whole-file methods write a single block, its text is the file.
+        static void SetWholeText(const string& fname, bit_ofstream& out)
+        {
+            ifstream in{fname, ios::binary | ios::in};
+            uint64_t bytes = 0;
+            uint64_t symbols = 0;
+            uint32_t crc = RangeChecksum(in, UINT64_MAX, bytes, &symbols);
+            if (out.block_count() == 1) {
+                out.set_block_text(bytes, crc);
+            }
+            out.set_totals(symbols, bytes);
+        }
+
+        // the current block decodes to the whole file
+        static void SetFileText(const string& fname, bit_ofstream& out)
+        {
+            ifstream in{fname, ios::binary | ios::in};
+            uint64_t bytes = 0;
+            uint32_t crc = RangeChecksum(in, UINT64_MAX, bytes);
+            out.set_block_text(bytes, crc);
+        }
+
+        // Compare the payload of every block with its checksum, without
+        // decoding. Returns the number of damaged blocks.
+        size_t CheckPayload(const string& fname, const bit_ifstream& is, std::ostream& log)
+        {
+            const BlockIndex& index = is.index();
+            ifstream in{fname, ios::binary | ios::in};
+            size_t bad = 0;
+            uint64_t offset = 1;
+            for (size_t i=0; i<index.size(); i++) {
+                const BlockEntry& b = index[i];
+                uint64_t got = 0;
+                in.seekg(b.offset, ios::beg);
+                uint32_t crc = RangeChecksum(in, b.bytes, got);
+                if (b.offset != offset || got != b.bytes || crc != b.crc) {
+                    log << "block " << i << ": bad checksum" << endl;
+                    in.clear();
+                    bad++;
+                }
+                offset = b.offset + b.bytes;
+            }
+            // the seek table and the index follow the last block
+            if (static_cast<uint64_t>(is.payload_size()) != offset) {
+                log << "bad archive size" << endl;
+                bad++;
+            }
+            return bad;
+        }
+
+        // Compare the decoded text of every block with its checksum.
+        // Returns the number of damaged blocks.
+        size_t CheckText(const string& fname, const BlockIndex& index, std::ostream& log)
+        {
+            ifstream in{fname, ios::binary | ios::in};
+            size_t bad = 0;
+            for (size_t i=0; i<index.size(); i++) {
+                uint64_t got = 0;
+                uint32_t crc = RangeChecksum(in, index[i].text_bytes, got);
+                if (got != index[i].text_bytes || crc != index[i].text_crc) {
+                    log << "block " << i << ": decoded text does not match" << endl;
+                    bad++;
+                }
+            }
+            if (in.peek() != EOF) {
+                log << "decoded text is too long" << endl;
+                bad++;
+            }
+            return bad;
+        }
+
+    protected:
+        static const size_t chunk_size = 1 << 16;
+
+        // Checksum of the next qty bytes, got is the number actually read.
+        // Counts the UTF-8 symbols too, all bytes but the continuations.
+        static uint32_t RangeChecksum(ifstream& in, uint64_t qty, uint64_t& got, uint64_t* symbols = nullptr)
+        {
+            vector<char> buf(chunk_size);
+            uint32_t crc = 0;
+            got = 0;
+            while (got < qty && in.good()) {
+                in.read(buf.data(), std::min<uint64_t>(qty - got, buf.size()));
+                crc = Crc32c::Update(crc, buf.data(), in.gcount());
+                got += in.gcount();
+                if (symbols != nullptr) {
+                    for (std::streamsize i=0; i<in.gcount(); i++) {
+                        *symbols += (static_cast<uint8_t>(buf[i]) & 0xc0) != 0x80;
+                    }
+                }
+            }
+            return crc;
+        }
+};
+const size_t ArchiveChecker::chunk_size;
+
+
+/** @} */ // end doxygroup
+
+
+/* -----------------------------------------------------------------------------*/
+/**
+ *  @defgroup jobs Encoding, decoding or testing of whole files, one
+ *  at a time or by a pool of worker threads.
+ *  @{
+ */
+
+//=============================================================================
+// What to do with a file, as given on the command line
+struct JobOptions
+{
+    // set by -a, files without it are decoded
+    bool has_algo = false;
+    ALGORITHM algo = ALGORITHM::huffman;
+    int order = 0;
+    TRANSFORM transform = TRANSFORM::none;
+    uint64_t seek_interval = 0;
+    // --test, check the checksums only
+    bool test = false;
+    // --range, decode only part of the text
+    bool whole = true;
+    uint64_t range_start = 0;
+    uint64_t range_len = UINT64_MAX;
+    // --max-memory, bytes of working memory of the job, 0 - no limit
+    uint64_t max_memory = 0;
+    // --sample, bytes of the text the tree is made of, 0 - all of it
+    uint64_t sample_bytes = 0;
+};
+
+//=============================================================================
+class FileJob
+{
+    public:
+        // name of the file written by the last Run, and its operations
+        string output;
+        uint64_t operations = 0;
+
+        // the file Run writes for infile, none for a test
+        static string OutputName(const string& infile, const JobOptions& opt)
+        {
+            if (opt.test) {
+                return "";
+            }
+            return (infile.find(".txt") != string::npos) ? EncodedName(infile, opt.algo) : DecodedName(infile);
+        }
+
+        // Encode a .txt file given an algorithm, test or decode anything
+        // else. Problems are reported to log, returns false on failure.
+        bool Run(const string& infile, const JobOptions& opt, std::ostream& log)
+        {
+            output.clear();
+            operations = 0;
+            if (opt.test) {
+                return Test(infile, log);
+            }
+            uint64_t before = ops.thread_total();
+            AllocCounter::Usage allocated = allocs.thread_usage();
+            allocs.reset_peak();
+            bool ok = (infile.find(".txt") != string::npos)
+                ? Encode(infile, opt, log)
+                : Decode(infile, opt, log);
+            if (ok) {
+                operations = ops.thread_total() - before;
+                // write operations, and allocations with --alloc
+                ops.write(output, operations);
+                allocs.write(output, allocated, MemoryBudget::PeakBytes());
+            }
+            return ok;
+        }
+
+    protected:
+        // kept from file to file, cleared before each
+        EncodeHuffman huffman{};
+        EncodeShannon shannon{};
+        Decoder decoder{};
+
+        bool Encode(const string& infile, const JobOptions& opt, std::ostream& log)
+        {
+            if (! opt.has_algo) {
+                log << infile << ": no algorithm to encode with" << endl;
+                return false;
+            }
+            output = EncodedName(infile, opt.algo);
+            // encode, write name.haff, name.shan or name.auto
+            ops.add(2);
+            if (opt.algo == ALGORITHM::automatic) {
+                EncodeSmallest(infile, opt, log);
             } else {
-                // if single byte
-                ops.add(1);
-                utf8.push_back(firstbyte);
+                try {
+                    EncodeTo(output, infile, opt, AutoSelector::Choice{opt.algo, opt.order, opt.transform, false}, log);
+                } catch(const std::runtime_error&) {
+                    // no archive rather than one cut short
+                    std::remove(output.c_str());
+                    throw;
+                }
             }
-            return *this;
+            return true;
         }
 
-        bit_ifstream& getarray(char* pbuf, int qty_bits) {
+        // Every candidate writes a trial archive next to the output, a
+        // smaller one than the output so far takes its place. A coder
+        // that fails is passed over, unless they all do.
+        void EncodeSmallest(const string& infile, const JobOptions& opt, std::ostream& log)
+        {
             ops.add(3);
-            char* cur = pbuf;
-            int i=0;
-            while (i<qty_bits) {
+            string trial = output + ".try";
+            uint64_t best = UINT64_MAX;
+            string failure;
+            for (const auto& choice : AutoSelector::Candidates()) {
                 ops.add(4);
-                bool bit;
-                getbit(bit);
-                if (bit) {
-                    ops.add(4);
-                    *cur |= (1 << (7 - i%8));
+                try {
+                    EncodeTo(trial, infile, opt, choice, log);
+                } catch(const std::runtime_error& e) {
+                    failure = e.what();
+                    continue;
                 }
-                i++;
-                if (i % 8 == 0) {
-                    ops.add(1);
-                    cur++;
+                struct stat st;
+                if (stat(trial.c_str(), &st) == 0 && static_cast<uint64_t>(st.st_size) < best
+                        && std::rename(trial.c_str(), output.c_str()) == 0) {
+                    best = st.st_size;
+                }
+            }
+            std::remove(trial.c_str());
+            if (best == UINT64_MAX) {
+                throw std::runtime_error(failure.empty() ? "Could not encode" : failure);
+            }
+        }
+
+        // the whole archive of infile with one coder
+        void EncodeTo(const string& archive, const string& infile, const JobOptions& opt,
+                const AutoSelector::Choice& choice, std::ostream& log)
+        {
+            ops.add(4);
+            ucs4_ifstream rawtext{infile};
+            bit_ofstream outs{archive};
+            if (choice.stored) {
+                EncodeStored enc{opt.seek_interval};
+                enc.Encode(rawtext, outs);
+            }
+            else {
+                IEncoder& enc = (choice.algo == ALGORITHM::huffman)
+                    ? static_cast<IEncoder&>(huffman) : static_cast<IEncoder&>(shannon);
+                Configure(enc, infile, opt, choice);
+                enc.Encode(rawtext, outs);
+                ReportSample(enc, log);
+            }
+            rawtext.close();
+            // a sampled encoder has taken the checksum on its one pass
+            if (! outs.has_totals()) {
+                ArchiveChecker::SetWholeText(infile, outs);
+            }
+            outs.stop_writing();
+            outs.close();
+        }
+
+        static void Configure(IEncoder& enc, const string& infile, const JobOptions& opt,
+                const AutoSelector::Choice& choice)
+        {
+            ops.add(4);
+            enc.Clear();
+            enc.SetOrder(choice.order);
+            enc.SetTransform(choice.transform);
+            enc.SetSeekInterval(opt.seek_interval);
+            enc.SetSample(infile, opt.sample_bytes);
+            if (opt.max_memory > 0) {
+                enc.SetBlockSize(MemoryBudget::BlockSize(opt.max_memory, choice.transform, enc.BlockSize()));
+                enc.SetTableLimit(MemoryBudget::TableBytes(opt.max_memory));
+            }
+        }
+
+        // the ratio a sampled tree lost against the tree of the whole text
+        void ReportSample(const IEncoder& enc, std::ostream& log)
+        {
+            if (! enc.Sampled()) {
+                return;
+            }
+            uint64_t sampled = (enc.SampledBits() + 7) / 8;
+            uint64_t exact = (enc.ExactBits() + 7) / 8;
+            log << output << ": sampled tree " << sampled << " bytes, exact tree "
+                << exact << " bytes, " << std::fixed << std::setprecision(2)
+                << 100.0 * (double(sampled) - exact) / std::max<uint64_t>(1, exact) << "% larger" << endl;
+        }
+
+        bool Decode(const string& infile, const JobOptions& opt, std::ostream& log)
+        {
+            output = DecodedName(infile);
+            // decode, write name-unz-*.txt
+            ops.add(3);
+            bit_ifstream enc_stream{infile};
+            if (enc_stream.method() == METHOD::pack) {
+                log << infile << ": multi-file archive, use unpack" << endl;
+                return false;
+            }
+            ArchiveChecker checker{};
+            // a range is checked by neither, both read the whole file
+            if (opt.whole && checker.CheckPayload(infile, enc_stream, log) > 0) {
+                log << infile << ": damaged" << endl;
+                return false;
+            }
+            ucs4_ofstream dec_stream{output};
+            if (opt.whole && enc_stream.has_totals()) {
+                Preallocate(output, enc_stream.totals().text_bytes);
+            }
+            decoder.Clear();
+            decoder.SetMemoryLimit(opt.max_memory);
+            // a refused or broken archive leaves no partial text
+            try {
+                if (opt.whole) {
+                    decoder.Decode(enc_stream, dec_stream);
+                } else {
+                    decoder.DecodeRange(enc_stream, dec_stream, opt.range_start, opt.range_len);
                 }
+                enc_stream.close();
+                dec_stream.close();
+            } catch(const std::runtime_error&) {
+                std::remove(output.c_str());
+                throw;
+            }
+            if (opt.whole && checker.CheckText(output, enc_stream.index(), log) > 0) {
+                log << output << ": damaged" << endl;
+                return false;
+            }
+            return true;
+        }
+
+        bool Test(const string& infile, std::ostream& log)
+        {
+            size_t bad = 0;
+            try {
+                bit_ifstream enc_stream{infile};
+                ArchiveChecker checker{};
+                bad = checker.CheckPayload(infile, enc_stream, log);
+            } catch(const std::runtime_error& e) {
+                log << e.what() << endl;
+                bad = 1;
+            }
+            log << infile << (bad > 0 ? ": damaged" : ": OK") << endl;
+            return bad == 0;
+        }
+
+        // the size of the text is known, its disk space is taken at once
+        static void Preallocate(const string& fname, uint64_t bytes)
+        {
+#ifdef __linux__
+            if (bytes == 0) {
+                return;
+            }
+            int fd = open(fname.c_str(), O_WRONLY);
+            if (fd >= 0) {
+                // only a hint: the file keeps its size and grows as it is
+                // written, file systems without fallocate are fine too
+                fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, bytes);
+                close(fd);
+            }
+#else
+            (void)fname;
+            (void)bytes;
+#endif
+        }
+
+        static string EncodedName(const string& infile, ALGORITHM algo)
+        {
+            string name = infile;
+            name.erase(infile.find(".txt"), 4);
+            if (algo == ALGORITHM::huffman) {
+                return name + ".haff";
+            }
+            if (algo == ALGORITHM::shennon) {
+                return name + ".shan";
             }
-            return *this;
+            return name + ".auto";
         }
 
-
+        // the archive header names the method, so every archive
+        // is decoded the same way whatever its extension
+        static string DecodedName(const string& infile)
+        {
+            string name = infile;
+            string::size_type ext_haff = infile.find(".haff");
+            string::size_type ext_shan = infile.find(".shan");
+            string::size_type ext_auto = infile.find(".auto");
+            if (ext_haff != string::npos) {
+                name.erase(ext_haff, 5);
+                return name + "-unz-h.txt";
+            }
+            if (ext_shan != string::npos) {
+                name.erase(ext_shan, 5);
+                return name + "-unz-s.txt";
+            }
+            if (ext_auto != string::npos) {
+                name.erase(ext_auto, 5);
+                return name + "-unz-a.txt";
+            }
+            string::size_type dot = name.rfind('.');
+            string::size_type slash = name.rfind('/');
+            if (dot != string::npos && (slash == string::npos || dot > slash)) {
+                name.erase(dot);
+            }
+            return name + "-unz.txt";
+        }
 };
 
 //=============================================================================
-class bit_ofstream : public ofstream
+// Runs a FileJob for every file on a pool of worker threads. Every
+// worker keeps its job object and takes the next file when done.
+class BatchRunner
 {
-
     public:
+        // the workers share the working memory of opt
+        BatchRunner(const JobOptions& opt, size_t workers)
+            : opt(Share(opt, std::max<size_t>(1, workers))), workers(std::max<size_t>(1, workers)) {}
 
-        bit_ofstream(const string& fname) : ofstream(fname, ios::binary | ios::out) {
-            // plus initialisation
-            ops.add(3);
-            start_writing();
+        // one line per file as it is done, returns the number of failures
+        size_t Run(const vector<string>& files, std::ostream& out)
+        {
+            std::atomic<size_t> next{0};
+            std::atomic<size_t> failed{0};
+            std::mutex out_mutex;
+            auto work = [&]() {
+                FileJob job{};
+                for (size_t i = next++; i < files.size(); i = next++) {
+                    std::ostringstream log;
+                    auto start = std::chrono::steady_clock::now();
+                    bool ok = false;
+                    try {
+                        ok = job.Run(files[i], opt, log);
+                    } catch(const std::exception& e) {
+                        log << files[i] << ": " << e.what() << endl;
+                    }
+                    double ms = std::chrono::duration<double, std::milli>(
+                            std::chrono::steady_clock::now() - start).count();
+                    if (! ok) {
+                        failed++;
+                    }
+                    std::lock_guard<std::mutex> lock(out_mutex);
+                    out << log.str();
+                    out << (ok ? "ok " : "FAIL ") << files[i];
+                    if (ok && ! job.output.empty()) {
+                        out << " -> " << job.output << " " << FileSize(job.output) << " bytes "
+                            << job.operations << " ops";
+                    }
+                    out << " " << std::fixed << std::setprecision(2) << ms << " ms" << endl;
+                }
+            };
+            vector<std::thread> pool;
+            for (size_t w=1; w<std::min(workers, files.size()); w++) {
+                pool.emplace_back(work);
+            }
+            work();
+            for (auto& t : pool) {
+                t.join();
+            }
+            return failed;
         }
 
-        bit_ofstream& putchar32(const char32_t& ch) {
-            ops.add(1);
-            try {
-                ops.add(3);
-                basic_string<char> utf8 = ucs4conv.to_bytes(ch);
-                pututf8(utf8);
-            } catch(const std::range_error& e) {
-                ops.add(2);
-                cout << "Error occured\n" << endl;
-                this->setstate(ios::failbit);
-            }
-            return *this;
+    protected:
+        const JobOptions opt;
+        const size_t workers;
+
+        static JobOptions Share(JobOptions opt, size_t workers)
+        {
+            opt.max_memory /= workers;
+            return opt;
         }
 
-        bit_ofstream& putbit(const bool bit) {
-            ops.add(2);
-            nbit--;
-            if (bit) {
+        static uint64_t FileSize(const string& fname)
+        {
+            ifstream in{fname, ios::binary | ios::ate};
+            return in ? static_cast<uint64_t>(in.tellg()) : 0;
+        }
+};
+
+//=============================================================================
+// Multi-file archives: every file is a member coded in a block of its
+// own, the block index gives where each member starts and how long it
+// is, so one member is decoded without reading the others.
+class PackJob
+{
+    public:
+        // Code files into one archive, every member with its own tree
+        // or a tree of all of them. Returns false on failure.
+        bool Pack(const string& archive, const vector<string>& files,
+                const JobOptions& opt, std::ostream& log)
+        {
+            if (files.empty()) {
+                log << archive << ": no files to pack" << endl;
+                return false;
+            }
+            uint64_t before = ops.thread_total();
+            AllocCounter::Usage allocated = allocs.thread_usage();
+            allocs.reset_peak();
+            ops.add(4);
+            vector<string> names;
+            for (const auto& file : files) {
                 ops.add(2);
-                buffer |= (1 << nbit);
+                string::size_type slash = file.rfind('/');
+                names.push_back(slash == string::npos ? file : file.substr(slash + 1));
             }
-            if (nbit == 0) {
-                ops.add(3);
-                put(buffer);
-                nbit = 8;
-                buffer = '\0';
+            try {
+                bit_ofstream outs{archive};
+                if (opt.algo == ALGORITHM::huffman) {
+                    EncodeHuffman enc{};
+                    PackFiles(enc, files, names, outs);
+                } else {
+                    EncodeShannon enc{};
+                    PackFiles(enc, files, names, outs);
+                }
+                outs.stop_writing();
+                outs.close();
+            } catch(const std::runtime_error&) {
+                // no archive rather than one cut short
+                std::remove(archive.c_str());
+                throw;
             }
-            return *this;
+            // write operations, and allocations with --alloc
+            ops.write(archive, ops.thread_total() - before);
+            allocs.write(archive, allocated, MemoryBudget::PeakBytes());
+            return true;
         }
 
-        void stop_writing() {
-            // remember the trash size
+        // Decode the member of the given number, or all of them if
+        // member is SIZE_MAX, next to the archive.
+        bool Unpack(const string& archive, size_t member, std::ostream& log)
+        {
             ops.add(4);
-            // write the buffer byte to be filled with data and trash
-            char trash_size = nbit % 8;
-            // write trash
-            while (nbit != 8) {
-                ops.add(1);
-                putbit(false);
+            bit_ifstream enc_stream{archive};
+            Decoder dec{};
+            vector<string> names = dec.ReadPackHeader(enc_stream);
+            if (enc_stream.index().size() != names.size() + 1) {
+                log << archive << ": bad block index" << endl;
+                return false;
             }
-            // rewind
-            seekp(0, ios::beg);
-            // write the trash size
-            putarray(&trash_size, 8);
-        }
-
-    protected:
-        int nbit = 8;
-        char buffer = '\0';
-        wstring_convert<std::codecvt_utf8<char32_t>, char32_t> ucs4conv;
-
-        bit_ofstream& putarray(const char* data, int qty_bits) {
-            ops.add(3);
-            const char* cur = data;
-            int i=0;
-            while (i<qty_bits) {
-                ops.add(7);
-                putbit( *cur & (1 << (7-(i%8))) );
-                i++;
-                if (i % 8 == 0) {
-                    ops.add(1);
-                    cur++;
+            if (member != SIZE_MAX && member >= names.size()) {
+                log << archive << ": no member " << member << endl;
+                return false;
+            }
+            string::size_type slash = archive.rfind('/');
+            string dir = (slash == string::npos) ? "" : archive.substr(0, slash + 1);
+            bool ok = true;
+            for (size_t i=0; i<names.size(); i++) {
+                if (member != SIZE_MAX && i != member) {
+                    continue;
+                }
+                uint64_t before = ops.thread_total();
+                AllocCounter::Usage allocated = allocs.thread_usage();
+                allocs.reset_peak();
+                ops.add(3);
+                const BlockEntry& block = enc_stream.index()[i + 1];
+                string output = dir + DecodedName(names[i]);
+                ucs4_ofstream dec_stream{output};
+                try {
+                    dec.DecodeMember(enc_stream, block, dec_stream);
+                    dec_stream.close();
+                } catch(const std::runtime_error&) {
+                    std::remove(output.c_str());
+                    throw;
+                }
+                // the member is the only block of its own text
+                ArchiveChecker checker{};
+                BlockIndex text{block};
+                if (checker.CheckText(output, text, log) > 0) {
+                    log << output << ": damaged" << endl;
+                    ok = false;
                 }
+                ops.write(output, ops.thread_total() - before);
+                allocs.write(output, allocated, MemoryBudget::PeakBytes());
+                log << names[i] << " -> " << output << endl;
             }
-            return *this;
+            return ok;
         }
 
-        bit_ofstream& pututf8(const string& utf8) {
-            ops.add(4);
-            putarray(utf8.c_str(), utf8.size() * 8);
-            return *this;
+        // one line per member: number, name, text and coded bytes
+        bool List(const string& archive, std::ostream& out)
+        {
+            bit_ifstream enc_stream{archive};
+            Decoder dec{};
+            vector<string> names = dec.ReadPackHeader(enc_stream);
+            const BlockIndex& index = enc_stream.index();
+            if (index.size() != names.size() + 1) {
+                out << archive << ": bad block index" << endl;
+                return false;
+            }
+            for (size_t i=0; i<names.size(); i++) {
+                out << i << " " << names[i] << " " << index[i + 1].text_bytes
+                    << " bytes, coded " << index[i + 1].bytes << " bytes" << endl;
+            }
+            return true;
         }
 
-        void start_writing() {
-            // write an empty byte, which will get overriden in stop_writing()
-            ops.add(1);
-            put('\0');
+    protected:
+        // the header is block 0, member i is block i+1
+        static void PackFiles(IEncoder& enc, const vector<string>& files,
+                const vector<string>& names, bit_ofstream& outs)
+        {
+            ops.add(2);
+            enc.WritePackHeader(files, names, outs);
+            for (const auto& file : files) {
+                ops.add(4);
+                outs.begin_block();
+                ucs4_ifstream rawtext{file};
+                enc.EncodeMember(rawtext, outs);
+                rawtext.close();
+                ArchiveChecker::SetFileText(file, outs);
+            }
         }
 
+        // name.txt becomes name-unz.txt, as for other archives
+        static string DecodedName(const string& name)
+        {
+            string base = name;
+            string::size_type dot = base.rfind('.');
+            if (dot != string::npos && dot > 0) {
+                base.erase(dot);
+            }
+            return base + "-unz.txt";
+        }
 };
 
-
 /** @} */ // end doxygroup
 
-/* -----------------------------------------------------------------------------*/
-/**
- *  @defgroup encoders Classes to facitilate encoding.
- *  @{
- */
 
+// bench.cpp and gen_corpus.cpp include this file and bring their own main()
 //=============================================================================
-class IEncoder
+// The messages between "serve" and its clients. A frame is the length
+// of its body in 8 bytes, then the body. A frame longer than the reader
+// takes (--max-frame) is refused on its head, before any of its body is
+// kept. A request holds the options of
+// the job and either the path of a file on the server or the file
+// itself inline. The reply holds the log of the job, the name of its
+// output and, for inline jobs, the output itself.
+class ServeProtocol
 {
     public:
+        struct Request
+        {
+            JobOptions opt;
+            // a file of the server, or the name of the inline one
+            string path;
+            bool inline_data = false;
+            string payload;
+        };
 
-        void Encode(ucs4_ifstream& in, bit_ofstream& out)
+        struct Reply
         {
-            ops.add(5);
-            FillFrequencyTable(in);
-            BuildTree();
-            GenerateCodes();
-            WriteTree(out);
-            TransformTextEncode(in, out);
+            bool ok = false;
+            string log;
+            // the output file, or for inline jobs the suffix that
+            // makes its name out of the name of the input
+            string output;
+            string payload;
+        };
+
+        // the longest frame read without --max-frame
+        static const uint64_t default_max_frame = uint64_t{1} << 28;
+        // the longest a reply waits for the peer to make room for it
+        static const int write_timeout_ms = 10000;
+
+        static string Pack(const Request& req)
+        {
+            string body;
+            PutByte(body, req.opt.has_algo);
+            PutByte(body, static_cast<uint8_t>(req.opt.algo));
+            PutByte(body, req.opt.order);
+            PutByte(body, static_cast<uint8_t>(req.opt.transform));
+            PutByte(body, req.opt.test);
+            PutByte(body, req.opt.whole);
+            PutNumber(body, req.opt.seek_interval);
+            PutNumber(body, req.opt.range_start);
+            PutNumber(body, req.opt.range_len);
+            PutNumber(body, req.opt.sample_bytes);
+            PutByte(body, req.inline_data);
+            PutString(body, req.path);
+            PutString(body, req.payload);
+            return body;
         }
 
-    protected:
-        IEncoder() { }
+        static Request UnpackRequest(const string& body)
+        {
+            Request req{};
+            size_t at = 0;
+            req.opt.has_algo = GetByte(body, at) != 0;
+            uint8_t algo = GetByte(body, at);
+            req.opt.order = GetByte(body, at);
+            uint8_t transform = GetByte(body, at);
+            req.opt.test = GetByte(body, at) != 0;
+            req.opt.whole = GetByte(body, at) != 0;
+            if (algo > static_cast<uint8_t>(ALGORITHM::automatic) || req.opt.order > 1
+                    || transform > static_cast<uint8_t>(TRANSFORM::words)) {
+                throw runtime_error("Bad request.");
+            }
+            req.opt.algo = static_cast<ALGORITHM>(algo);
+            req.opt.transform = static_cast<TRANSFORM>(transform);
+            req.opt.seek_interval = GetNumber(body, at);
+            req.opt.range_start = GetNumber(body, at);
+            req.opt.range_len = GetNumber(body, at);
+            req.opt.sample_bytes = GetNumber(body, at);
+            req.inline_data = GetByte(body, at) != 0;
+            req.path = GetString(body, at);
+            req.payload = GetString(body, at);
+            return req;
+        }
 
-        shared_ptr<INode> root;
-        FrequencyTable table;
+        static string Pack(const Reply& rep)
+        {
+            string body;
+            PutByte(body, rep.ok);
+            PutString(body, rep.log);
+            PutString(body, rep.output);
+            PutString(body, rep.payload);
+            return body;
+        }
 
-        // mark the class as polymorphic
-        virtual void BuildTree() = 0;
+        static Reply UnpackReply(const string& body)
+        {
+            Reply rep{};
+            size_t at = 0;
+            rep.ok = GetByte(body, at) != 0;
+            rep.log = GetString(body, at);
+            rep.output = GetString(body, at);
+            rep.payload = GetString(body, at);
+            return rep;
+        }
 
-        void FillFrequencyTable(ucs4_ifstream& is) {
-            ops.add(1);
-            // write the trash size
-            if (is.good()) {
-                // we can continue
-                char32_t ch;
-                ops.add(2);
-                while (is.get(ch).good()) {
-                    ops.add(2);
-                    ++(this->table)[ch];
+        // the length of the first frame of the bytes a connection has sent
+        // so far, false while its head is not all there
+        static bool FrameLength(const string& bytes, uint64_t max_frame, uint64_t& len)
+        {
+            if (bytes.size() < 8) {
+                return false;
+            }
+            len = Length(bytes.data(), max_frame);
+            return true;
+        }
+
+        // the first frame of the bytes a connection has sent so far, false
+        // while it is not all there
+        static bool TakeFrame(string& bytes, string& body, uint64_t max_frame)
+        {
+            uint64_t len = 0;
+            if (! FrameLength(bytes, max_frame, len) || bytes.size() - 8 < len) {
+                return false;
+            }
+            body.assign(bytes, 8, len);
+            bytes.erase(0, 8 + len);
+            return true;
+        }
+
+        // the next frame of fd, false if the peer closed the connection
+        // before one
+        static bool ReadFrame(int fd, string& body, uint64_t max_frame)
+        {
+            char head[8];
+            if (! ReadAll(fd, head, sizeof(head), true)) {
+                return false;
+            }
+            uint64_t len = Length(head, max_frame);
+            body.resize(len);
+            ReadAll(fd, &body[0], len, false);
+            return true;
+        }
+
+        static void WriteFrame(int fd, const string& body)
+        {
+            char head[8];
+            uint64_t len = body.size();
+            for (int i=0; i<8; i++) {
+                head[i] = static_cast<char>(len >> (8 * i));
+            }
+            // the head and the body in one call, a peer that went away
+            // gives an error rather than SIGPIPE
+            struct iovec parts[2] = {{head, sizeof(head)}, {const_cast<char*>(body.data()), body.size()}};
+            struct msghdr msg{};
+            msg.msg_iov = parts;
+            msg.msg_iovlen = 2;
+            while (msg.msg_iovlen > 0) {
+                ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+                if (sent < 0 && errno == EINTR) {
+                    continue;
                 }
-                ops.add(1);
-                if (is.eof()) {
-                    // clear eof and rewind input stream
-                    ops.add(2);
-                    is.clear();
-                    is.seekg(0, std::ios::beg);
-                } else {
-                    // we stopped reading the file, but it is not EOF yet.
-                    ops.add(1);
-                    throw std::runtime_error("Could not read file");
+                // a non-blocking socket that is full, a peer that reads
+                // nothing for a while is given up
+                if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    struct pollfd room{fd, POLLOUT, 0};
+                    if (poll(&room, 1, write_timeout_ms) <= 0) {
+                        throw runtime_error("Could not write to the socket");
+                    }
+                    continue;
+                }
+                if (sent < 0) {
+                    throw runtime_error("Could not write to the socket");
+                }
+                while (msg.msg_iovlen > 0 && static_cast<size_t>(sent) >= msg.msg_iov->iov_len) {
+                    sent -= msg.msg_iov->iov_len;
+                    msg.msg_iov++;
+                    msg.msg_iovlen--;
+                }
+                if (msg.msg_iovlen > 0) {
+                    msg.msg_iov->iov_base = static_cast<char*>(msg.msg_iov->iov_base) + sent;
+                    msg.msg_iov->iov_len -= sent;
                 }
-                // we reached eof. all ok
             }
         }
 
-        void GenerateCodes()
+        static struct sockaddr_un Address(const string& path)
         {
-            ops.add(1);
-            InnerGenerateCodes(root, VariableCode{});
+            struct sockaddr_un addr{};
+            addr.sun_family = AF_UNIX;
+            if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+                throw runtime_error("Bad socket path " + path);
+            }
+            std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+            return addr;
         }
 
-        void InnerGenerateCodes(const NodePtr node, const VariableCode& prefix)
+    protected:
+        // the length in a frame head
+        static uint64_t Length(const char* head, uint64_t max_frame)
         {
-            if (const shared_ptr<const LeafNode> lf = dynamic_pointer_cast<const LeafNode>(node))
-            {
-                ops.add(2);
-                this->ch2code[lf->c] = prefix;
+            uint64_t len = 0;
+            for (int i=7; i>=0; i--) {
+                len = (len << 8) | static_cast<unsigned char>(head[i]);
             }
-            else if (const shared_ptr<const InternalNode> in = dynamic_pointer_cast<const InternalNode>(node))
-            {
-                ops.add(6);
-                VariableCode leftPrefix = prefix;
-                leftPrefix.push_back(false);
-                InnerGenerateCodes(in->left, leftPrefix);
-                VariableCode rightPrefix = prefix;
-                rightPrefix.push_back(true);
-                InnerGenerateCodes(in->right, rightPrefix);
+            if (len > max_frame) {
+                throw runtime_error("Frame longer than --max-frame.");
             }
+            return len;
         }
 
-        void WriteTree(bit_ofstream& os)
+        static void PutByte(string& body, uint8_t value)
         {
-            ops.add(1);
-            InnerWriteTree(root, os);
+            body.push_back(static_cast<char>(value));
         }
 
-        void InnerWriteTree(const NodePtr node, bit_ofstream& os)
+        static void PutNumber(string& body, uint64_t value)
         {
-            if (const shared_ptr<const LeafNode> lf = dynamic_pointer_cast<const LeafNode>(node))
-            {
-                ops.add(2);
-                os.putbit(true);
-                os.putchar32(lf->c);
+            for (int i=0; i<8; i++) {
+                body.push_back(static_cast<char>(value >> (8 * i)));
             }
-            else if (const shared_ptr<const InternalNode> in = dynamic_pointer_cast<const InternalNode>(node))
-            {
-                ops.add(3);
-                os.putbit(false);
-                InnerWriteTree(in->left, os);
-                InnerWriteTree(in->right, os);
+        }
+
+        static void PutString(string& body, const string& value)
+        {
+            PutNumber(body, value.size());
+            body.append(value);
+        }
+
+        static uint8_t GetByte(const string& body, size_t& at)
+        {
+            if (at >= body.size()) {
+                throw runtime_error("Bad request.");
             }
+            return static_cast<unsigned char>(body[at++]);
         }
 
-        void TransformTextEncode(ucs4_ifstream& is, bit_ofstream& os)
+        static uint64_t GetNumber(const string& body, size_t& at)
         {
-            ops.add(2);
-            if (is.good() && os.good()) {
-                // we can continue
-                char32_t in_ch;
-                ops.add(2);
-                while (is.get(in_ch).good())
-                {
-                    for (const auto& bit : this->ch2code[in_ch]) {
-                        ops.add(2);
-                        os.putbit(bit);
-                    }
+            if (at > body.size() || body.size() - at < 8) {
+                throw runtime_error("Bad request.");
+            }
+            uint64_t value = 0;
+            for (int i=7; i>=0; i--) {
+                value = (value << 8) | static_cast<unsigned char>(body[at + i]);
+            }
+            at += 8;
+            return value;
+        }
+
+        static string GetString(const string& body, size_t& at)
+        {
+            uint64_t len = GetNumber(body, at);
+            if (len > body.size() - at) {
+                throw runtime_error("Bad request.");
+            }
+            at += len;
+            return body.substr(at - len, len);
+        }
+
+        // false if the connection ended before the first byte and
+        // may_end, an error if it ended anywhere else
+        static bool ReadAll(int fd, char* data, size_t qty, bool may_end)
+        {
+            size_t done = 0;
+            while (done < qty) {
+                ssize_t got = read(fd, data + done, qty - done);
+                if (got < 0 && errno == EINTR) {
+                    continue;
                 }
-                ops.add(1);
-                if (is.eof()) {
-                    // clear eof and rewind input stream
-                    ops.add(2);
-                    is.clear();
-                    is.seekg(0, std::ios::beg);
-                } else {
-                    // we stopped reading the file, but it is not EOF yet.
-                    ops.add(1);
-                    throw std::runtime_error("Could not encode");
+                if (got == 0 && done == 0 && may_end) {
+                    return false;
                 }
-                // we reached eof. all ok
+                if (got <= 0) {
+                    throw runtime_error("Could not read from the socket");
+                }
+                done += got;
             }
+            return true;
         }
-
-    private:
-        EncodeHuffmanMap ch2code;
 };
+const uint64_t ServeProtocol::default_max_frame;
+const int ServeProtocol::write_timeout_ms;
 
 //=============================================================================
-class EncodeHuffman : public IEncoder
+// One connection to a server, requests are sent one at a time
+class ServeClient
 {
     public:
-        void BuildTree() override
-        {
-            std::priority_queue<NodePtr, std::vector<NodePtr>, NodeCmp> trees;
-            for (const auto& stats : table)
-            {
-                ops.add(2);
-                NodePtr np{new LeafNode{stats.second, stats.first}};
-                trees.push(np);
-            }
-            while (trees.size() > 1)
-            {
-                ops.add(7);
-                NodePtr childR = trees.top();
-                trees.pop();
-                NodePtr childL = trees.top();
-                trees.pop();
-                // Internal node constructor also requiers +1 ops
-                NodePtr parent{new InternalNode{childR, childL}};
-                trees.push(parent);
+        explicit ServeClient(const string& path, uint64_t max_frame = ServeProtocol::default_max_frame)
+            : max_frame(max_frame)
+        {
+            struct sockaddr_un addr = ServeProtocol::Address(path);
+            fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (fd < 0 || connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0) {
+                if (fd >= 0) {
+                    close(fd);
+                }
+                throw runtime_error("Could not connect to " + path);
             }
-            ops.add(2);
-            root = shared_ptr<INode>{trees.top()};
         }
+
+        ~ServeClient()
+        {
+            close(fd);
+        }
+
+        ServeClient(const ServeClient&) = delete;
+        ServeClient& operator=(const ServeClient&) = delete;
+
+        ServeProtocol::Reply Call(const ServeProtocol::Request& req)
+        {
+            ServeProtocol::WriteFrame(fd, ServeProtocol::Pack(req));
+            if (! ServeProtocol::ReadFrame(fd, body, max_frame)) {
+                throw runtime_error("The server closed the connection");
+            }
+            return ServeProtocol::UnpackReply(body);
+        }
+
+    protected:
+        int fd = -1;
+        const uint64_t max_frame;
+        // kept between calls, so a reply of the size of the last one
+        // is read without allocating
+        string body;
 };
 
 //=============================================================================
-class EncodeShannon : public IEncoder
+// Runs FileJobs for the clients of a Unix socket until SIGINT or
+// SIGTERM. The thread that accepts the connections also polls them and
+// reads what they send. A whole request goes to a queue that a pool of
+// workers takes jobs from, and its connection is not polled again until
+// the reply is written, so requests of one connection are answered in
+// order. No more than a whole request is read from a connection at a
+// time, and none longer than max_frame. An idle or slow client holds no
+// worker. Jobs on files of the server that share a file, as input or
+// output, run one after the other, so two of them never write one
+// archive at once. A client that keeps
+// its connection pays for neither a process nor a thread per job. The
+// workers keep their file buffers and the flat code table from one job
+// to the next; the code trees are those of every text and are built
+// for each job. Inline files are written to files of the worker in
+// /dev/shm (next to the socket where there is none), which are reused
+// by every job of that worker and removed when the server stops.
+class SocketServer
 {
-    typedef vector<NodePtr> LeafVec;
-    typedef LeafVec::const_iterator LeafIter;
-
     public:
-        void BuildTree() override
+        // the workers share the working memory of opt
+        SocketServer(const string& path, const JobOptions& opt, size_t workers,
+                uint64_t max_frame = ServeProtocol::default_max_frame)
+            : path(path), workers(std::max<size_t>(1, workers)), max_frame(max_frame)
         {
-            LeafVec leaves;
-            for (const auto& stats : table)
-            {
-                ops.add(2);
-                NodePtr np{new LeafNode{stats.second, stats.first}};
-                leaves.push_back(np);
+            max_memory = opt.max_memory / this->workers;
+            struct stat st;
+            if (stat("/dev/shm", &st) == 0 && S_ISDIR(st.st_mode)) {
+                string::size_type slash = path.rfind('/');
+                scratch_base = "/dev/shm/" + path.substr(slash == string::npos ? 0 : slash + 1)
+                    + "." + std::to_string(getpid());
+            } else {
+                scratch_base = path;
             }
-            ops.add(1);
-            sort(leaves.begin(), leaves.end(), NodeCmp{});
-            // start recursion
-            ops.add(2);
-            root = InnerBuildTree(leaves.begin(), leaves.end() - 1);
         }
 
-    protected:
-
-        NodePtr InnerBuildTree(LeafIter first, LeafIter last)
+        // false if the socket could not be made
+        bool Run(std::ostream& log)
         {
-            ops.add(1);
-            if (distance(first, last) == 0 )
-            {
-                ops.add(1);
-                return *first;
+            struct sockaddr_un addr = ServeProtocol::Address(path);
+            // a socket left by a server that did not stop is replaced
+            struct stat st;
+            if (lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+                unlink(path.c_str());
+            }
+            int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+            if (listen_fd < 0 || bind(listen_fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0
+                    || listen(listen_fd, SOMAXCONN) != 0 || pipe2(wake, O_CLOEXEC | O_NONBLOCK) != 0) {
+                log << path << ": " << std::strerror(errno) << endl;
+                if (listen_fd >= 0) {
+                    close(listen_fd);
+                }
+                return false;
+            }
+            stop = 0;
+            struct sigaction action{};
+            action.sa_handler = &SocketServer::Stop;
+            sigaction(SIGINT, &action, nullptr);
+            sigaction(SIGTERM, &action, nullptr);
+            log << "serving " << path << " with " << workers << " workers" << endl;
+
+            vector<std::thread> pool;
+            for (size_t w=0; w<workers; w++) {
+                pool.emplace_back([this, w]() { Work(w); });
             }
-            else
+            Poll(listen_fd);
+            close(listen_fd);
+            unlink(path.c_str());
             {
-                ops.add(8);
-                LeafIter split = FindBreakingIndex(first, last);
-                NodePtr childL = InnerBuildTree(first, split);
-                NodePtr childR = InnerBuildTree(split+1, last);
-                // Internal node constructor also requiers +1 ops
-                return shared_ptr<INode>{new InternalNode{childL, childR}};
+                // the workers answer the requests taken and leave
+                std::lock_guard<std::mutex> lock(mutex);
+                done = true;
+                ready.notify_all();
+            }
+            for (auto& t : pool) {
+                t.join();
             }
+            for (const auto& conn : connections) {
+                close(conn.first);
+            }
+            connections.clear();
+            close(wake[0]);
+            close(wake[1]);
+            log << "stopped" << endl;
+            return true;
         }
 
-        LeafIter FindBreakingIndex(LeafIter first, LeafIter last)
+    protected:
+        // what a connection has sent and not yet had answered
+        struct Connection
         {
-            ops.add(6);
-            LeafIter left_ptr = first;
-            LeafIter right_ptr = last;
-            uint64_t sumleft = (*left_ptr)->f;
-            uint64_t sumright = (*right_ptr)->f;
-            // func = right - left;
-            // we want abs(func) to be 0 (minimal possible)
-            while (left_ptr+1 < right_ptr) {
-                ops.add(10);
-                int64_t func = sumleft - sumright;
-                int64_t valueleft = (*(left_ptr+1))->f;
-                int64_t valueright = (*(right_ptr-1))->f;
-                if (abs(func + valueleft) < abs(func - valueright)) {
-                    ops.add(2);
-                    sumleft += valueleft;
-                    left_ptr++;
+            string bytes;
+            // a worker has its request, it is not polled
+            bool busy = false;
+        };
+
+        struct Task
+        {
+            int fd;
+            string body;
+        };
+
+        // a connection a worker is done with, broken if its reply failed
+        struct Returned
+        {
+            int fd;
+            bool broken;
+        };
+
+        static const size_t read_size = 1 << 16;
+
+        const string path;
+        const size_t workers;
+        const uint64_t max_frame;
+        uint64_t max_memory = 0;
+        // the inline files of worker w are named scratch_base.w
+        string scratch_base;
+        // the poller's own, by file descriptor
+        std::map<int, Connection> connections;
+        // a byte in wake brings the poller back to take the returned
+        int wake[2] = {-1, -1};
+        std::mutex mutex;
+        std::condition_variable ready;
+        std::deque<Task> tasks;
+        vector<Returned> returned;
+        // the files of the path jobs running, under mutex
+        std::set<string> held;
+        std::condition_variable freed;
+        bool done = false;
+        static volatile std::sig_atomic_t stop;
+
+        static void Stop(int)
+        {
+            stop = 1;
+        }
+
+        // accepts, reads and queues until stopped; poll wakes up now and
+        // then to see whether to stop
+        void Poll(int listen_fd)
+        {
+            vector<struct pollfd> fds;
+            vector<char> chunk(read_size);
+            while (! stop) {
+                fds.clear();
+                fds.push_back(pollfd{listen_fd, POLLIN, 0});
+                fds.push_back(pollfd{wake[0], POLLIN, 0});
+                for (const auto& conn : connections) {
+                    if (! conn.second.busy) {
+                        fds.push_back(pollfd{conn.first, POLLIN, 0});
+                    }
                 }
-                else {
-                    ops.add(2);
-                    sumright += valueright;
-                    right_ptr--;
+                if (poll(fds.data(), fds.size(), 200) <= 0) {
+                    continue;
+                }
+                if (fds[1].revents != 0) {
+                    TakeReturned();
+                }
+                for (size_t i=2; i<fds.size(); i++) {
+                    if (fds[i].revents != 0) {
+                        Receive(fds[i].fd, chunk);
+                    }
+                }
+                if (fds[0].revents != 0) {
+                    int fd = -1;
+                    while ((fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK)) >= 0) {
+                        connections[fd] = Connection{};
+                    }
                 }
             }
-            return left_ptr;
         }
 
-};
-
-/** @} */ // end doxygroup
+        // what fd has sent; a whole request goes to the workers, a closed
+        // or broken connection is dropped, and so is one whose request is
+        // longer than max_frame. What follows a whole request is left in
+        // the socket until it is answered.
+        void Receive(int fd, vector<char>& chunk)
+        {
+            Connection& conn = connections[fd];
+            while (true) {
+                uint64_t len = 0;
+                try {
+                    if (ServeProtocol::FrameLength(conn.bytes, max_frame, len) && conn.bytes.size() - 8 >= len) {
+                        break;
+                    }
+                } catch(const std::exception&) {
+                    Drop(fd);
+                    return;
+                }
+                ssize_t got = read(fd, chunk.data(), chunk.size());
+                if (got > 0) {
+                    conn.bytes.append(chunk.data(), got);
+                    continue;
+                }
+                if (got < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    break;
+                }
+                Drop(fd);
+                return;
+            }
+            Dispatch(fd);
+        }
 
-/* -----------------------------------------------------------------------------*/
-/**
- *  @defgroup decoders Class to facilitate decoding
- *  @{
- */
+        // the next request of an idle connection to the queue
+        void Dispatch(int fd)
+        {
+            Connection& conn = connections[fd];
+            Task task{fd, string{}};
+            try {
+                if (! ServeProtocol::TakeFrame(conn.bytes, task.body, max_frame)) {
+                    return;
+                }
+            } catch(const std::exception&) {
+                // garbage, the connection is dropped
+                Drop(fd);
+                return;
+            }
+            conn.busy = true;
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push_back(std::move(task));
+            ready.notify_one();
+        }
 
-//=============================================================================
-class Decoder
-{
-    public:
-        void Decode(bit_ifstream& is, ucs4_ofstream& os) {
-            ops.add(2);
-            ReadTree(is);
-            TransformDecode(is, os);
+        void TakeReturned()
+        {
+            char drain[64];
+            while (read(wake[0], drain, sizeof(drain)) > 0) {
+            }
+            vector<Returned> back;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                back.swap(returned);
+            }
+            for (const auto& item : back) {
+                if (item.broken) {
+                    Drop(item.fd);
+                    continue;
+                }
+                connections[item.fd].busy = false;
+                // a request sent behind the last one
+                Dispatch(item.fd);
+            }
         }
 
-    protected:
+        void Drop(int fd)
+        {
+            close(fd);
+            connections.erase(fd);
+        }
 
-        DecodeMap code2ch{};
+        void Work(size_t worker)
+        {
+            FileJob job{};
+            // the inline file of the worker, its name has no extension yet
+            const string scratch = scratch_base + "." + std::to_string(worker);
+            vector<string> made;
+            while (true) {
+                Task task{-1, string{}};
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    ready.wait(lock, [this]() { return done || ! tasks.empty(); });
+                    if (tasks.empty()) {
+                        break;
+                    }
+                    task = std::move(tasks.front());
+                    tasks.pop_front();
+                }
+                bool broken = ! Serve(task, job, scratch, made);
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    returned.push_back(Returned{task.fd, broken});
+                }
+                char byte = 0;
+                ssize_t sent = write(wake[1], &byte, 1);
+                (void) sent;
+            }
+            for (const auto& fname : made) {
+                unlink(fname.c_str());
+                unlink((fname + ".ops").c_str());
+                unlink((fname + ".mem").c_str());
+            }
+        }
 
-        void ReadTree(bit_ifstream& is)
+        // the reply to one request, false if it could not be written
+        bool Serve(const Task& task, FileJob& job, const string& scratch, vector<string>& made)
         {
-            ops.add(2);
-            VariableCode var{};
-            InnerReadTree(var, is);
+            ServeProtocol::Reply rep{};
+            try {
+                rep = Handle(ServeProtocol::UnpackRequest(task.body), job, scratch, made);
+            } catch(const std::exception& e) {
+                rep.ok = false;
+                rep.log += e.what();
+                rep.log += "\n";
+            }
+            try {
+                ServeProtocol::WriteFrame(task.fd, ServeProtocol::Pack(rep));
+            } catch(const std::exception&) {
+                // the client went away, its connection is dropped
+                return false;
+            }
+            return true;
         }
 
-        void InnerReadTree(const VariableCode& prefix, bit_ifstream& is)
+        ServeProtocol::Reply Handle(ServeProtocol::Request req, FileJob& job,
+                const string& scratch, vector<string>& made)
         {
-            ops.add(1);
-            if (! is.good()) {
-                throw runtime_error("Could not reconstruct tree.");
+            ServeProtocol::Reply rep{};
+            req.opt.max_memory = max_memory;
+            if (! req.inline_data) {
+                vector<string> files{Canonical(req.path)};
+                const string output = FileJob::OutputName(req.path, req.opt);
+                if (! output.empty()) {
+                    files.push_back(Canonical(output));
+                }
+                Hold(files);
+                rep.ok = RunJob(job, req.path, req.opt, rep.log);
+                Release(files);
+                rep.output = job.output;
+                return rep;
             }
-            bool bit;
-            ops.add(1);
-            is.getbit(bit);
-            if (bit)
+            // the extension of the client's file, which tells a text from
+            // an archive and names the output as it would be named there
+            const string ext = Extension(req.path);
+            const string input = scratch + ext;
             {
-                // read letter
-                ops.add(3);
-                char32_t ch;
-                is.getucs4(ch);
-                // add to map
-                code2ch[prefix] = ch;
+                ofstream out{input, ios::binary | ios::trunc};
+                out.write(req.payload.data(), req.payload.size());
+                if (! out) {
+                    throw runtime_error("Could not write " + input);
+                }
             }
-            else
-            {
-                ops.add(6);
-                VariableCode leftPrefix = prefix;
-                leftPrefix.push_back(false);
-                InnerReadTree(leftPrefix, is);
-                VariableCode rightPrefix = prefix;
-                rightPrefix.push_back(true);
-                InnerReadTree(rightPrefix, is);
+            Remember(made, input);
+            rep.ok = RunJob(job, input, req.opt, rep.log);
+            // the log names the client's file
+            const string stem = req.path.substr(0, req.path.size() - ext.size());
+            for (size_t at = rep.log.find(scratch); at != string::npos; at = rep.log.find(scratch, at + stem.size())) {
+                rep.log.replace(at, scratch.size(), stem);
+            }
+            if (job.output.empty()) {
+                return rep;
             }
+            // a job that failed may have begun its output
+            Remember(made, job.output);
+            if (! rep.ok) {
+                return rep;
+            }
+            rep.output = job.output.substr(scratch.size());
+            ifstream in{job.output, ios::binary | ios::ate};
+            rep.payload.resize(in ? static_cast<uint64_t>(in.tellg()) : 0);
+            in.seekg(0, ios::beg);
+            in.read(&rep.payload[0], rep.payload.size());
+            return rep;
         }
 
-        void TransformDecode(bit_ifstream& is, ucs4_ofstream& os)
+        // waits until no other job holds any of files, then holds them
+        void Hold(const vector<string>& files)
         {
-            ops.add(2);
-            if (is.good() && os.good()) {
-                // we can continue
-                bool bit;
-                VariableCode code{};
-                ops.add(2);
-                while (is.getbit(bit).good())
-                {
-                    ops.add(2);
-                    code.push_back(bit);
-                    if (code2ch.find(code) != code2ch.end()) {
-                        ops.add(3);
-                        os << code2ch[code];
-                        code.clear();
+            std::unique_lock<std::mutex> lock(mutex);
+            freed.wait(lock, [&]() {
+                for (const auto& fname : files) {
+                    if (held.count(fname) > 0) {
+                        return false;
                     }
                 }
-                ops.add(1);
-                if (! is.eof()) {
-                    // we stopped reading the file, but it is not EOF yet.
-                    ops.add(1);
-                    throw std::runtime_error("Could not encode");
-                }
-                // we reached eof. all ok
+                return true;
+            });
+            held.insert(files.begin(), files.end());
+        }
+
+        void Release(const vector<string>& files)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (const auto& fname : files) {
+                held.erase(fname);
             }
+            freed.notify_all();
         }
 
-};
+        // one name however the path names the file: the real path of
+        // its directory, which may not have the file yet, and its name
+        static string Canonical(const string& fname)
+        {
+            string::size_type slash = fname.rfind('/');
+            const string dir = (slash == string::npos) ? "." : (slash == 0) ? "/" : fname.substr(0, slash);
+            std::unique_ptr<char, decltype(&free)> full{realpath(dir.c_str(), nullptr), &free};
+            if (! full) {
+                return fname;
+            }
+            return string(full.get()) + "/" + fname.substr(slash == string::npos ? 0 : slash + 1);
+        }
 
+        // the errors of the job go to its log, as in a batch
+        static bool RunJob(FileJob& job, const string& infile, const JobOptions& opt, string& log)
+        {
+            std::ostringstream out;
+            bool ok = false;
+            try {
+                ok = job.Run(infile, opt, out);
+            } catch(const std::exception& e) {
+                out << infile << ": " << e.what() << endl;
+            }
+            log = out.str();
+            return ok;
+        }
 
-/** @} */ // end doxygroup
+        static string Extension(const string& fname)
+        {
+            string::size_type slash = fname.rfind('/');
+            string name = fname.substr(slash == string::npos ? 0 : slash + 1);
+            string::size_type dot = name.rfind('.');
+            return (dot == string::npos) ? "" : name.substr(dot);
+        }
 
+        static void Remember(vector<string>& made, const string& fname)
+        {
+            if (std::find(made.begin(), made.end(), fname) == made.end()) {
+                made.push_back(fname);
+            }
+        }
+};
+volatile std::sig_atomic_t SocketServer::stop = 0;
+const size_t SocketServer::read_size;
+
+#ifndef MYPROG_NO_MAIN
+//=============================================================================
+// peak resident size of the run against --max-memory
+static void ReportPeakMemory(uint64_t max_memory, std::ostream& out)
+{
+    uint64_t peak = MemoryBudget::PeakBytes();
+    out << "peak memory " << peak / 1024 << " KiB of " << max_memory / 1024 << " KiB"
+        << (peak > max_memory ? ", over the limit" : "") << endl;
+}
 
 //=============================================================================
 int main(int argc, char **argv)
 {
     using std::cout;
     using std::endl;
+    // the allocations are counted from before the first one
+    for (int i=1; i<argc; i++) {
+        if (std::strcmp(argv[i], "--alloc") == 0) {
+            allocs.enabled = true;
+        }
+    }
     // Parse agruments
     bool show_help = false;
     // Check that options are valid
@@ -826,9 +8691,29 @@ int main(int argc, char **argv)
     if (input.option_exists("-h")) {
         show_help = true;
     }
+    // many files in one run: "batch" comes first, then the options and the files
+    bool batch = argc > 1 && string(argv[1]).compare("batch") == 0;
+    // multi-file archives: "pack", "unpack" or "list" comes first
+    const string command = (argc > 1) ? argv[1] : "";
+    bool pack = command.compare("pack") == 0;
+    bool unpack = command.compare("unpack") == 0;
+    bool list = command.compare("list") == 0;
+    bool archive_command = pack || unpack || list;
+    // a server of jobs on a Unix socket, and a client that sends it one
+    bool serve = command.compare("serve") == 0;
+    bool client = command.compare("client") == 0;
+    const string socket_path = input.get_option_value("--socket");
+    if ((serve || client) != ! socket_path.empty()) {
+        show_help = true;
+    }
+    // the client sends the file itself rather than its path
+    bool inline_data = input.option_exists("--inline");
+    if (inline_data && ! client) {
+        show_help = true;
+    }
     // input file
     const string infile = input.get_option_value("-i");
-    if (infile.empty()) show_help = true;
+    if (infile.empty() && ! batch && ! archive_command && ! serve) show_help = true;
     // algorithm name
     const string alg = input.get_option_value("-a");
     ALGORITHM algo = ALGORITHM::huffman;
@@ -838,89 +8723,330 @@ int main(int argc, char **argv)
     else if (alg.compare("huffman") == 0) {
         algo = ALGORITHM::huffman;
     }
-    else {
+    else if (alg.compare("auto") == 0) {
+        algo = ALGORITHM::automatic;
+    }
+    else if (! alg.empty()) {
+        show_help = true;
+    }
+    // the algorithm is needed only for encoding, archives record their method
+    if (alg.empty() && infile.find(".txt") != string::npos) {
+        show_help = true;
+    }
+    // context order of the model, only used for encoding
+    const string ord = input.get_option_value("-o");
+    int order = 0;
+    if (ord.compare("1") == 0) {
+        order = 1;
+    }
+    else if (! ord.empty() && ord.compare("0") != 0) {
+        show_help = true;
+    }
+    // transform applied to blocks of text before coding
+    const string trn = input.get_option_value("-t");
+    TRANSFORM transform = TRANSFORM::none;
+    if (trn.compare("bwt") == 0) {
+        transform = TRANSFORM::bwt;
+    }
+    else if (trn.compare("lz77") == 0) {
+        transform = TRANSFORM::lz77;
+    }
+    else if (trn.compare("words") == 0) {
+        transform = TRANSFORM::words;
+    }
+    else if (! trn.empty() && trn.compare("none") != 0) {
+        show_help = true;
+    }
+    // symbols between seek points of the encoded text, 0 - none
+    const string sek = input.get_option_value("-s");
+    uint64_t seek_interval = 0;
+    if (! sek.empty()) {
+        seek_interval = std::strtoull(sek.c_str(), nullptr, 10);
+        if (seek_interval == 0) {
+            show_help = true;
+        }
+    }
+    // decode only the symbols start .. start+len-1
+    const string rng = input.get_option_value("--range");
+    uint64_t range_start = 0;
+    uint64_t range_len = UINT64_MAX;
+    if (! rng.empty()) {
+        string::size_type colon = rng.find(':');
+        if (colon == string::npos || colon == 0 || colon + 1 == rng.size()
+                || rng.find_first_not_of("0123456789:") != string::npos) {
+            show_help = true;
+        } else {
+            range_start = std::strtoull(rng.c_str(), nullptr, 10);
+            range_len = std::strtoull(rng.c_str() + colon + 1, nullptr, 10);
+        }
+    }
+    // a range is only read from an archive
+    if (! rng.empty() && ! alg.empty()) {
+        show_help = true;
+    }
+    // the context is lost after the block sorting
+    if (order != 0 && transform != TRANSFORM::none) {
+        show_help = true;
+    }
+    // auto chooses the order itself
+    if (algo == ALGORITHM::automatic && (! ord.empty() || ! trn.empty())) {
+        show_help = true;
+    }
+    // check the archive checksums without decoding
+    bool test = input.option_exists("--test");
+    if (test && ! alg.empty()) {
+        show_help = true;
+    }
+    // number of worker threads of a batch
+    const string jobs = input.get_option_value("-j");
+    size_t workers = std::max(1u, std::thread::hardware_concurrency());
+    if (! jobs.empty()) {
+        workers = std::strtoull(jobs.c_str(), nullptr, 10);
+        if (workers == 0) {
+            show_help = true;
+        }
+    }
+    // a batch takes its files as arguments, and the profiler is single threaded
+    bool profile = input.option_exists("--profile");
+    if (batch && (! infile.empty() || ! rng.empty() || profile)) {
+        show_help = true;
+    }
+    // bytes of memory the run may take, with a K, M or G suffix
+    const string mem_limit = input.get_option_value("--max-memory");
+    uint64_t max_memory = 0;
+    if (! mem_limit.empty()) {
+        max_memory = MemoryBudget::Parse(mem_limit);
+        if (max_memory == 0) {
+            show_help = true;
+        }
+    }
+    // allocations and peak heap per stage, written to a .mem file next to the .ops
+    bool alloc = input.option_exists("--alloc");
+    // order 0 in one pass, the tree is made of this many bytes of the text
+    const string smp = input.get_option_value("--sample");
+    uint64_t sample_bytes = 0;
+    if (! smp.empty()) {
+        sample_bytes = MemoryBudget::Parse(smp);
+        if (sample_bytes == 0 || order != 0 || transform != TRANSFORM::none
+                || alg.empty() || algo == ALGORITHM::automatic || pack) {
+            show_help = true;
+        }
+    }
+    // number of the member to unpack, all by default
+    const string mem = input.get_option_value("-m");
+    size_t member = SIZE_MAX;
+    if (! mem.empty()) {
+        if (mem.find_first_not_of("0123456789") != string::npos) {
+            show_help = true;
+        } else {
+            member = std::strtoull(mem.c_str(), nullptr, 10);
+        }
+    }
+    // the archive and the files follow the command
+    vector<string> paths;
+    if (archive_command) {
+        paths = input.get_positional({"-a", "-o", "-t", "-s", "-j", "-m", "-i", "--range", "--max-memory", "--sample"});
+        paths.erase(paths.begin());
+        if (! infile.empty() || ! rng.empty() || test || ! ord.empty() || ! trn.empty() || ! sek.empty()
+                || ! mem_limit.empty() || paths.empty() || (! pack && paths.size() != 1)) {
+            show_help = true;
+        }
+        // the members are coded with the tree, without a transform
+        if (pack && (alg.empty() || algo == ALGORITHM::automatic)) {
+            show_help = true;
+        }
+        if (! pack && ! alg.empty()) {
+            show_help = true;
+        }
+    }
+    if (! mem.empty() && ! unpack) {
+        show_help = true;
+    }
+    // the clients give the options of every job
+    if (serve && (! infile.empty() || ! alg.empty() || ! ord.empty() || ! trn.empty() || ! sek.empty()
+                || ! rng.empty() || test || ! smp.empty() || profile)) {
+        show_help = true;
+    }
+    // the profiler is single threaded, and the work is done by the server
+    if (client && (profile || alloc || ! mem_limit.empty())) {
         show_help = true;
     }
+    // the longest message read from the socket, with a K, M or G suffix
+    const string frame_limit = input.get_option_value("--max-frame");
+    uint64_t max_frame = ServeProtocol::default_max_frame;
+    if (! frame_limit.empty()) {
+        max_frame = MemoryBudget::Parse(frame_limit);
+        if (max_frame == 0 || ! (serve || client)) {
+            show_help = true;
+        }
+    }
     if (show_help) {
-        cout << "Usage: program -a (huffman || shennon) -i input_file(.haff || .shan || .txt)" << endl;
+        cout << "Usage: program -a (huffman || shennon || auto) [-o (0 || 1) || -t (none || bwt || lz77 || words)] [-s seek_interval] [--max-memory bytes[K||M||G]] [--profile] [--alloc] -i input_file.txt" << endl;
+        cout << "       program -a (huffman || shennon) --sample bytes[K||M||G] [-s seek_interval] [--profile] [--alloc] -i input_file.txt" << endl;
+        cout << "       program [--test || --range start:len] [--max-memory bytes[K||M||G]] [--profile] [--alloc] -i archive(.haff || .shan || .auto)" << endl;
+        cout << "       program batch [-a ... encoding options] [--test] [--max-memory bytes[K||M||G]] [--alloc] [-j workers] [files... || < file_list]" << endl;
+        cout << "       program pack -a (huffman || shennon) [--alloc] archive.pack [files... || < file_list]" << endl;
+        cout << "       program unpack [-m member] [--profile] [--alloc] archive.pack" << endl;
+        cout << "       program list archive.pack" << endl;
+        cout << "       program serve --socket path [--max-memory bytes[K||M||G]] [--max-frame bytes[K||M||G]] [--alloc] [-j workers]" << endl;
+        cout << "       program client --socket path [--inline] [--max-frame bytes[K||M||G]] [encoding or decoding options] -i file" << endl;
         return -1;
     }
+    // time and hardware counters per stage, printed at the end
+    if (profile) {
+        profiler.Enable();
+    }
+    if (alloc) {
+        allocs.enabled = true;
+        allocs.concurrent = (batch || serve) && workers > 1;
+    }
+
+    JobOptions opt{};
+    opt.has_algo = ! alg.empty();
+    opt.algo = algo;
+    opt.order = order;
+    opt.transform = transform;
+    opt.seek_interval = seek_interval;
+    opt.test = test;
+    opt.whole = rng.empty();
+    opt.range_start = range_start;
+    opt.range_len = range_len;
+    opt.sample_bytes = sample_bytes;
+    if (max_memory > 0) {
+        // what the program takes before any work is not working memory
+        uint64_t base = MemoryBudget::PeakBytes();
+        opt.max_memory = (max_memory > base) ? max_memory - base : 1;
+        if (opt.has_algo) {
+            uint64_t share = opt.max_memory / (batch ? std::max<size_t>(1, workers) : 1);
+            try {
+                MemoryBudget::BlockSize(share, transform, UINT32_MAX);
+            } catch(const std::runtime_error& e) {
+                cout << e.what() << endl;
+                return -1;
+            }
+        }
+    }
+
+    if (serve) {
+        SocketServer server{socket_path, opt, workers, max_frame};
+        return server.Run(cout) ? 0 : -1;
+    }
+
+    if (client) {
+        ServeProtocol::Request req{};
+        req.opt = opt;
+        req.inline_data = inline_data;
+        req.path = infile;
+        if (inline_data) {
+            ifstream in{infile, ios::binary | ios::ate};
+            if (! in) {
+                cout << infile << ": could not open" << endl;
+                return -1;
+            }
+            req.payload.resize(static_cast<uint64_t>(in.tellg()));
+            in.seekg(0, ios::beg);
+            in.read(&req.payload[0], req.payload.size());
+        } else {
+            // the server has a directory of its own
+            std::unique_ptr<char, decltype(&free)> full{realpath(infile.c_str(), nullptr), &free};
+            if (full) {
+                req.path = full.get();
+            }
+        }
+        try {
+            ServeClient conn{socket_path, max_frame};
+            ServeProtocol::Reply rep = conn.Call(req);
+            cout << rep.log;
+            if (rep.ok && inline_data && ! rep.output.empty()) {
+                // named as the job would have named it here
+                string name = infile;
+                string::size_type slash = name.rfind('/');
+                string::size_type dot = name.rfind('.');
+                if (dot != string::npos && (slash == string::npos || dot > slash)) {
+                    name.erase(dot);
+                }
+                ofstream out{name + rep.output, ios::binary | ios::trunc};
+                out.write(rep.payload.data(), rep.payload.size());
+                if (! out) {
+                    cout << name + rep.output << ": could not write" << endl;
+                    return -1;
+                }
+            }
+            return rep.ok ? 0 : -1;
+        } catch(const std::runtime_error& e) {
+            cout << infile << ": " << e.what() << endl;
+            return -1;
+        }
+    }
+
+    if (batch) {
+        // the files are the arguments after "batch", or the lines of stdin
+        vector<string> files = input.get_positional({"-a", "-o", "-t", "-s", "-j", "-i", "--range", "--max-memory", "--sample"});
+        files.erase(files.begin());
+        if (files.empty()) {
+            string line;
+            while (std::getline(std::cin, line)) {
+                if (! line.empty()) {
+                    files.push_back(line);
+                }
+            }
+        }
+        BatchRunner runner{opt, workers};
+        size_t failed = runner.Run(files, cout);
+        if (max_memory > 0) {
+            ReportPeakMemory(max_memory, cout);
+        }
+        return failed > 0 ? -1 : 0;
+    }
+
+    if (archive_command) {
+        const string archive = paths.front();
+        PackJob job{};
+        bool ok = false;
+        // the files are the arguments after the archive, or the lines of stdin
+        vector<string> files(paths.begin() + 1, paths.end());
+        if (pack && files.empty()) {
+            string line;
+            while (std::getline(std::cin, line)) {
+                if (! line.empty()) {
+                    files.push_back(line);
+                }
+            }
+        }
+        try {
+            if (pack) {
+                ok = job.Pack(archive, files, opt, cout);
+            } else if (unpack) {
+                ok = job.Unpack(archive, member, cout);
+            } else {
+                ok = job.List(archive, cout);
+            }
+        } catch(const std::runtime_error& e) {
+            cout << archive << ": " << e.what() << endl;
+            return -1;
+        }
+        if (ok && profiler.enabled) {
+            profiler.Report(cout);
+        }
+        return ok ? 0 : -1;
+    }
 
-    string name = infile;
-    string::size_type ext_txt = infile.find(".txt");
-    string::size_type ext_haff = infile.find(".haff");
-    string::size_type ext_shan = infile.find(".shan");
-
-    // Check for valid combination of options
-    // and do the work in each case
-    if (algo==ALGORITHM::huffman && infile.find(".txt") != string::npos) {
-        name.erase(ext_txt, 4);
-        string fout = name + ".haff";
-        // encode with huffman, write name.haff
-        ops.add(4);
-        ucs4_ifstream rawtext{infile};
-        bit_ofstream outs{fout};
-        EncodeHuffman enc{};
-        enc.Encode(rawtext, outs);
-        rawtext.close();
-        outs.stop_writing();
-        outs.close();
-        // write operations
-        ofstream result{fout + ".ops"};
-        result << ops.operations << endl;
-        result.close();
-    }
-    else if (algo==ALGORITHM::shennon && infile.find(".txt") != string::npos) {
-        name.erase(ext_txt, 4);
-        string fout = name + ".shan";
-        // encode with shennon, write name.shan
-        ops.add(4);
-        ucs4_ifstream rawtext{infile};
-        bit_ofstream outs{fout};
-        EncodeShannon enc{};
-        enc.Encode(rawtext, outs);
-        rawtext.close();
-        outs.stop_writing();
-        outs.close();
-        // write operations
-        ofstream result{fout + ".ops"};
-        result << ops.operations << endl;
-        result.close();
-    }
-    else if (algo==ALGORITHM::huffman && infile.find(".haff") != string::npos) {
-        name.erase(ext_haff, 5);
-        string fout = name + "-unz-h.txt";
-        // decode with huffman, write name-unz-h.txt
-        ops.add(3);
-        bit_ifstream enc_stream{infile};
-        ucs4_ofstream dec_stream{fout};
-        Decoder dec{};
-        dec.Decode(enc_stream, dec_stream);
-        enc_stream.close();
-        dec_stream.close();
-        // write operations
-        ofstream result{fout + ".ops"};
-        result << ops.operations << endl;
-        result.close();
-    }
-    else if (algo==ALGORITHM::shennon && infile.find(".shan") != string::npos) {
-        name.erase(ext_shan, 5);
-        string fout = name + "-unz-s.txt";
-        // decode with shennon, write name-unz-s.txt
-        ops.add(3);
-        bit_ifstream enc_stream{infile};
-        ucs4_ofstream dec_stream{fout};
-        Decoder dec{};
-        dec.Decode(enc_stream, dec_stream);
-        enc_stream.close();
-        dec_stream.close();
-        // write operations
-        ofstream result{fout + ".ops"};
-        result << ops.operations << endl;
-        result.close();
-    }
-    else {
-        cout << "Usage: program -a (huffman || shennon) -i input_file(.haff || .shan || .txt)" << endl;
+    // encode, decode or test the file
+    FileJob job{};
+    try {
+        if (! job.Run(infile, opt, cout)) {
+            return -1;
+        }
+    } catch(const std::runtime_error& e) {
+        cout << infile << ": " << e.what() << endl;
+        return -1;
+    }
+    if (profiler.enabled) {
+        profiler.Report(cout);
+    }
+    if (max_memory > 0) {
+        ReportPeakMemory(max_memory, cout);
     }
     return 0;
 }
+#endif // MYPROG_NO_MAIN